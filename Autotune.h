@@ -0,0 +1,111 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "Socket.h"
+
+class Autotune
+{//chunk of the framed TCP transfer (see FileWorker::useAutotune()) after the bandwidth-delay product:
+ //TCP_INFO is sampled at most once per SampleInterval, the delivery rate times the round trip is smoothed,
+ //the sender's chunk (one send or sendfile, one data frame) follows it and moves only when it is off by
+ //the factor of 2. The socket buffers are left to the kernel: set on the connected socket they turn off
+ //its own autotuning and can't raise the window scale, so they are only watched and logged
+public:
+	//ms
+	static const int SampleInterval = 100;
+	static const int MinChunk = 16 * 1024;
+	static const int MaxChunk = 1024 * 1024;
+private:
+	bool _sending;
+	int _firstChunk;
+	int _chunk;
+	//socket buffer of the side (the kernel's one) at the start and by the last sample
+	int _firstBuffer;
+	int _buffer;
+	//smoothed bandwidth-delay product, bytes
+	long long _product;
+	//the last sample: round trip (us), bytes per second, congestion window
+	long long _rtt;
+	long long _rate;
+	long long _window;
+	//the previous sample: its time (ms), bytes of the transfer by then
+	long long _lastTime;
+	long long _lastBytes;
+	int _samples;
+	int _changes;
+public:
+	Autotune(bool sending, int chunk, int buffer) : _sending(sending), _firstChunk(chunk), _chunk(chunk),
+		_firstBuffer(buffer), _buffer(buffer), _product(0), _rtt(0), _rate(0), _window(0),
+		_lastTime(-1), _lastBytes(0), _samples(0), _changes(0)
+	{
+	}
+
+	bool sample(Socket* socket, long long bytes, long long now)
+	{//bytes - moved by the transfer so far; true if the chunk has changed
+		if (_lastTime < 0 || bytes < _lastBytes)
+		{//the first one or the transfer has gone back (resumed)
+			_lastTime = now;
+			_lastBytes = bytes;
+			return false;
+		}
+		long long elapsed = now - _lastTime;
+		if (elapsed < SampleInterval)
+			return false;
+		long long measured = (bytes - _lastBytes) * 1000 / elapsed;
+		_lastTime = now;
+		_lastBytes = bytes;
+		TcpStats stats;
+		if (!socket->getTcpStats(stats))
+			return false;
+		//the receiver has its own estimate of the round trip, the rate of the sender is the kernel's one
+		long long rtt = (!_sending && stats.receiveRtt > 0) ? stats.receiveRtt : stats.rtt;
+		long long rate = (_sending && stats.deliveryRate > 0) ? stats.deliveryRate : measured;
+		if (rtt <= 0 || rate <= 0)
+			return false;
+		_samples++;
+		_rtt = rtt;
+		_rate = rate;
+		_window = stats.congestionWindow;
+		long long product = rate * rtt / 1000000;
+		_product = (_samples == 1) ? product : (3 * _product + product) / 4;
+
+		//the resumed transfer has the new socket
+		_buffer = _sending ? socket->getSendBufferSize() : socket->getReceiveBufferSize();
+		int chunk = target(_product, MinChunk, MaxChunk);
+		if (!_sending || !offByTwo(chunk, _chunk))
+			return false;
+		_chunk = chunk;
+		_changes++;
+		return true;
+	}
+
+	int chunk()const { return _chunk; }
+
+	ostream& outInfo(ostream& stream)
+	{//the tuned values of the transfer
+		stream << "autotune: ";
+		if (_sending)
+			stream << "chunk " << _firstChunk << " -> " << _chunk << ", send";
+		else
+			stream << "receive";
+		stream << " buffer " << _firstBuffer << " -> " << _buffer << ", rtt " << _rtt << " us, rate "
+			<< _rate / 1000000.0 << " MB/s, cwnd " << _window << ", bdp " << _product << " bytes, "
+			<< _samples << " samples, " << _changes << " changes" << endl;
+		return stream;
+	}
+
+private:
+	static int target(long long bytes, int lowest, int highest)
+	{//power of 2 within the bounds
+		long long value = lowest;
+		while (value < bytes && value < highest)
+			value <<= 1;
+		return (int)std::min<long long>(value, highest);
+	}
+
+	static bool offByTwo(int wanted, int current)
+	{
+		return wanted >= 2LL * current || 2LL * wanted <= current;
+	}
+};
+
+#endif //AUTOTUNE_H
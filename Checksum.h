@@ -0,0 +1,244 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32C_HARDWARE
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32C_TARGET
+#else
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+#endif
+
+class Crc32c
+{//CRC-32C (Castagnoli polynomial, as iSCSI and ext4 have it) of the file chunks.
+ //The crc32 instruction of SSE 4.2 gives 8 bytes per cycle on three independent streams (it has the latency
+ //of 3 cycles), the streams are joined by the tables of the shift operator (M. Adler's method, the work
+ //of PCLMULQDQ in the Intel paper). Without SSE 4.2 - slicing by 8 tables, about 1 GB/s
+public:
+	static uint32_t compute(const void* data, size_t length, uint32_t crc = 0)
+	{//crc - checksum of the preceding bytes (the chunk can be checked piece by piece)
+#ifdef CRC32C_HARDWARE
+		if (accelerated())
+			return hardware(data, length, crc);
+#endif
+		return software(data, length, crc);
+	}
+
+	static uint32_t software(const void* data, size_t length, uint32_t crc = 0)
+	{
+		const Tables& tables = Tables::get();
+		const unsigned char* next = (const unsigned char*)data;
+		uint64_t value = ~crc;
+		for (; length > 0 && ((uintptr_t)next & 7) != 0; length--)
+			value = tables.bytes[0][(value ^ *next++) & 0xFF] ^ (value >> 8);
+		for (; length >= 8; length -= 8, next += 8)
+		{//little endian words
+			uint64_t word;
+			memcpy(&word, next, sizeof(word));
+			word ^= value;
+			value = tables.bytes[7][word & 0xFF] ^ tables.bytes[6][(word >> 8) & 0xFF] ^
+				tables.bytes[5][(word >> 16) & 0xFF] ^ tables.bytes[4][(word >> 24) & 0xFF] ^
+				tables.bytes[3][(word >> 32) & 0xFF] ^ tables.bytes[2][(word >> 40) & 0xFF] ^
+				tables.bytes[1][(word >> 48) & 0xFF] ^ tables.bytes[0][word >> 56];
+		}
+		for (; length > 0; length--)
+			value = tables.bytes[0][(value ^ *next++) & 0xFF] ^ (value >> 8);
+		return ~(uint32_t)value;
+	}
+
+	static bool accelerated()
+	{//SSE 4.2 of the processor
+#ifdef CRC32C_HARDWARE
+		static const bool supported = detect();
+		return supported;
+#else
+		return false;
+#endif
+	}
+
+#ifdef CRC32C_HARDWARE
+	CRC32C_TARGET static uint32_t hardware(const void* data, size_t length, uint32_t crc = 0)
+	{//only if accelerated()
+		const Tables& tables = Tables::get();
+		const unsigned char* next = (const unsigned char*)data;
+		uint64_t crc0 = ~crc;
+		for (; length > 0 && ((uintptr_t)next & 7) != 0; length--)
+			crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+		//three streams of the long blocks, then of the short ones
+		while (length >= LongBlock * 3)
+		{
+			crc0 = streams(tables.longShift, next, LongBlock, crc0);
+			next += LongBlock * 3;
+			length -= LongBlock * 3;
+		}
+		while (length >= ShortBlock * 3)
+		{
+			crc0 = streams(tables.shortShift, next, ShortBlock, crc0);
+			next += ShortBlock * 3;
+			length -= ShortBlock * 3;
+		}
+		for (; length >= 8; length -= 8, next += 8)
+			crc0 = _mm_crc32_u64(crc0, load(next));
+		for (; length > 0; length--)
+			crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+		return ~(uint32_t)crc0;
+	}
+#endif
+
+	static uint32_t combine(uint32_t crc1, uint32_t crc2, long long length2)
+	{//checksum of the two pieces by their checksums, length2 - length of the second one
+		uint32_t op[32];
+		zeros(op, length2);
+		return times(op, crc1) ^ crc2;
+	}
+
+	class Combiner
+	{//combine() of the pieces of the same length in O(1): tables of the shift operator
+	public:
+		explicit Combiner(long long length)
+		{
+			uint32_t op[32];
+			zeros(op, length);
+			fill(_shift, op);
+		}
+
+		uint32_t operator()(uint32_t crc1, uint32_t crc2)const
+		{
+			return shift(_shift, crc1) ^ crc2;
+		}
+
+	private:
+		uint32_t _shift[4][256];
+	};
+
+private:
+	static const uint32_t Polynomial = 0x82F63B78u; //reflected 0x1EDC6F41
+	static const size_t LongBlock = 8192;
+	static const size_t ShortBlock = 256;
+
+	struct Tables
+	{
+		uint32_t bytes[8][256];
+		uint32_t longShift[4][256];
+		uint32_t shortShift[4][256];
+
+		Tables()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t crc = i;
+				for (int bit = 0; bit < 8; bit++)
+					crc = (crc & 1) ? (crc >> 1) ^ Polynomial : crc >> 1;
+				bytes[0][i] = crc;
+			}
+			for (uint32_t i = 0; i < 256; i++)
+				for (int k = 1; k < 8; k++)
+					bytes[k][i] = bytes[0][bytes[k - 1][i] & 0xFF] ^ (bytes[k - 1][i] >> 8);
+			uint32_t op[32];
+			zeros(op, LongBlock);
+			fill(longShift, op);
+			zeros(op, ShortBlock);
+			fill(shortShift, op);
+		}
+
+		static const Tables& get()
+		{//built once (thread-safe static)
+			static const Tables tables;
+			return tables;
+		}
+	};
+
+	//the operators over GF(2): 32 columns, the image of every bit of the register
+	static uint32_t times(const uint32_t* op, uint32_t value)
+	{
+		uint32_t sum = 0;
+		for (int i = 0; value != 0; i++, value >>= 1)
+			if (value & 1)
+				sum ^= op[i];
+		return sum;
+	}
+
+	static void multiply(uint32_t* result, const uint32_t* a, const uint32_t* b)
+	{//result = a(b(x))
+		uint32_t product[32];
+		for (int n = 0; n < 32; n++)
+			product[n] = times(a, b[n]);
+		memcpy(result, product, sizeof(product));
+	}
+
+	static void zeros(uint32_t* op, long long length)
+	{//operator that appends 'length' zero bytes to the register
+		uint32_t power[32];
+		//one zero bit, then one zero byte
+		power[0] = Polynomial;
+		for (int n = 1; n < 32; n++)
+			power[n] = 1u << (n - 1);
+		for (int i = 0; i < 3; i++)
+			multiply(power, power, power);
+		for (int n = 0; n < 32; n++)
+			op[n] = 1u << n;
+		for (; length > 0; length >>= 1)
+		{//power - 2^i zero bytes
+			if (length & 1)
+				multiply(op, power, op);
+			if (length > 1)
+				multiply(power, power, power);
+		}
+	}
+
+	static void fill(uint32_t shift[4][256], const uint32_t* op)
+	{//the operator by bytes of the register
+		for (uint32_t n = 0; n < 256; n++)
+			for (int k = 0; k < 4; k++)
+				shift[k][n] = times(op, n << (8 * k));
+	}
+
+	static uint32_t shift(const uint32_t shift[4][256], uint32_t crc)
+	{
+		return shift[0][crc & 0xFF] ^ shift[1][(crc >> 8) & 0xFF] ^ shift[2][(crc >> 16) & 0xFF] ^ shift[3][crc >> 24];
+	}
+
+#ifdef CRC32C_HARDWARE
+	static uint64_t load(const unsigned char* data)
+	{
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	CRC32C_TARGET static uint64_t streams(const uint32_t shiftTable[4][256], const unsigned char* next, size_t block, uint64_t crc0)
+	{//three blocks at once, the register after all of them
+		uint64_t crc1 = 0, crc2 = 0;
+		const unsigned char* end = next + block;
+		for (; next < end; next += 8)
+		{
+			crc0 = _mm_crc32_u64(crc0, load(next));
+			crc1 = _mm_crc32_u64(crc1, load(next + block));
+			crc2 = _mm_crc32_u64(crc2, load(next + 2 * block));
+		}
+		crc0 = shift(shiftTable, (uint32_t)crc0) ^ crc1;
+		return shift(shiftTable, (uint32_t)crc0) ^ crc2;
+	}
+
+	static bool detect()
+	{//CPUID leaf 1, ECX bit 20
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+	}
+#endif
+};
+
+#endif //CHECKSUM_H
@@ -0,0 +1,132 @@
+#ifndef COMMANDPARSER_H
+#define COMMANDPARSER_H
+
+#include <string>
+#include <cstring>
+
+struct StringRef
+{//characters of the caller's string, nothing is copied (std::string_view is c++17)
+	const char* data;
+	size_t size;
+
+	StringRef() : data(""), size(0) {}
+	StringRef(const char* data, size_t size) : data(data), size(size) {}
+	StringRef(const char* str) : data(str), size(strlen(str)) {}
+	StringRef(const std::string& str) : data(str.data()), size(str.size()) {}
+
+	bool empty()const { return size == 0; }
+	const char* begin()const { return data; }
+	const char* end()const { return data + size; }
+	std::string str()const { return std::string(data, size); }
+
+	StringRef from(size_t pos)const { return pos < size ? StringRef(data + pos, size - pos) : StringRef(end(), 0); }
+	StringRef to(size_t pos)const { return StringRef(data, pos < size ? pos : size); }
+
+	bool operator==(StringRef other)const { return size == other.size && memcmp(data, other.data, size) == 0; }
+	bool operator!=(StringRef other)const { return !(*this == other); }
+};
+
+class CommandParser
+{//command line grammar without std::regex (constructed on every request it was the top hotspot):
+ //	( )*[A-Za-z0-9_]+(( )+(.)+)?(\r\n|\n)
+ //'.' doesn't match the line terminators as in ECMAScript regex
+public:
+	static bool checkFormat(StringRef line)
+	{
+		const char* it = line.begin();
+		const char* end = line.end();
+		//(\r\n|\n)
+		if (it == end || end[-1] != '\n') return false;
+		end--;
+		if (it != end && end[-1] == '\r') end--;
+
+		while (it != end && *it == ' ') it++;
+		const char* word = it;
+		while (it != end && isWordChar(*it)) it++;
+		if (it == word) return false;
+		if (it == end) return true;
+
+		//(( )+(.)+)? - space and at least one more character
+		if (*it != ' ' || end - it < 2) return false;
+		for (; it != end; it++)
+			if (isLineTerminator(*it)) return false;
+		return true;
+	}
+
+	static StringRef command(StringRef line, StringRef& rest)
+	{//first [A-Za-z0-9_]+, rest - the characters after it
+		const char* it = line.begin();
+		while (it != line.end() && !isWordChar(*it)) it++;
+		const char* word = it;
+		while (it != line.end() && isWordChar(*it)) it++;
+		if (it == word)
+		{
+			rest = StringRef();
+			return StringRef();
+		}
+		rest = StringRef(it, line.end() - it);
+		return StringRef(word, it - word);
+	}
+
+	static StringRef fileName(StringRef text)
+	{//first [A-Za-z0-9]+.[A-Za-z0-9]+ (leftmost, greedy as regex_search does)
+		const char* it = text.begin();
+		const char* end = text.end();
+		while (it != end)
+		{
+			if (!isAlnum(*it))
+			{
+				it++;
+				continue;
+			}
+			const char* run = it;
+			while (it != end && isAlnum(*it)) it++;
+			//the longest first part which is followed by any character and a letter (digit)
+			for (const char* dot = it; dot > run; dot--)
+				if (end - dot >= 2 && !isLineTerminator(*dot) && isAlnum(dot[1]))
+				{
+					const char* last = dot + 1;
+					while (last != end && isAlnum(*last)) last++;
+					return StringRef(run, last - run);
+				}
+		}
+		return StringRef();
+	}
+
+	static StringRef afterSpaces(StringRef text)
+	{//the characters after the first ( )+, nothing if there are no spaces
+		const char* it = (const char*)memchr(text.data, ' ', text.size);
+		if (it == nullptr) return StringRef();
+		while (it != text.end() && *it == ' ') it++;
+		return StringRef(it, text.end() - it);
+	}
+
+	static bool contains(StringRef text, StringRef word)
+	{
+		if (word.empty()) return true;
+		for (const char* it = text.begin(); (size_t)(text.end() - it) >= word.size; it++)
+		{
+			it = (const char*)memchr(it, word.data[0], text.end() - it - word.size + 1);
+			if (it == nullptr) return false;
+			if (memcmp(it, word.data, word.size) == 0) return true;
+		}
+		return false;
+	}
+
+	static bool isWordChar(char c)
+	{
+		return isAlnum(c) || c == '_';
+	}
+
+	static bool isAlnum(char c)
+	{//locale independent
+		return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+	}
+
+	static bool isLineTerminator(char c)
+	{
+		return c == '\n' || c == '\r';
+	}
+};
+
+#endif //COMMANDPARSER_H
@@ -0,0 +1,129 @@
+#ifndef COMMANDTABLE_H
+#define COMMANDTABLE_H
+
+#include "CommandParser.h"
+
+#include <vector>
+#include <cstdint>
+
+inline uint32_t commandHash(StringRef name)
+{//FNV-1a of the command name (the table is laid out at run time, once per added command)
+	uint32_t hash = 2166136261u;
+	for (char c : name)
+		hash = (hash ^ (unsigned char)c) * 16777619u;
+	return hash;
+}
+
+template<typename Target>
+class CommandTable
+{//command name -> handler without collisions: one hash, one slot, one name compare per lookup;
+ //the handlers are plain functions calling the member (no std::bind/std::function),
+ //the slots are rebuilt with the new seed when a command is added (subclasses add their own)
+public:
+	typedef bool(*Handler)(Target*, std::string&);
+private:
+	struct Entry
+	{
+		const char* name;
+		size_t length;
+		uint32_t hash;
+		Handler handler;
+	};
+	enum : uint16_t { Empty = 0xFFFF };
+
+	std::vector<Entry> _entries;
+	//index of the entry by the mixed hash
+	std::vector<uint16_t> _slots;
+	uint32_t _seed;
+	int _shift;
+
+	template<typename Owner, bool (Owner::*Method)(std::string&)>
+	static bool call(Target* target, std::string& arguments)
+	{
+		return (static_cast<Owner*>(target)->*Method)(arguments);
+	}
+public:
+	CommandTable() : _seed(0), _shift(32) {}
+
+	template<typename Owner, bool (Owner::*Method)(std::string&)>
+	void add(const char* name)
+	{//name has to live as long as the table (literal)
+		add(name, &CommandTable::call<Owner, Method>);
+	}
+
+	void add(const char* name, Handler handler)
+	{
+		Entry entry;
+		entry.name = name;
+		entry.length = strlen(name);
+		entry.hash = commandHash(StringRef(name, entry.length));
+		entry.handler = handler;
+		for (Entry& existing : _entries)
+			if (existing.length == entry.length && memcmp(existing.name, name, entry.length) == 0)
+			{//redefinition
+				existing.handler = handler;
+				return;
+			}
+		_entries.push_back(entry);
+		rebuild();
+	}
+
+	Handler find(StringRef name)const
+	{
+		int index = indexOf(name);
+		return index < 0 ? nullptr : _entries[index].handler;
+	}
+
+	int indexOf(StringRef name)const
+	{//order of the command's addition, -1 if there is no such command
+		if (_entries.empty()) return -1;
+		uint16_t index = _slots[slot(commandHash(name), _seed)];
+		if (index == Empty) return -1;
+		const Entry& entry = _entries[index];
+		if (entry.length != name.size || memcmp(entry.name, name.data, name.size) != 0)
+			return -1;
+		return index;
+	}
+
+	const char* name(int index)const { return _entries[index].name; }
+
+	Handler handler(int index)const { return _entries[index].handler; }
+
+	size_t size()const { return _entries.size(); }
+
+private:
+
+	uint32_t slot(uint32_t hash, uint32_t seed)const
+	{//multiplicative mixing, the high bits index the slots
+		return _shift == 32 ? 0 : (uint32_t)((hash ^ seed) * 2654435769u) >> _shift;
+	}
+
+	void rebuild()
+	{//first seed without collisions, the table is doubled if the seeds don't help
+		for (int bits = 1; ; bits++)
+		{
+			if (((size_t)1 << bits) < 2 * _entries.size())
+				continue;
+			_shift = 32 - bits;
+			_slots.assign((size_t)1 << bits, Empty);
+			for (_seed = 0; _seed < 256; _seed++)
+				if (place())
+					return;
+		}
+	}
+
+	bool place()
+	{
+		std::fill(_slots.begin(), _slots.end(), Empty);
+		for (size_t i = 0; i < _entries.size(); i++)
+		{
+			uint16_t& cell = _slots[slot(_entries[i].hash, _seed)];
+			if (cell != Empty)
+				return false;
+			cell = (uint16_t)i;
+		}
+		return true;
+	}
+};
+
+#endif //COMMANDTABLE_H
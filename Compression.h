@@ -0,0 +1,170 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+class LzCodec
+{//LZ77 of the LZ4 block format: greedy matches found by the hash of 4 bytes, no entropy coding -
+ //hundreds of MB/s per core, text and CSV shrink several times. A block is compressed alone
+ //(every frame can be decoded by itself, so the transfer is resumed at the frame boundary).
+ //	sequence: token (literals:4 | match - 4:4) [255.. literals] literals offset:2 [255.. match]
+ //	the last sequence has literals only, the last 5 bytes are literals
+public:
+	static size_t compress(const char* source, size_t length, char* destination, size_t capacity)
+	{//the block, 0 if it doesn't fit the capacity (the data doesn't compress well enough)
+		const unsigned char* src = (const unsigned char*)source;
+		unsigned char* out = (unsigned char*)destination;
+		unsigned char* outEnd = out + capacity;
+		//positions of the 4 byte sequences by their hash (every candidate is checked)
+		uint32_t table[1 << HashBits];
+		memset(table, 0, sizeof(table));
+
+		size_t anchor = 0, pos = 0;
+		//the matches begin before it and end before the last literals
+		size_t limit = (length > MinLength) ? length - MinLength : 0;
+		size_t matchEnd = (length > LastLiterals) ? length - LastLiterals : 0;
+		unsigned misses = 0;
+		while (pos < limit)
+		{
+			uint32_t bytes = read32(src + pos);
+			uint32_t& slot = table[hash(bytes)];
+			size_t candidate = slot;
+			slot = (uint32_t)pos;
+			if (candidate >= pos || pos - candidate > MaxOffset || read32(src + candidate) != bytes)
+			{//the data which doesn't repeat is skipped faster
+				pos += 1 + (misses++ >> SkipStrength);
+				continue;
+			}
+			misses = 0;
+			size_t match = MinMatch;
+			while (pos + match < matchEnd && src[candidate + match] == src[pos + match])
+				match++;
+			//the match may begin earlier
+			while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1])
+			{
+				pos--;
+				candidate--;
+				match++;
+			}
+			out = sequence(out, outEnd, src + anchor, pos - anchor, pos - candidate, match);
+			if (out == nullptr)
+				return 0;
+			pos += match;
+			anchor = pos;
+		}
+		out = sequence(out, outEnd, src + anchor, length - anchor, 0, 0);
+		return (out == nullptr) ? 0 : out - (unsigned char*)destination;
+	}
+
+	static bool decompress(const char* source, size_t length, char* destination, size_t rawLength)
+	{//false if the block is not exactly rawLength bytes (it's checked as the foreign data)
+		const unsigned char* in = (const unsigned char*)source;
+		const unsigned char* inEnd = in + length;
+		unsigned char* out = (unsigned char*)destination;
+		unsigned char* outEnd = out + rawLength;
+		while (in < inEnd)
+		{
+			unsigned token = *in++;
+			size_t literals = token >> 4;
+			if (literals == 15 && !readLength(in, inEnd, literals))
+				return false;
+			if (literals > (size_t)(inEnd - in) || literals > (size_t)(outEnd - out))
+				return false;
+			memcpy(out, in, literals);
+			in += literals;
+			out += literals;
+			if (in == inEnd)
+				//the last sequence
+				return out == outEnd;
+
+			if (inEnd - in < 2)
+				return false;
+			size_t offset = in[0] | (in[1] << 8);
+			in += 2;
+			size_t match = token & 15;
+			if (match == 15 && !readLength(in, inEnd, match))
+				return false;
+			match += MinMatch;
+			if (offset == 0 || offset > (size_t)(out - (unsigned char*)destination) || match > (size_t)(outEnd - out))
+				return false;
+			const unsigned char* from = out - offset;
+			if (offset >= match)
+				memcpy(out, from, match);
+			else
+				//the match overlaps itself (repeated bytes)
+				for (size_t i = 0; i < match; i++)
+					out[i] = from[i];
+			out += match;
+		}
+		return false;
+	}
+
+private:
+	static const int HashBits = 14;
+	static const size_t MinMatch = 4;
+	static const size_t LastLiterals = 5;
+	//the last match begins this far from the end at least
+	static const size_t MinLength = 12;
+	static const size_t MaxOffset = 65535;
+	//misses after which the step grows
+	static const unsigned SkipStrength = 6;
+
+	static uint32_t read32(const unsigned char* data)
+	{
+		uint32_t value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	static uint32_t hash(uint32_t sequence)
+	{
+		return (sequence * 2654435761u) >> (32 - HashBits);
+	}
+
+	static unsigned char* writeLength(unsigned char* out, size_t length)
+	{//the part of the length over the 4 bits of the token
+		for (; length >= 255; length -= 255)
+			*out++ = 255;
+		*out++ = (unsigned char)length;
+		return out;
+	}
+
+	static bool readLength(const unsigned char*& in, const unsigned char* inEnd, size_t& length)
+	{
+		unsigned char byte;
+		do
+		{
+			if (in == inEnd)
+				return false;
+			byte = *in++;
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+
+	static unsigned char* sequence(unsigned char* out, unsigned char* outEnd, const unsigned char* literals, size_t literalLength,
+		size_t offset, size_t match)
+	{//the literals and the match (none - the last sequence), nullptr if there is no room
+		size_t room = 1 + literalLength / 255 + 1 + literalLength + 2 + match / 255 + 1;
+		if (room > (size_t)(outEnd - out))
+			return nullptr;
+		size_t matchCode = (match > 0) ? match - MinMatch : 0;
+		*out++ = (unsigned char)((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(matchCode, 15));
+		if (literalLength >= 15)
+			out = writeLength(out, literalLength - 15);
+		memcpy(out, literals, literalLength);
+		out += literalLength;
+		if (match == 0)
+			return out;
+		*out++ = (unsigned char)(offset & 0xFF);
+		*out++ = (unsigned char)(offset >> 8);
+		if (matchCode >= 15)
+			out = writeLength(out, matchCode - 15);
+		return out;
+	}
+};
+
+#endif //COMPRESSION_H
@@ -2,10 +2,87 @@
 #define CONNECTION_H
 
 #include "Socket.h"
-
-class FileWorker
+#include "IoRing.h"
+#include "DatagramBatch.h"
+#include "TransferJournal.h"
+#include "DeltaSync.h"
+#include "Compression.h"
+#include "FileCache.h"
+#include "Pipeline.h"
+#include "Autotune.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "CommandTable.h"
+
+class FileWorker : public IoCompletion
 {
+	//transfer protocol as a state machine: the bytes are pushed to the socket by pump()
+	//and the received ones are fed with consume(), so the same transfer can be driven
+	//by the blocking loop (send(), receive()) or by the event loop over unblocked socket
+public:
+	enum class Status { InProgress, Completed, Failed, ConnectionLost };
+	//file lengths and offsets are 64-bit on the wire since this version (32-bit before)
+	static const int LargeFilesVersion = 2;
+	//UDP datagrams are numbered and acknowledged selectively since this version (stop-and-wait before)
+	static const int SlidingWindowVersion = 3;
+	//TCP payload goes in frames, the progress is an in-band frame when it's asked for (see reportProgress())
+	//since this version (OOB byte after each chunk before)
+	static const int ProgressFramesVersion = 4;
+	//compressed data frames (see useCompression()) since this version
+	static const int CompressedFramesVersion = 5;
+	//checksum frames of the regions and the digest frame of the file (CRC-32C) since this version
+	static const int ChecksummedFramesVersion = 6;
+	//UDP datagrams in flight
+	static const int WindowSize = 64;
+	//later datagrams acknowledged after the hole which make it lost
+	static const unsigned DuplicateThreshold = 3;
+	//pipe capacity requested for splice (the default limit of unprivileged process)
+	static const int PipeSize = 1024 * 1024;
+	//chunks of one io_uring chain
+	static const int ChainChunks = 16;
+	//frame = kind + 32-bit length + body
+	enum FrameKind : char { DataFrame = 'D', ProgressFrame = 'P', CompressedFrame = 'Z', ChecksumFrame = 'C', DigestFrame = 'F' };
+	static const int FrameHeaderSize = 1 + sizeof(unsigned);
+	//payload of one data frame at most (the progress frames go between the data frames)
+	static const int MaxFrameLength = 1024 * 1024;
+	//file bytes of one compressed frame at most: compressed frame = 32-bit file bytes + LzCodec block
+	static const int CompressedChunk = 256 * 1024;
+	//the compressed chunk is smaller than the chunk by this part at least, otherwise it goes as it is
+	static const int CompressionGain = 16;
+	//chunks sent as they are without trying after the incompressible ones (doubled up to it)
+	static const int MaxBypass = 64;
+	//file bytes of one checksum (the durable chunk of the journal): checksum frame = 32-bit region + CRC-32C,
+	//it follows the data of the region, no data frame crosses the region boundary
+	static const int ChecksumRegion = TransferJournal::ChunkSize;
+	static const int ChecksumFrameLength = 2 * sizeof(uint32_t);
+	//corrupted regions of one transfer received again, then it fails
+	static const int MaxVerifyFailures = 3;
+	//blocks of the disk stage (see usePipeline())
+	static const int PipelineDepth = 4;
 private:
+	enum class Stage
+	{
+		Idle,
+		//transmitting side
+		SendHeader,			//confirm (refuse) byte and hint data
+		SendPayload,		//file chunks
+		SendProgress,		//OOB byte with loading percent after each chunk (TCP)
+		AwaitDatagramsAck,	//offsets of tracked datagrams from the receiver (UDP)
+		AwaitBytesCount,	//bytes number that the receiver has got
+		AwaitResumeOffset,	//bytes number that the receiver has got before reconnection
+		//receiving side
+		AwaitConfirm,		//file existance acknowledge
+		ReceiveHeader,		//hint data
+		ReceivePayload,		//file chunks
+		ReceiveProgress,	//loading percent after each chunk (TCP, OOB byte is inline) or in the progress frame
+		ReceiveFrame,		//kind and length of the next frame (TCP, see ProgressFramesVersion)
+		ReceiveCompressed,	//compressed frame (TCP, see CompressedFramesVersion)
+		ReceiveChecksum,	//checksum of the received region (TCP, see ChecksummedFramesVersion)
+		ReceiveDigest,		//checksum of the whole file after the last region
+		AwaitWrites,		//the disk stage writes the rest of the file (see usePipeline())
+		SendBytesCount		//bytes number that has been received
+	};
+
 	//file r/w buffer
 	vector<char> _buffer;
 	int _timeOut;
@@ -15,41 +92,363 @@ private:
 	Socket* _socket;
 	std::function<Socket*(int)> _tryToReconnect;
 	string _fileName;
-	int _fileLength;
+	long long _fileLength;
+	//part of the file transferred as the whole one (see useRange()), -1 - the whole file
+	long long _rangeBegin;
+	long long _rangeLength;
 
 	std::ifstream _rdFile;
 	std::ofstream _wrFile;
+	//sender: the files are taken from the cache (see useCache()), the file in the memory - instead of _rdFile
+	FileCache* _cache;
+	FileCache::Content _content;
+	//buffered TCP transfer: the disk stage in its own thread (see usePipeline()), 0 blocks - none
+	int _pipelineDepth;
+	unique_ptr<ReadAhead> _readAhead;
+	unique_ptr<WriteBehind> _writeBehind;
+	//the disk stage wakes the owner of the transfer driven by the event loop (see useRing()),
+	//nullptr - the transfer is blocking, it waits for the disk stage
+	std::shared_ptr<StageWakeUp> _stageWakeUp;
+	EventHandler* _stageOwner;
+	//descriptor of the file for sendfile/splice (TCP on unix), -1 otherwise
+	int _fileHandle;
+	//socket -> pipe -> file for splice
+	int _pipe[2];
+	int _pipeSize;
+
+	//io_uring of the event loop (TCP on unix, see useRing()), nullptr otherwise
+	IoRing* _ring;
+	//datagrams of the shared UDP socket sent in batches (windowed UDP on linux, see useBatch())
+	DatagramBatch* _batch;
+	//the transfer is recorded by the client id (server's TCP transfers, see useJournal())
+	TransferJournal* _journal;
+	int _journalId;
+	//upload: bytes reported to the journal
+	long long _journaled;
+	EventHandler* _ringOwner;
+	//operations of the chain in flight and what each of them accomplishes
+	vector<IoOperation> _chain;
+	vector<Stage> _chainStages;
+	int _chainLeft;
+	//results of the abandoned chains are ignored
+	unsigned _chainTag;
+	//InProgress until some operation of the chain fails
+	Status _chainFailure;
+	std::shared_ptr<vector<char>> _chainBuffer;
 
 	//totaly number of bytes accurately received
-	int _totallyBytesReceived;
-	int _totallyBytesSend;
+	long long _totallyBytesReceived;
+	long long _totallyBytesSend;
+	//size of the length and offset fields: 4 bytes (old peers) or 8 bytes (see useProtocol())
+	size_t _offsetSize;
+	int _protocolVersion;
 
 	//percent counter
 	int _totalPercent;
 
 	//UDP packet control
-	vector<int> _trackedDatagrams;
+	vector<long long> _trackedDatagrams;
 	//received by receiver
-	vector<int> _receivedDatagrams;
+	vector<long long> _receivedDatagrams;
 	int _nPacks;
+
+	//TCP frames (see useProtocol()): the data frames are pure payload
+	bool _framed;
+	//sender: payload of the current data frame which is not in the chunks yet
+	long long _frameLeft;
+	//sender: the data frame at most (the autotuned chunk)
+	long long _frameLimit;
+	//chunk after TCP_INFO (see useAutotune())
+	bool _autotune;
+	unique_ptr<Autotune> _tuner;
+	//start of the transfer in this process (us) and the bytes moved by then, for the rate (see Metrics)
+	long long _startedAt;
+	long long _startedBytes;
+	//sender: progress frame interval (ms, bytes), 0 - not by the time (bytes)
+	int _progressInterval;
+	long long _progressBytes;
+	//sender: the last progress frame
+	long long _progressTime;
+	long long _progressSent;
+	//sender: the chunks go in compressed frames (see useCompression())
+	bool _compressing;
+	//sender: chunks to send as they are, how many the last incompressible one has made so
+	int _bypassLeft;
+	int _bypassRun;
+	//file bytes and payload bytes on the wire in data and compressed frames, codec time (microseconds)
+	long long _rawBytes;
+	long long _wireBytes;
+	long long _codecTime;
+	int _compressedFrames;
+	vector<char> _codecBuffer;
+	//checksum frames (see useProtocol()): CRC-32C of the regions of the file, computed or verified ones are known
+	bool _checksummed;
+	vector<uint32_t> _regionChecksums;
+	vector<char> _regionKnown;
+	//sender: next region without the checksum frame, the digest frame has been queued
+	long long _regionsAnnounced;
+	bool _digestQueued;
+	//receiver: bytes verified from the beginning of the file, regions which have been corrupted
+	long long _verifiedBytes;
+	int _verifyFailures;
+	//the regions are read by the own stream (the sending one keeps its position)
+	std::ifstream _checkFile;
+	vector<char> _checkBuffer;
+
+	//UDP sliding window (see useProtocol()): datagram = number + chunk, number = offset / _bufLen;
+	//the receiver acknowledges the base and the bitmap of the next WindowSize datagrams
+	bool _windowed;
+	//first not acknowledged (not received) datagram
+	unsigned _windowBase;
+	//next new datagram (sender)
+	unsigned _windowNext;
+	//bit i - datagram _windowBase + 1 + i has been acknowledged (received)
+	uint64_t _windowMask;
+	//sender: last transmission of the datagrams in flight (ms, by number % WindowSize)
+	vector<long long> _sentAt;
+	//sender: the datagram has been transmitted again by the acknowledgement (once, then by timeout)
+	vector<bool> _fastResent;
+	//sender: the last transmission of the datagram is a retransmission, its acknowledgement
+	//is not a round trip sample (Karn's rule)
+	vector<bool> _retransmitted;
+	//sender: lost datagrams to be transmitted again
+	std::deque<unsigned> _resend;
+	//sender: smoothed round trip time and its variation (ms, RFC 6298), -1 - no sample yet;
+	//the timeouts without the acknowledgement double the retransmission time-out (shift);
+	//the last acknowledgement which moved the window
+	long long _roundTrip;
+	long long _roundTripVar;
+	int _backoff;
+	long long _lastAcked;
+	//receiver: datagrams since the last acknowledgement
+	int _unacknowledged;
+	//sender: the wait for the acknowledgement has begun (see Trace.h)
+	TRACE_TICKS(_ackWaitSince);
+
+	Stage _stage;
+	Status _status;
+	//control data to transmit (UDP: one datagram per entry)
+	std::queue<string> _output;
+	size_t _outputPos;
+	//fixed size field collected from the input
+	vector<char> _field;
+	//position in the current file chunk, its bytes (sender without sendfile)
+	int _chunkPos;
+	int _chunkLen;
+	const char* _chunkData;
+	//last pump() has stopped because the socket would block
+	bool _blocked;
+	//time limit of the current waiting stage
+	time_t _deadline;
+	int _waitTimeOut;
+	int _appliedTimeOut;
 public:
-	FileWorker(Socket* socket, std::function<Socket*(int)>& tryToReconnect, int bufLen, int timeOut, int nPacks = 1) : _bufLen(bufLen), _timeOut(timeOut)
+	FileWorker(Socket* socket, std::function<Socket*(int)>& tryToReconnect, int bufLen, int timeOut, int nPacks = 1) : FileWorker(socket, bufLen, timeOut, nPacks)
 	{
-		_socket = socket;
 		_tryToReconnect = tryToReconnect;
+	}
+
+	//without reconnection callback the owner restores the connection itself (see resume())
+	FileWorker(Socket* socket, int bufLen, int timeOut, int nPacks = 1) : _bufLen(bufLen), _timeOut(timeOut)
+	{
+		_socket = socket;
 
 		_totallyBytesReceived = 0;
 		_totallyBytesSend = 0;
 		_fileLength = 0;
+		_rangeBegin = 0;
+		_rangeLength = -1;
+		_offsetSize = sizeof(int);
+		_protocolVersion = 1;
 
 		_totalPercent = 0;
 
+		_nPacks = nPacks;
 		if (_socket->protocol() == IPPROTO_UDP)
 		{
-			_nPacks = nPacks;
 			_trackedDatagrams.reserve(_nPacks);
 			_receivedDatagrams.reserve(_nPacks);
 		}
+
+		_framed = false;
+		_frameLeft = 0;
+		_frameLimit = MaxFrameLength;
+		_autotune = false;
+		_startedAt = _startedBytes = 0;
+		_progressInterval = 0;
+		_progressBytes = 0;
+		_progressTime = _progressSent = 0;
+		_compressing = false;
+		_bypassLeft = _bypassRun = 0;
+		_rawBytes = _wireBytes = _codecTime = 0;
+		_compressedFrames = 0;
+		_checksummed = false;
+		_regionsAnnounced = 0;
+		_digestQueued = false;
+		_verifiedBytes = 0;
+		_verifyFailures = 0;
+
+		_windowed = false;
+		_windowBase = _windowNext = 0;
+		_windowMask = 0;
+		_roundTrip = -1;
+		_roundTripVar = 0;
+		_backoff = 0;
+		_lastAcked = 0;
+		_unacknowledged = 0;
+
+		_stage = Stage::Idle;
+		_status = Status::Failed;
+		_outputPos = 0;
+		_chunkPos = _chunkLen = 0;
+		_blocked = false;
+		_deadline = 0;
+		_waitTimeOut = _appliedTimeOut = 0;
+		_fileHandle = -1;
+		_pipe[0] = _pipe[1] = -1;
+		_pipeSize = 0;
+		_ring = nullptr;
+		_ringOwner = nullptr;
+		_batch = nullptr;
+		_journal = nullptr;
+		_cache = nullptr;
+		_pipelineDepth = 0;
+		_stageWakeUp = std::make_shared<StageWakeUp>();
+		_stageOwner = nullptr;
+		_chunkData = nullptr;
+		_journalId = 0;
+		_journaled = 0;
+		_chainLeft = 0;
+		_chainTag = 0;
+		_chainFailure = Status::InProgress;
+	}
+
+	~FileWorker()
+	{
+		abandonChain();
+		//the disk stage is over before the file is closed
+		_readAhead.reset();
+		_writeBehind.reset();
+		closeFileHandle();
+		//the parked transfer whose client hasn't come back
+		journalEnd();
+	}
+
+	Status status()const { return _status; }
+	bool blocked()const { return _blocked; }
+	bool isSending()const { return _rdFile.is_open() || _content != nullptr; }
+	int protocolVersion()const { return _protocolVersion; }
+
+	void useProtocol(int version)
+	{//negotiated by the peers before the transfer, kept after reconnection
+		_protocolVersion = version;
+		_offsetSize = (version >= LargeFilesVersion) ? sizeof(long long) : sizeof(int);
+		_windowed = version >= SlidingWindowVersion && _socket->protocol() == IPPROTO_UDP;
+		_framed = version >= ProgressFramesVersion && _socket->protocol() == IPPROTO_TCP;
+		_checksummed = _framed && version >= ChecksummedFramesVersion;
+	}
+
+	void reportProgress(int milliseconds, long long bytes)
+	{//framed sender: progress frame after the interval of time or bytes (the first one which ends),
+	 //no progress frames by default - both sides show their own progress
+		_progressInterval = std::max(milliseconds, 0);
+		_progressBytes = std::max(bytes, 0LL);
+	}
+
+	void useCompression(bool compress)
+	{//framed sender of CompressedFramesVersion: the file goes by CompressedChunk in the compressed frames,
+	 //the chunks which don't compress go in the data frames and the next ones are not tried for a while;
+	 //the chunks are decompressed and written as a whole, so the transfer is resumed at their boundaries
+		_compressing = compress;
+	}
+
+	void useRange(long long begin, long long length)
+	{//parallel download: the bytes [begin, begin + length) of the file go as the file of that length,
+	 //the receiver writes them in place (the file is neither truncated nor resized)
+		_rangeBegin = begin;
+		_rangeLength = length;
+	}
+
+	void useCache(FileCache* cache)
+	{//sender: the file in the cache is sent from the memory (no sendfile, no ring), the missed one is read into it
+		_cache = cache;
+	}
+
+	void useAutotune(bool autotune)
+	{//framed TCP: the chunk of the sender follows the bandwidth-delay product measured by TCP_INFO during
+	 //the transfer (see Autotune), the socket buffers are the kernel's; the values are logged at the end
+		_autotune = autotune;
+	}
+
+	void usePipeline(int depth)
+	{//the buffered TCP transfer reads the file ahead (writes it behind) in the thread of the disk stage through
+	 //the ring of depth blocks, the socket is served meanwhile. The transfers with sendfile, splice or io_uring
+	 //don't need it (the kernel reads ahead, the ring doesn't block), so on linux it serves the cached-out and
+	 //the pipeless cases and the windows build has it for every TCP transfer
+		_pipelineDepth = depth;
+	}
+
+	void useJournal(TransferJournal* journal, int clientId)
+	{//the transfer is recorded when the hint data has been exchanged and forgotten when it's over,
+	 //the server restarted in the middle of it resumes it (see restore())
+		if (journal == nullptr || _socket->protocol() != IPPROTO_TCP)
+			return;
+		_journal = journal;
+		_journalId = clientId;
+	}
+
+	bool restore(const TransferJournal::Entry& entry)
+	{//transfer of the previous server run before resume(): the upload continues from the durable offset,
+	 //the download from the one the client tells; false if the file is not the same
+		_fileName = entry.fileName;
+		useProtocol(entry.version);
+		if (entry.rangeLength >= 0)
+			useRange(entry.rangeBegin, entry.rangeLength);
+		_bufLen = entry.bufLen;
+		_timeOut = entry.timeOut;
+		if (_buffer.size() < (size_t)_bufLen)
+			_buffer.resize(_bufLen);
+		if (entry.upload)
+		{
+			_fileLength = entry.fileLength;
+			//the durable chunks have been verified
+			_totallyBytesReceived = _journaled = _verifiedBytes = entry.durable;
+			if (!openForWriting(false))
+				return false;
+			if (!_framed)
+				_socket->setOOBInline();
+		}
+		else if (!openForReading() || _fileLength != entry.fileLength)
+			return false;
+		else
+			openFileHandle();
+		startPipeline();
+		startTuning();
+		metricsBegin();
+		_status = Status::ConnectionLost;
+		_stage = Stage::Idle;
+		return true;
+	}
+
+	void useRing(IoRing* ring, EventHandler* owner)
+	{//TCP transfer driven by the event loop of the ring: the owner is scheduled when the disk stage is ready
+	 //(see usePipeline()); the chunks go through io_uring if it's available, the owner is scheduled
+	 //when the operations are completed
+		if (ring == nullptr || _socket->protocol() != IPPROTO_TCP)
+			return;
+		_stageOwner = owner;
+		_stageWakeUp->attach(&ring->eventLoop(), owner);
+		if (!ring->available())
+			return;
+		_ring = ring;
+		_ringOwner = owner;
+	}
+
+	void useBatch(DatagramBatch* batch)
+	{//the window's datagrams are queued, the owner of the batch flushes it (once per loop iteration)
+		if (batch == nullptr || !batch->available() || (int)_socket->handle() != batch->handle())
+			return;
+		_batch = batch;
 	}
 
 	void trackSendingDatagrams()
@@ -57,25 +456,25 @@ public:
 		if (_trackedDatagrams.size() < _nPacks)
 		{
 			_trackedDatagrams.push_back(_totallyBytesSend);
+			showPercents(cout, percentOfLoading(_totallyBytesSend), 20, '.');
+			_stage = Stage::SendPayload;
 			return;
 		}
-		_socket->setReceiveTimeOut(_timeOut >> 1);
+		//wait for the receiver's offsets
+		TRACE_MARK(_ackWaitSince);
+		wait(Stage::AwaitDatagramsAck, _timeOut >> 1);
+	}
 
-		_receivedDatagrams.resize(_nPacks);
-		int recvRealSize = _socket->receiveArray(_receivedDatagrams.data(), _receivedDatagrams.size());
-		if (recvRealSize != _trackedDatagrams.size())
-		{
-			_receivedDatagrams.clear();
-			_trackedDatagrams.clear();
-			throw runtime_error("connection is lost");
-		}
+	bool checkDatagramsAck()
+	{
+		for (int i = 0; i < _nPacks; i++)
+			_receivedDatagrams.push_back(offsetField(i * _offsetSize));
+		_field.clear();
 		//compare local and remote
-		int areEqual = std::equal(_receivedDatagrams.begin(), _receivedDatagrams.end(), _trackedDatagrams.begin());
+		bool areEqual = std::equal(_receivedDatagrams.begin(), _receivedDatagrams.end(), _trackedDatagrams.begin());
 		_receivedDatagrams.clear();
 		_trackedDatagrams.clear();
-
-		if (!areEqual)
-			throw runtime_error("connection is lost");
+		return areEqual;
 	}
 
 	void trackReceivingDatagrams()
@@ -84,7 +483,10 @@ public:
 			_receivedDatagrams.push_back(_totallyBytesReceived);
 		else
 		{
-			_socket->sendArray(_receivedDatagrams.data(), _receivedDatagrams.size());
+			string offsets;
+			for (long long offset : _receivedDatagrams)
+				offsets += encodeOffset(offset);
+			_output.push(offsets);
 			_receivedDatagrams.clear();
 		}
 	}
@@ -94,7 +496,9 @@ public:
 		//send timeout less than receive timeout
 		if (!_socket->setSendTimeOut(_timeOut / 3)) return false;	//(/4)
 																	//try to set system buffer size = _bufLen
-		if (!_socket->setSendBufferSize(_bufLen)) return false;
+		//(the framed stream keeps the kernel's buffer: no progress bytes to keep close to the payload)
+		if (!_framed && !_socket->setSendBufferSize(_bufLen)) return false;
+		return true;
 	}
 	ostream& outFileInfo(ostream& stream)
 	{
@@ -103,6 +507,14 @@ public:
 		stream << endl;
 		return stream;
 	}
+	ostream& outCompressionInfo(ostream& stream)
+	{//payload of the transfer (the frames sent again after the reconnection are counted again)
+		stream << "compression: " << _rawBytes << " -> " << _wireBytes << " bytes";
+		if (_wireBytes > 0)
+			stream << " (ratio " << (double)_rawBytes / _wireBytes << ")";
+		stream << ", " << _compressedFrames << " compressed frames, codec " << _codecTime / 1000.0 << " ms" << endl;
+		return stream;
+	}
 	void showPercents(ostream& stream, int loadingPercent, int milestone, char placeholder)
 	{
 
@@ -123,337 +535,2106 @@ public:
 		_totalPercent = loadingPercent;
 		return;
 	}
-	bool trackSendPercent()
+	char percentOfLoading(long long bytesWrite)
 	{
-		int loadingPercent = percentOfLoading(_totallyBytesSend);
-		showPercents(cout, loadingPercent, 20, '.');
-		return _socket->send_OOB_byte((char)loadingPercent) == 1;
+		if (_fileLength == 0) return 100;
+		return (char)(((double)bytesWrite / _fileLength) * 100);
 	}
-	bool trackReceivePercent()
+
+	//---------------------------------blocking transfer----------------------------------//
+
+	bool send(string& fileName)
 	{
-		char loadingPercent = 0;
-		if (_socket->recv_OOB_byte(loadingPercent) != 1) return false;
-		showPercents(cout, loadingPercent, 20, '.');
-		return true;
+		beginSend(fileName);
+		return run();
 	}
-	char percentOfLoading(int bytesWrite)
+
+	bool receive(string& fileName)
 	{
-		return (char)(((double)bytesWrite / _fileLength) * 100);
+		beginReceive(fileName);
+		return run();
 	}
-	bool send(string& fileName)
+
+	//---------------------------------transfer steps-------------------------------------//
+
+	bool beginSend(string& fileName)
 	{
 		_fileName = fileName;
-		_rdFile.open(_fileName, ios::in | ios::binary);
+		_status = Status::InProgress;
+		_stage = Stage::SendHeader;
 		//file existance check
-		if (!_rdFile.is_open())
+		if (!openForReading() || _fileLength > maxFileLength())
 		{
-			_socket->sendRefuse();
+			if (isSending())
+				cout << "file is too large for the old protocol" << endl;
+			_rdFile.close();
+			_content.reset();
+			queueOutput((char)0);
 			return false;
 		}
-		else
-			_socket->sendConfirm();
+		queueOutput((char)1);
+		metricsBegin();
 
 		setupSendingSocket();
 		//real system buffer size
 		_bufLen = _socket->getSendBufferSize();
-		//one byte to the OOB data
-		//total size of the transmitting file
-		_fileLength = getFileLength(_rdFile);
+		openFileHandle();
 
-		//send hint data to the receiver
-		if (!_socket->send(_bufLen)) return false;
-		if (!_socket->send(_timeOut)) return  false;
-		if (!_socket->send(_fileLength)) return false;
+		//hint data to the receiver
+		queueOutput(_bufLen);
+		queueOutput(_timeOut);
+		queueOffset(_fileLength);
+		journalBegin();
 
-		if (_buffer.size() < _bufLen)
+		if (_buffer.size() < (size_t)_bufLen)
 			_buffer.resize(_bufLen);
-
-		int fileByteRead = 0;
-		int bytesWrite = 0;
+		startPipeline();
+		startTuning();
 
 		outFileInfo(cout);
+		return true;
+	}
 
-		while (true)
+	void beginReceive(string& fileName)
+	{
+		_fileName = fileName;
+		_status = Status::InProgress;
+		//OOB bytes stay in their places between the chunks
+		if (_socket->protocol() == IPPROTO_TCP && !_framed)
+			_socket->setOOBInline();
+		metricsBegin();
+		//waiting for acknowledge
+		wait(Stage::AwaitConfirm, _timeOut);
+	}
+
+	bool pump(size_t& budget)
+	{//transmit pending data until the socket blocks, the budget is spent or some input is needed
+	 //returns true if the transfer has moved on
+		bool progress = false;
+		_blocked = false;
+		while (_status == Status::InProgress && budget > 0)
 		{
-			try
+			if (_chainLeft > 0)
+				//the ring transmits
+				break;
+			else if (!_output.empty())
 			{
-				//file reading to buffer
-				_rdFile.read(_buffer.data(), _bufLen);
-				fileByteRead = _rdFile.gcount();
-				if (!_rdFile.eof() && _bufLen != fileByteRead)
-					return false;
-
-				bytesWrite = _socket->sendall(_buffer.data(), fileByteRead, 0);
-
-				if (bytesWrite < fileByteRead) cout << "les" << std::flush;
-				if (bytesWrite == SOCKET_ERROR)
-					throw runtime_error("connection is lost");
-
-				_totallyBytesSend += bytesWrite;
-
-				if (_socket->protocol() == IPPROTO_UDP)
-					trackSendingDatagrams();
-				//send OOB byte with loading percent value
-
-				if (_socket->protocol() == IPPROTO_TCP)
+				string& data = _output.front();
+				TRACE_SPAN("send output");
+				int bytesWrite = _socket->send(data.data() + _outputPos, (int)(data.size() - _outputPos));
+				if (!transmitted(bytesWrite)) break;
+				spend(budget, bytesWrite);
+				if ((_outputPos += bytesWrite) == data.size())
 				{
-					if (!trackSendPercent())
-						throw runtime_error("fail to transmit OOB byte");
+					_output.pop();
+					_outputPos = 0;
 				}
+			}
+			else if (_stage == Stage::SendHeader)
+			{
+				if (isSending())
+					startPayload();
 				else
-					showPercents(cout, percentOfLoading(_totallyBytesSend), 20, '.');
-
-				if (_rdFile.eof())
+					finish(Status::Failed);
+			}
+			else if (_stage == Stage::SendPayload && _windowed)
+			{
+				if (!sendDatagram(budget)) break;
+			}
+			else if (_stage == Stage::SendPayload)
+			{
+				if (sendThroughRing())
 				{
-					//timeOut / 2
-					_socket->setReceiveTimeOut(_timeOut);
-					//check bytes that client has received
-					_socket->receive(_totallyBytesReceived);
-					_socket->disableReceiveTimeOut();
-
-					if (_totallyBytesReceived == _fileLength)
-						break;
-					else
-						throw runtime_error("connection is lost");
-
+					progress = true;
+					break;
 				}
-				//send OOB byte
+				if (!sendChunk(budget)) break;
+			}
+			else if (_stage == Stage::SendProgress)
+			{
+				TRACE_SPAN("progress byte");
+				//send OOB byte with loading percent value
+				char loadingPercent = percentOfLoading(_totallyBytesSend);
+				if (!transmitted(_socket->send_OOB_byte(loadingPercent))) break;
+				showPercents(cout, loadingPercent, 20, '.');
+				_stage = Stage::SendPayload;
 			}
-			catch (exception e)
+			else if (_stage == Stage::AwaitWrites)
 			{
-				if (!tryToRestoreConnectionFromTransmittingSide()) break;
+				allReceived();
+				if (_stage == Stage::AwaitWrites)
+					break;
 			}
+			else if (_stage == Stage::SendBytesCount)
+				finish(Status::Completed);
+			else
+				//waiting for input
+				break;
+			progress = true;
 		}
-
-		_rdFile.close();
-		_socket->disableSendTimeOut();
-		return true;
+		return progress;
 	}
 
-	bool receive(string& fileName)
-	{
-		_fileName = fileName;
-		//waiting for acknowledge
-		if (!_socket->receiveAck())
-		{//there is no such file
-			cout << "there is no such file" << endl;
-			return false;
-		}
-		_wrFile.open(_fileName, ios::out | ios::trunc | ios::binary);
-
-		if (!_wrFile.is_open())
-			//can't create file
-			return false;
-
-		//size of data portion
-		if (!_socket->receive(_bufLen)) return false;
-		if (!_socket->receive(_timeOut)) return false;
-		if (!_socket->receive(_fileLength)) return false;
-
-		if (_buffer.size() < _bufLen)
-			_buffer.resize(_bufLen);
-
-		_socket->setReceiveTimeOut(_timeOut >> 2);
-
-		int bytesRead = 0;
-		int rest = 0;
-		outFileInfo(cout);
-		//file writing
-		while (true)
+	size_t consume(const char* data, size_t length)
+	{//handle the received bytes, returns number of bytes the transfer has taken
+		size_t consumed = 0;
+		while (_status == Status::InProgress && consumed < length)
 		{
-			try
+			if (_windowed && consumeWindowed(data, length, consumed))
+				//datagram of the sliding window
+				continue;
+			if (_stage == Stage::AwaitConfirm)
 			{
-				if ((rest = _fileLength - _totallyBytesReceived) < _bufLen)
-					bytesRead = _socket->recvall(_buffer.data(), rest, 0);
-				else
-					bytesRead = _socket->recvall(_buffer.data(), _bufLen, 0);
+				if (data[consumed++] == 0)
+				{//there is no such file
+					cout << "there is no such file" << endl;
+					finish(Status::Failed);
+					break;
+				}
+				if (!openForWriting())
+				{//can't create file
+					finish(Status::Failed);
+					break;
+				}
+				wait(Stage::ReceiveHeader, _timeOut);
+			}
+			else if (_stage == Stage::ReceiveHeader)
+			{
+				if (!collect(data, length, consumed, 2 * sizeof(int) + _offsetSize)) break;
+				//size of data portion
+				_bufLen = field<int>(0);
+				_timeOut = field<int>(sizeof(int));
+				_fileLength = offsetField(2 * sizeof(int));
+				_field.clear();
+				if (_bufLen <= 0 || _fileLength < 0)
+				{//not a header (its datagrams have been lost)
+					finish(Status::Failed);
+					break;
+				}
+				if (_rangeLength >= 0 && _fileLength != _rangeLength)
+				{//the sender has the other file
+					finish(Status::Failed);
+					break;
+				}
+				journalBegin();
 
-				if (bytesRead == SOCKET_ERROR)
-					throw runtime_error("connection is lost");
+				if (_buffer.size() < (size_t)_bufLen)
+					_buffer.resize(_bufLen);
+				startPipeline();
+				startTuning();
 
-				else if (bytesRead == 0)
-					//connection close
+				outFileInfo(cout);
+				if (_fileLength == 0 && !_checksummed)
+					allReceived();
+				else
+					nextChunk();
+			}
+			else if (_stage == Stage::ReceivePayload)
+			{
+				if (!stageHasRoom())
 					break;
-				if (bytesRead < _bufLen) cout << "les";
+				int bytesRead = (int)std::min<size_t>(length - consumed, _chunkLen - _chunkPos);
 				//file writing
-				_wrFile.write(_buffer.data(), bytesRead);
-
-				_totallyBytesReceived += bytesRead;
-
-				if (_socket->protocol() == IPPROTO_UDP)
-					trackReceivingDatagrams();
-				//recv OOB byte with loading percent value
-				//(_socket->protocol() == IPPROTO_TCP) ? trackReceivePercent() : showPercents(cout,percentOfLoading(_totallyBytesReceived),20,'.');
-				if (_socket->protocol() == IPPROTO_TCP)
+				if (!writeFile(_totallyBytesReceived, data + consumed, bytesRead))
 				{
-					if (!trackReceivePercent())
-						throw runtime_error("connection is lostaga");
+					finish(Status::Failed);
+					break;
 				}
-				else
-					showPercents(cout, percentOfLoading(_totallyBytesReceived), 20, '.');
-
-				if (_totallyBytesReceived == _fileLength)
-				{//file uploaded
-				 //transmit to server bytes number that has received
-					_socket->send(_totallyBytesReceived);
+				consumed += bytesRead;
+				payloadReceived(bytesRead);
+			}
+			else if (_stage == Stage::ReceiveProgress)
+			{
+				//OOB byte with loading percent value
+				showPercents(cout, data[consumed++], 20, '.');
+				chunkReceived();
+			}
+			else if (_stage == Stage::ReceiveFrame)
+			{
+				if (!collect(data, length, consumed, FrameHeaderSize)) break;
+				char kind = field<char>(0);
+				long long frameLength = field<unsigned>(1);
+				_field.clear();
+				if (!frameStarted(kind, frameLength))
+				{//not this protocol
+					finish(Status::Failed);
 					break;
 				}
 			}
-			catch (exception e)
+			else if (_stage == Stage::ReceiveCompressed)
 			{
-				if (!tryToRestoreConnectionFromReceivingSide()) break;
+				if (!stageHasRoom() || !collect(data, length, consumed, _chunkLen)) break;
+				if (!compressedReceived())
+				{//corrupted or foreign frame
+					finish(Status::Failed);
+					break;
+				}
 			}
+			else if (_stage == Stage::ReceiveChecksum || _stage == Stage::ReceiveDigest)
+			{
+				//the file is read back when the disk stage has written it
+				if (_writeBehind && _writeBehind->drain(_stageOwner == nullptr) == WriteBehind::Pending)
+					break;
+				if (!collect(data, length, consumed, _chunkLen)) break;
+				bool verified = (_stage == Stage::ReceiveChecksum) ? checksumReceived() : digestReceived();
+				if (!verified)
+				{//the file can't be received correctly
+					finish(Status::Failed);
+					break;
+				}
+			}
+			else if (_stage == Stage::AwaitDatagramsAck)
+			{
+				if (!collect(data, length, consumed, _nPacks * _offsetSize)) break;
+				TRACE_SINCE("ack wait", _ackWaitSince);
+				if (!checkDatagramsAck())
+				{
+					MetricsShard& metrics = Metrics::local();
+					metrics.count(metrics.windowFailures);
+					connectionLost();
+					break;
+				}
+				showPercents(cout, percentOfLoading(_totallyBytesSend), 20, '.');
+				_stage = Stage::SendPayload;
+			}
+			else if (_stage == Stage::AwaitBytesCount)
+			{
+				//check bytes that client has received
+				if (!collect(data, length, consumed, _offsetSize)) break;
+				_totallyBytesReceived = offsetField(0);
+				_field.clear();
+				if (_totallyBytesReceived == _fileLength)
+					finish(Status::Completed);
+				else
+					connectionLost();
+			}
+			else if (_stage == Stage::AwaitResumeOffset)
+			{
+				//get bytes number that client managed to get
+				if (!collect(data, length, consumed, _offsetSize)) break;
+				_totallyBytesReceived = offsetField(0);
+				_field.clear();
+
+				_rdFile.clear();
+				_rdFile.seekg(_rangeBegin + _totallyBytesReceived, ios::beg);
+				_totallyBytesSend = _totallyBytesReceived;
+				_chunkPos = _chunkLen = 0;
+				startPayload();
+			}
+			else
+				//not waiting for input
+				break;
 		}
-
-		_wrFile.close();
-		_socket->disableReceiveTimeOut();
-		return _fileLength == _totallyBytesReceived;
-	}
-
-private:
-
-	bool tryToRestoreConnectionFromReceivingSide()
-	{
-		if ((_socket = _tryToReconnect(_timeOut)) == nullptr)
-		{
-			_wrFile.close();
-			return false;
-		}
-		_socket->setReceiveTimeOut(_timeOut);
-		return _socket->send(_totallyBytesReceived);
+		return consumed;
 	}
 
-	bool tryToRestoreConnectionFromTransmittingSide()
-	{
-		if ((_socket = _tryToReconnect(_timeOut)) == nullptr)
+	void resume(Socket* socket)
+	{//continue the transfer over the restored connection
+		_socket = socket;
+		//the new owner decides (see useRing())
+		_ring = nullptr;
+		_ringOwner = nullptr;
+		leaveOwner();
+		//the batch of the other socket
+		if (_batch != nullptr && _batch->handle() != (int)socket->handle())
+			_batch = nullptr;
+		_status = Status::InProgress;
+		_output = std::queue<string>();
+		_outputPos = 0;
+		_field.clear();
+		_appliedTimeOut = 0;
+
+		if (isSending())
 		{
-			_rdFile.close();
-			return false;
+			setupSendingSocket();
+			_trackedDatagrams.clear();
+			wait(Stage::AwaitResumeOffset, _timeOut);
+			return;
 		}
 
-		setupSendingSocket();
-		//get bytes number that client managed to get
-		_socket->receive(_totallyBytesReceived);
+		_receivedDatagrams.clear();
+		//transmit to the sender bytes number that has received
+		queueOffset(_totallyBytesReceived);
+		if (_totallyBytesReceived == _fileLength && !_checksummed)
+			allReceived();
+		else
+			nextChunk();
+	}
 
-		_rdFile.seekg(_totallyBytesReceived, ios::beg);
+	void interrupt()
+	{//connection is known to be lost
+		if (_status == Status::InProgress)
+			connectionLost();
+	}
 
-		if (_rdFile.eof())
-			_rdFile.clear();
+	bool retransmissionDue()
+	{//UDP sliding window: nothing has been acknowledged for a while,
+	 //the datagrams in flight have to be transmitted again (see sendDatagram())
+		if (_status != Status::InProgress || _stage != Stage::AwaitDatagramsAck || !_windowed ||
+			nowMs() - _lastAcked < retransmissionTimeOut())
+			return false;
+		_stage = Stage::SendPayload;
 		return true;
 	}
 
-	static int getFileLength(std::ifstream& file)
-	{
-		//cursor to the end of file
-		file.seekg(0, ios::end);
-		//get it position
-		int fileEndPos = file.tellg();
-		//cursor to the beginning
-		file.seekg(0, ios::beg);
-		//file length
-		return fileEndPos;
+	bool expired(time_t now)
+	{//waiting stage has run out of time
+		if (_status != Status::InProgress || !expectsInput() || now < _deadline)
+			return false;
+		connectionLost();
+		return true;
 	}
 
-};
-
-
-class Connection
-{
-	//contains mutual data end algorithms for server and client
-protected:
-	//comands and their functions map(dictionary)
-	//реализуемые этими командами (const char* -> std::function<void(string)>)
-	CommandMap _commandMap;
-
-	//id of the client or server
-	int _id;
-	int _bufLen;
-	int _timeOut;
-	virtual void fillCommandMap() = 0;
-
-public:
-	Connection(int bufLen, int timeOut) : _bufLen(bufLen), _timeOut(timeOut)
+	bool expectsInput()const
 	{
-		_id = generateId<int>(0, std::numeric_limits<int>::max());
+		return _output.empty() && (_stage == Stage::AwaitConfirm || _stage == Stage::ReceiveHeader ||
+			_stage == Stage::ReceivePayload || _stage == Stage::ReceiveProgress || _stage == Stage::ReceiveFrame ||
+			_stage == Stage::ReceiveCompressed || _stage == Stage::ReceiveChecksum || _stage == Stage::ReceiveDigest ||
+			_stage == Stage::AwaitDatagramsAck || _stage == Stage::AwaitBytesCount || _stage == Stage::AwaitResumeOffset);
 	}
 
-	virtual ~Connection() {}
-
-protected:
-
-	bool catchCommand(string request)
-	{
-		//identifies command from request
-		string command = cutSuitableSubstring(request, "[A-Za-z0-9_]+");
-		//check command
-		if (checkCommandExistance(command))
+	size_t expectedLength()const
+	{//bytes number the current stage is waiting for
+		switch (_stage)
 		{
-			//command execution
-			return _commandMap[command](request);
-
+		case Stage::AwaitConfirm:
+		case Stage::ReceiveProgress: return 1;
+		case Stage::ReceiveHeader: return 2 * sizeof(int) + _offsetSize - _field.size();
+		case Stage::ReceivePayload: return _chunkLen - _chunkPos;
+		case Stage::ReceiveFrame: return FrameHeaderSize - _field.size();
+		case Stage::ReceiveCompressed:
+		case Stage::ReceiveChecksum:
+		case Stage::ReceiveDigest: return _chunkLen - _field.size();
+		case Stage::AwaitDatagramsAck: return _nPacks * _offsetSize - _field.size();
+		case Stage::AwaitBytesCount:
+		case Stage::AwaitResumeOffset: return _offsetSize - _field.size();
+		default: return 0;
 		}
-		//there is no such command
-		return false;
 	}
 
-	static bool checkStringFormat(const string& message, const string& pattern)
-	{//regexp match
-		std::regex regExp(pattern);
-		return std::regex_match(message, regExp);
+	bool receivesDirectly()const
+	{//the transfer reads the socket itself (see receiveDirectly())
+		return _pipe[0] != -1 && _status == Status::InProgress && expectsInput();
 	}
 
-	bool checkCommandExistance(const string& command)
-	{
-		//command existance check
-		auto it = _commandMap.find(command);
-		return it != _commandMap.end();
-	}
-	//--------------------------find substring-----------------------------//
-	static std::string cutSuitableSubstring(string &message, const string& pattern)
-	{//cut first matching substring from message
-		std::regex regExp(pattern);
-		std::smatch matches;
-		std::regex_search(message, matches, regExp);
+	int receiveDirectly(size_t& budget)
+	{//TCP upload: the payload is spliced from the socket to the file through the pipe,
+	 //the rest is read exactly as expected; returns the result of the socket read
+		if (_stage != Stage::ReceivePayload || _socket->hasBufferedData())
+		{
+			size_t length = expectedLength();
+			if (_buffer.size() < length)
+				_buffer.resize(length);
+			int bytesRead = _socket->receive(_buffer.data(), (int)length);
+			if (bytesRead > 0)
+			{
+				spend(budget, bytesRead);
+				consume(_buffer.data(), bytesRead);
+			}
+			return bytesRead;
+		}
 
-		string result = matches.empty() ? string("") : matches[0];
-		message = matches.suffix().str();
+		int length = std::min(_chunkLen - _chunkPos, _pipeSize);
+		length = (int)std::min<size_t>(length, std::max<size_t>(budget, 1));
+		int bytesRead = _socket->receiveToPipe(_pipe[1], length);
+		if (bytesRead <= 0)
+			return bytesRead;
+		spend(budget, bytesRead);
 
-		return result;
+		//the pipe is drained before the next read
+		for (int bytesLeft = bytesRead; bytesLeft > 0;)
+		{
+#if defined(UNIX)
+			loff_t offset = _rangeBegin + _totallyBytesReceived + (bytesRead - bytesLeft);
+			int bytesWrite = (int)::splice(_pipe[0], NULL, _fileHandle, &offset, bytesLeft, SPLICE_F_MOVE);
+#else
+			int bytesWrite = -1;
+#endif
+			if (bytesWrite <= 0)
+			{
+				finish(Status::Failed);
+				return bytesRead;
+			}
+			bytesLeft -= bytesWrite;
+		}
+		payloadReceived(bytesRead);
+		return bytesRead;
 	}
 
-	static std::string getFirstPatternedSubstring(const string &message, const string& pattern)
-	{//get first substring mathing to pattern 
-		std::regex regExp(pattern);
-		std::smatch matches;
-		std::regex_search(message, matches, regExp);
+	bool receiveThroughRing()
+	{//TCP upload through io_uring: the next chunks with their progress bytes as one chain
+	 //recv -> write -> recv progress -> ..., false if the socket has to be read as usual
+		if (_chainLeft > 0)
+			return true;
+		if (_ring == nullptr || _fileHandle == -1 || isSending() || _writeBehind || _status != Status::InProgress ||
+			(_stage != Stage::ReceivePayload && _stage != Stage::ReceiveProgress) || _socket->hasBufferedData())
+			return false;
 
-		return matches.empty() ? string("") : matches[0];
+		char* data = prepareChain(ChainChunks * (_bufLen + 1));
+		long long offset = _totallyBytesReceived;
+		if (_framed)
+		{//the rest of the data frame, the header of the next frame is read as usual
+			for (int i = 0; i < ChainChunks && _chunkPos + (offset - _totallyBytesReceived) < _chunkLen; i++)
+			{
+				int length = (int)std::min<long long>(_bufLen, _chunkLen - _chunkPos - (offset - _totallyBytesReceived));
+				addToChain(Stage::Idle, IoOperation::Receive, (int)_socket->handle(), data, length, 0, MSG_WAITALL);
+				addToChain(Stage::ReceivePayload, IoOperation::Write, _fileHandle, data, length, _rangeBegin + offset, 0);
+				data += length;
+				offset += length;
+			}
+			_deadline = std::time(NULL) + _waitTimeOut;
+			return submitChain();
+		}
+		//the rest of the current chunk
+		int length = (_stage == Stage::ReceiveProgress) ? 0 : _chunkLen - _chunkPos;
+		for (int i = 0; i < ChainChunks; i++)
+		{
+			if (length > 0)
+			{
+				addToChain(Stage::Idle, IoOperation::Receive, (int)_socket->handle(), data, length, 0, MSG_WAITALL);
+				addToChain(Stage::ReceivePayload, IoOperation::Write, _fileHandle, data, length, _rangeBegin + offset, 0);
+				data += length;
+				offset += length;
+			}
+			//OOB byte is inline
+			addToChain(Stage::ReceiveProgress, IoOperation::Receive, (int)_socket->handle(), data++, 1, 0, 0);
+			if (offset == _fileLength)
+				break;
+			length = chunkLength(offset);
+		}
+		_deadline = std::time(NULL) + _waitTimeOut;
+		return submitChain();
 	}
 
-	//---------------------------------работа с файлами----------------------------------------//
+	void completed(unsigned tag, unsigned index, int result) override
+	{//result of the chain operation
+		if (tag != _chainTag || index >= _chain.size())
+			return;
+		IoOperation& operation = _chain[index];
+		if (result != (int)operation.length)
+		{
+			bool fileFailure = operation.kind == IoOperation::Read || operation.kind == IoOperation::Write;
+			//the rest of the chain is cancelled after the failed operation
+			if (result != -ECANCELED && _chainFailure != Status::Failed)
+				_chainFailure = fileFailure ? Status::Failed : Status::ConnectionLost;
+			else if (_chainFailure == Status::InProgress)
+				_chainFailure = Status::ConnectionLost;
+		}
+		else if (_chainStages[index] == Stage::SendPayload)
+		{
+			_totallyBytesSend += result;
+			_frameLeft -= result;
+		}
+		else if (_chainStages[index] == Stage::ReceivePayload)
+		{
+			_totallyBytesReceived += result;
+			_chunkPos += result;
+			_deadline = std::time(NULL) + _waitTimeOut;
+			journalProgress();
+		}
+		else if (_chainStages[index] == Stage::SendProgress || _chainStages[index] == Stage::ReceiveProgress)
+			showPercents(cout, operation.data[0], 20, '.');
 
-	bool sendFile(Socket* socket, string& message, std::function<Socket*(int)> tryToReconnect)
-	{
-		string fileName = getFirstPatternedSubstring(message, "[A-Za-z0-9]+.[A-Za-z0-9]+");
-		FileWorker fileWorker(socket, tryToReconnect, _bufLen, _timeOut);
-		return fileWorker.send(fileName);
+		if (--_chainLeft == 0)
+			chainCompleted();
 	}
 
-	bool receiveFile(Socket* socket, string& message, std::function<Socket*(int)> tryToReconnect)
-	{
-		string fileName = getFirstPatternedSubstring(message, "[A-Za-z0-9]+.[A-Za-z0-9]+");
-		FileWorker fileWorker(socket, tryToReconnect, _bufLen, _timeOut);
-		return fileWorker.receive(fileName);
+private:
+
+	bool run()
+	{//drive the transfer over the blocking socket
+		while (true)
+		{
+			if (_status == Status::InProgress)
+			{
+				size_t budget = std::numeric_limits<size_t>::max();
+				pump(budget);
+				if (_status == Status::InProgress)
+				{
+					if (expectsInput())
+						receiveInput();
+					else
+						//send timeout is expired
+						connectionLost();
+				}
+			}
+
+			if (_status == Status::ConnectionLost && tryToRestoreConnection())
+				continue;
+			if (_status != Status::InProgress)
+				break;
+		}
+
+		if (_socket != nullptr)
+		{
+			_socket->disableSendTimeOut();
+			_socket->disableReceiveTimeOut();
+		}
+		return _status == Status::Completed;
+	}
+
+	void receiveInput()
+	{
+		//milliseconds, the window waits for the acknowledgements no longer than the retransmission timeout
+		int timeOut = (_windowed && _stage == Stage::AwaitDatagramsAck) ? (int)retransmissionTimeOut() : _waitTimeOut * 1000;
+		if (_appliedTimeOut != timeOut)
+		{
+			_socket->setReceiveTimeOutMs(timeOut);
+			_appliedTimeOut = timeOut;
+		}
+		if (receivesDirectly())
+		{
+			size_t budget = std::numeric_limits<size_t>::max();
+			int bytesRead = receiveDirectly(budget);
+			if (bytesRead == SOCKET_ERROR || bytesRead == 0)
+				connectionLost();
+			return;
+		}
+		//exactly as many bytes as expected: the rest of the stream belongs to the caller,
+		//datagram is read entirely
+		size_t length = expectedLength();
+		if (_socket->protocol() == IPPROTO_UDP)
+			length = std::max(length, _bufLen + sizeof(unsigned));
+		if (_buffer.size() < length)
+			_buffer.resize(length);
+
+		int bytesRead = _socket->receive(_buffer.data(), (int)length);
+		if (bytesRead == SOCKET_ERROR && Socket::wouldBlock() && _stage == Stage::AwaitDatagramsAck && _windowed &&
+			std::time(NULL) < _deadline)
+		{//no acknowledgement for a while: the datagrams in flight are transmitted again
+			_stage = Stage::SendPayload;
+			return;
+		}
+		if (bytesRead == SOCKET_ERROR || bytesRead == 0)
+		{//connection is lost or closed
+			connectionLost();
+			return;
+		}
+		consume(_buffer.data(), bytesRead);
+	}
+
+	bool sendThroughRing()
+	{//TCP download through io_uring: the next chunks with their progress bytes as one chain
+	 //read -> send -> OOB send -> ..., false if the chunk has to be sent as usual
+		if (_ring == nullptr || _fileHandle == -1 || _chunkPos != _chunkLen || _totallyBytesSend >= _fileLength ||
+			(_framed && _frameLeft == 0))
+			return false;
+
+		char* data = prepareChain(ChainChunks * (_bufLen + 1));
+		long long offset = _totallyBytesSend;
+		if (_framed)
+		{//the rest of the data frame (its header has been sent)
+			for (int i = 0; i < ChainChunks && offset < _totallyBytesSend + _frameLeft; i++)
+			{
+				int length = (int)std::min<long long>(_bufLen, _totallyBytesSend + _frameLeft - offset);
+				addToChain(Stage::Idle, IoOperation::Read, _fileHandle, data, length, _rangeBegin + offset, 0);
+				addToChain(Stage::SendPayload, IoOperation::Send, (int)_socket->handle(), data, length, 0, MSG_WAITALL);
+				data += length;
+				offset += length;
+			}
+			return submitChain();
+		}
+		for (int i = 0; i < ChainChunks && offset < _fileLength; i++)
+		{
+			int length = chunkLength(offset);
+			addToChain(Stage::Idle, IoOperation::Read, _fileHandle, data, length, _rangeBegin + offset, 0);
+			addToChain(Stage::SendPayload, IoOperation::Send, (int)_socket->handle(), data, length, 0, MSG_WAITALL);
+			data += length;
+			offset += length;
+			*data = percentOfLoading(offset);
+			addToChain(Stage::SendProgress, IoOperation::Send, (int)_socket->handle(), data++, 1, 0, MSG_OOB);
+		}
+		return submitChain();
+	}
+
+	char* prepareChain(size_t bufferSize)
+	{
+		_chain.clear();
+		_chainStages.clear();
+		//the buffer of the abandoned chain may be still used by the kernel
+		if (!_chainBuffer || _chainBuffer.use_count() > 1)
+			_chainBuffer = std::make_shared<vector<char>>();
+		if (_chainBuffer->size() < bufferSize)
+			_chainBuffer->resize(bufferSize);
+		return _chainBuffer->data();
+	}
+
+	void addToChain(Stage stage, IoOperation::Kind kind, int handle, char* data, int length, long long offset, int flags)
+	{
+		IoOperation operation;
+		operation.kind = kind;
+		operation.handle = handle;
+		operation.data = data;
+		operation.length = length;
+		operation.offset = offset;
+		operation.flags = flags;
+		_chain.push_back(operation);
+		_chainStages.push_back(stage);
+	}
+
+	bool submitChain()
+	{//false if the ring is full
+		_chainTag++;
+		if (!_ring->submit(_chain, this, _ringOwner, _chainTag, _chainBuffer))
+			return false;
+		_chainLeft = (int)_chain.size();
+		_chainFailure = Status::InProgress;
+		return true;
+	}
+
+	void chainCompleted()
+	{
+		Status failure = _chainFailure;
+		_chainFailure = Status::InProgress;
+		if (_status != Status::InProgress)
+			return;
+		if (failure == Status::Failed)
+			finish(Status::Failed);
+		else if (failure == Status::ConnectionLost)
+			connectionLost();
+		else if (isSending())
+		{//whole chunks have been sent
+			_chunkPos = _chunkLen = 0;
+			_stage = Stage::SendPayload;
+		}
+		else if (_framed && _chunkPos < _chunkLen)
+			//the data frame goes on
+			_stage = Stage::ReceivePayload;
+		else
+			chunkReceived();
+	}
+
+	void abandonChain()
+	{//the operations in flight are cancelled, their results are not needed
+		if (_chainLeft == 0)
+			return;
+		_ring->detach(this);
+		_chainLeft = 0;
+		_chainTag++;
+		_chainFailure = Status::InProgress;
+	}
+
+	//---------------------------------UDP sliding window---------------------------------//
+
+	void startPayload()
+	{//from the beginning or from the resume offset
+		_stage = Stage::SendPayload;
+		//the data frame starts at the offset
+		_frameLeft = 0;
+		_progressTime = nowMs();
+		_progressSent = _totallyBytesSend;
+		//the checksum frame of the region which has ended at the offset may be lost with the connection
+		_regionsAnnounced = (_totallyBytesSend > 0) ? (_totallyBytesSend - 1) / ChecksumRegion : 0;
+		_digestQueued = false;
+		if (!_windowed) return;
+		_windowBase = _windowNext = (unsigned)(_totallyBytesSend / _bufLen);
+		_windowMask = 0;
+		_resend.clear();
+		_sentAt.assign(WindowSize, 0);
+		_fastResent.assign(WindowSize, false);
+		_retransmitted.assign(WindowSize, false);
+		_lastAcked = nowMs();
+		_deadline = std::time(NULL) + (_timeOut >> 1);
+	}
+
+	unsigned datagramsNumber()const
+	{
+		return (unsigned)((_fileLength + _bufLen - 1) / _bufLen);
+	}
+
+	bool acknowledged(unsigned number)const
+	{
+		if (number < _windowBase) return true;
+		if (number == _windowBase || number - _windowBase > WindowSize) return false;
+		return ((_windowMask >> (number - _windowBase - 1)) & 1) != 0;
+	}
+
+	bool sendDatagram(size_t& budget)
+	{//lost datagrams first, then the new ones while the window has room
+		long long now = nowMs();
+		if (now - _lastAcked >= retransmissionTimeOut())
+		{//nothing has been acknowledged for a while
+			bool expired = false;
+			for (unsigned number = _windowBase; number < _windowNext; number++)
+				if (!acknowledged(number) && now - _sentAt[number % WindowSize] >= retransmissionTimeOut())
+				{
+					resend(number);
+					expired = true;
+				}
+			_lastAcked = now;
+			if (expired)
+				//no sample comes from the retransmissions, the time-out grows until a new datagram is acknowledged
+				_backoff = std::min(_backoff + 1, 6);
+		}
+		while (!_resend.empty() && acknowledged(_resend.front()))
+			_resend.pop_front();
+
+		unsigned number;
+		if (!_resend.empty())
+			number = _resend.front();
+		else if (_windowNext < datagramsNumber() && _windowNext - _windowBase < WindowSize)
+			number = _windowNext;
+		else
+		{
+			if (_windowBase == datagramsNumber())
+				//the final acknowledgement tells that the receiver has everything (the bytes count may be lost)
+				finish(Status::Completed);
+			else
+			{//deadline is moved by the acknowledgements only
+				TRACE_MARK(_ackWaitSince);
+				_stage = Stage::AwaitDatagramsAck;
+				_waitTimeOut = 1;
+			}
+			return true;
+		}
+
+		long long offset = (long long)number * _bufLen;
+		int length = chunkLength(offset);
+		int datagramLength = length + (int)sizeof(number);
+		//the chunk is read right into the batch
+		char* datagram = (_batch != nullptr) ? _batch->append(_socket->peerAddress(), datagramLength) : nullptr;
+		if (datagram == nullptr)
+		{
+			if (_buffer.size() < (size_t)datagramLength)
+				_buffer.resize(datagramLength);
+			datagram = _buffer.data();
+		}
+		memcpy(datagram, &number, sizeof(number));
+		if (readFile(offset, datagram + sizeof(number), length) != length)
+		{//file has been truncated
+			finish(Status::Failed);
+			return false;
+		}
+		if (datagram == _buffer.data())
+		{
+			TRACE_SPAN("send datagram");
+			int bytesWrite = _socket->send(datagram, datagramLength);
+			if (!transmitted(bytesWrite)) return false;
+		}
+		spend(budget, datagramLength);
+
+		_sentAt[number % WindowSize] = now;
+		if (!_resend.empty() && _resend.front() == number)
+		{
+			_resend.pop_front();
+			_retransmitted[number % WindowSize] = true;
+		}
+		else
+		{
+			_fastResent[number % WindowSize] = false;
+			_retransmitted[number % WindowSize] = false;
+			_windowNext++;
+		}
+		return true;
+	}
+
+	void resend(unsigned number)
+	{
+		if (std::find(_resend.begin(), _resend.end(), number) != _resend.end())
+			return;
+		_resend.push_back(number);
+		MetricsShard& metrics = Metrics::local();
+		metrics.count(metrics.resends);
+	}
+
+	bool consumeWindowed(const char* data, size_t length, size_t& consumed)
+	{//acknowledgement (sender) or numbered chunk (receiver), false if it is not the window's datagram
+		const size_t ackLength = sizeof(unsigned) + sizeof(uint64_t);
+		if (isSending())
+		{
+			bool sending = _stage == Stage::SendPayload || _stage == Stage::AwaitDatagramsAck;
+			if (length - consumed == ackLength && (sending || _stage == Stage::AwaitBytesCount))
+			{//late acknowledgements are dropped
+				if (sending)
+					windowAcknowledged(data + consumed);
+				consumed = length;
+				return true;
+			}
+			if (sending && length - consumed == _offsetSize)
+				//final acknowledgement has been lost, the bytes count follows it
+				_stage = Stage::AwaitBytesCount;
+			return false;
+		}
+		if (_stage != Stage::ReceivePayload)
+			return false;
+		if (length - consumed > sizeof(unsigned))
+			windowReceived(data + consumed, length - consumed);
+		consumed = length;
+		return true;
+	}
+
+	void windowAcknowledged(const char* ack)
+	{
+		unsigned base;
+		uint64_t mask;
+		memcpy(&base, ack, sizeof(base));
+		memcpy(&mask, ack + sizeof(base), sizeof(mask));
+		if (base < _windowBase || base > _windowNext)
+			//reordered (or foreign) acknowledgement
+			return;
+		TRACE_SINCE("ack wait", _ackWaitSince);
+
+		long long now = nowMs();
+		if (base > _windowBase)
+		{//the round trip of the datagram which has moved the window (the others may have been acknowledged before)
+			if (!_retransmitted[_windowBase % WindowSize])
+				roundTripSample(now - _sentAt[_windowBase % WindowSize]);
+			_lastAcked = now;
+			_deadline = std::time(NULL) + (_timeOut >> 1);
+		}
+		_windowBase = base;
+		_windowMask = mask;
+		_totallyBytesSend = std::min(_fileLength, (long long)base * _bufLen);
+		showPercents(cout, percentOfLoading(_totallyBytesSend), 20, '.');
+
+		//the hole is lost when DuplicateThreshold later datagrams have come (as TCP fast retransmit)
+		//or when there has been time for its acknowledgement to come
+		for (int bit = 63; bit >= 0; bit--)
+			if ((mask >> bit) & 1)
+			{
+				unsigned last = base + 1 + bit;
+				for (unsigned number = base; number < last; number++)
+				{
+					if (acknowledged(number))
+						continue;
+					unsigned slot = number % WindowSize;
+					if ((last - number >= DuplicateThreshold && !_fastResent[slot]) ||
+						now - _sentAt[slot] >= retransmissionTimeOut())
+					{
+						_fastResent[slot] = true;
+						resend(number);
+					}
+				}
+				break;
+			}
+		_stage = Stage::SendPayload;
+	}
+
+	void windowReceived(const char* datagram, size_t length)
+	{
+		unsigned number;
+		memcpy(&number, datagram, sizeof(number));
+		long long offset = (long long)number * _bufLen;
+		int chunkLen = (int)(length - sizeof(number));
+		bool duplicate = acknowledged(number);
+		if (!duplicate && number - _windowBase <= WindowSize && offset < _fileLength && chunkLen == chunkLength(offset))
+		{
+			if (!writeFile(offset, datagram + sizeof(number), chunkLen))
+			{
+				finish(Status::Failed);
+				return;
+			}
+			if (number == _windowBase)
+			{//the window moves over the received datagrams
+				_windowBase++;
+				for (; _windowMask & 1; _windowMask >>= 1)
+					_windowBase++;
+				_windowMask >>= 1;
+			}
+			else
+				_windowMask |= (uint64_t)1 << (number - _windowBase - 1);
+			_totallyBytesReceived = std::min(_fileLength, (long long)_windowBase * _bufLen);
+			_deadline = std::time(NULL) + _waitTimeOut;
+			showPercents(cout, percentOfLoading(_totallyBytesReceived), 20, '.');
+		}
+
+		//the holes and the duplicates are reported at once
+		bool complete = _totallyBytesReceived == _fileLength;
+		if (++_unacknowledged >= 4 || _windowMask != 0 || duplicate || complete)
+		{
+			string ack((const char*)&_windowBase, sizeof(_windowBase));
+			ack.append((const char*)&_windowMask, sizeof(_windowMask));
+			_output.push(ack);
+			if (complete)
+				//the sender waits for it, nothing would be retransmitted if it's lost
+				_output.push(ack);
+			_unacknowledged = 0;
+		}
+		if (complete)
+			allReceived();
+	}
+
+	void roundTripSample(long long roundTrip)
+	{//RFC 6298 (2.2, 2.3) with the clock granularity of 1 ms
+		if (_roundTrip < 0)
+		{
+			_roundTrip = roundTrip;
+			_roundTripVar = roundTrip / 2;
+		}
+		else
+		{
+			_roundTripVar = (3 * _roundTripVar + std::abs(_roundTrip - roundTrip)) / 4;
+			_roundTrip = (7 * _roundTrip + roundTrip) / 8;
+		}
+		_backoff = 0;
+	}
+
+	long long retransmissionTimeOut()const
+	{//srtt + 4 * rttvar, the maximum before the first sample (RFC 6298 2.1, 2.3, 5.5)
+		const long long MinTimeOut = 20, MaxTimeOut = 1000;
+		if (_roundTrip < 0)
+			return MaxTimeOut;
+		long long timeOut = _roundTrip + std::max<long long>(1, 4 * _roundTripVar);
+		return std::min<long long>(std::max<long long>(timeOut, MinTimeOut) << _backoff, MaxTimeOut);
+	}
+
+	static long long nowMs()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static long long nowUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	bool tryToRestoreConnection()
+	{
+		MetricsShard& metrics = Metrics::local();
+		metrics.count(metrics.reconnects);
+		Socket* socket = _tryToReconnect ? _tryToReconnect(_timeOut) : nullptr;
+		if (socket == nullptr)
+		{
+			metrics.count(metrics.reconnectFailures);
+			_socket = nullptr;
+			finish(Status::Failed);
+			return false;
+		}
+		resume(socket);
+		return true;
+	}
+
+	bool sendChunk(size_t& budget)
+	{
+		if (_chunkPos == _chunkLen)
+		{
+			if (_checksummed && !queueChecksums())
+				return false;
+			if (_checksummed && _totallyBytesSend >= _fileLength && !_digestQueued)
+			{//the digest goes after the last checksum
+				queueDigest();
+				return true;
+			}
+			if (_totallyBytesSend >= _fileLength)
+			{//check bytes that client has received
+				wait(Stage::AwaitBytesCount, _timeOut);
+				return true;
+			}
+			if (_framed && _frameLeft == 0 && _compressing && _protocolVersion >= CompressedFramesVersion)
+				//the whole frames go through the output
+				return sendCompressedFrame();
+			if (_framed && _frameLeft == 0)
+			{//the headers go through the output
+				startFrame();
+				return true;
+			}
+			_chunkPos = 0;
+			if (_fileHandle != -1)
+				//sendfile reads the file itself, from the offset (the whole data frame at once)
+				_chunkLen = _framed ? (int)_frameLeft : chunkLength(_totallyBytesSend);
+			else
+			{
+				int length = chunkLength(_totallyBytesSend);
+				if (_framed)
+					length = (int)std::min<long long>(length, _frameLeft);
+				if (_readAhead)
+				{//the disk stage has read it or the owner is scheduled when it has
+					_chunkLen = _readAhead->acquire(_totallyBytesSend, length, _chunkData, _stageOwner == nullptr);
+					if (_chunkLen == ReadAhead::Pending)
+					{
+						_chunkLen = 0;
+						return false;
+					}
+				}
+				else
+				{
+					//file reading to buffer
+					_chunkLen = readFile(_totallyBytesSend, _buffer.data(), length);
+					_chunkData = _buffer.data();
+				}
+			}
+			if (_chunkLen <= 0)
+			{//file has been truncated
+				finish(Status::Failed);
+				return false;
+			}
+		}
+
+		TRACE_TICKS(sendStart);
+		TRACE_MARK(sendStart);
+		int bytesWrite = (_fileHandle != -1)
+			? _socket->sendFile(_fileHandle, _rangeBegin + _totallyBytesSend, _chunkLen - _chunkPos)
+			: _socket->send(_chunkData + _chunkPos, _chunkLen - _chunkPos);
+		TRACE_SINCE("send", sendStart);
+		if (bytesWrite == 0)
+		{//file has been truncated
+			finish(Status::Failed);
+			return false;
+		}
+		if (!transmitted(bytesWrite)) return false;
+		spend(budget, bytesWrite);
+		_chunkPos += bytesWrite;
+		_totallyBytesSend += bytesWrite;
+		if (_framed)
+			_frameLeft -= bytesWrite;
+
+		if (_chunkPos == _chunkLen)
+		{
+			if (_readAhead)
+				//the block can be filled again
+				_readAhead->release(_chunkLen);
+			if (_socket->protocol() == IPPROTO_UDP)
+				trackSendingDatagrams();
+			else if (_framed)
+				showPercents(cout, percentOfLoading(_totallyBytesSend), 20, '.');
+			else
+				_stage = Stage::SendProgress;
+		}
+		return true;
+	}
+
+	void startFrame()
+	{//progress frame if it's time for it, then the header of the next data frame
+		tune();
+		queueProgress();
+		_frameLeft = std::min<long long>(_frameLimit, _fileLength - _totallyBytesSend);
+		if (_progressBytes > 0)
+			//the progress frame goes right after the interval
+			_frameLeft = std::min(_frameLeft, std::max(_progressSent + _progressBytes - _totallyBytesSend, 1LL));
+		if (_checksummed)
+			_frameLeft = std::min(_frameLeft, regionLeft(_totallyBytesSend));
+		queueFrame(DataFrame, (unsigned)_frameLeft);
+	}
+
+	void queueProgress()
+	{//progress frame if it's time for it
+		long long now = nowMs();
+		if ((_progressInterval > 0 && now - _progressTime >= _progressInterval) ||
+			(_progressBytes > 0 && _totallyBytesSend - _progressSent >= _progressBytes))
+		{
+			queueFrame(ProgressFrame, 1);
+			queueOutput(percentOfLoading(_totallyBytesSend));
+			_progressTime = now;
+			_progressSent = _totallyBytesSend;
+		}
+	}
+
+	bool sendCompressedFrame()
+	{//the next chunk in the compressed frame or in the data frame (it doesn't compress),
+	 //the file is read from the offset (sendfile and the ring don't keep the stream's position)
+		queueProgress();
+		int length = (int)std::min<long long>(CompressedChunk, _fileLength - _totallyBytesSend);
+		if (_checksummed)
+			length = (int)std::min<long long>(length, regionLeft(_totallyBytesSend));
+		if (_buffer.size() < (size_t)length)
+			_buffer.resize(length);
+		if (readFile(_totallyBytesSend, _buffer.data(), length) != length)
+		{//file has been truncated
+			finish(Status::Failed);
+			return false;
+		}
+
+		size_t compressed = 0;
+		if (_bypassLeft > 0)
+			_bypassLeft--;
+		else
+		{
+			size_t capacity = length - length / CompressionGain;
+			if (_codecBuffer.size() < capacity)
+				_codecBuffer.resize(capacity);
+			long long start = nowUs();
+			compressed = LzCodec::compress(_buffer.data(), length, _codecBuffer.data(), capacity);
+			_codecTime += nowUs() - start;
+			//the incompressible data (archives, media) is not tried for longer and longer
+			_bypassRun = (compressed == 0) ? std::min(std::max(2 * _bypassRun, 1), (int)MaxBypass) : 0;
+			_bypassLeft = _bypassRun;
+		}
+		if (compressed > 0)
+		{
+			unsigned rawLength = (unsigned)length;
+			queueFrame(CompressedFrame, (unsigned)(sizeof(rawLength) + compressed));
+			string frame((const char*)&rawLength, sizeof(rawLength));
+			frame.append(_codecBuffer.data(), compressed);
+			_output.push(frame);
+			_wireBytes += frame.size();
+			_compressedFrames++;
+		}
+		else
+		{
+			queueFrame(DataFrame, (unsigned)length);
+			_output.push(string(_buffer.data(), length));
+			_wireBytes += length;
+		}
+		_rawBytes += length;
+		_totallyBytesSend += length;
+		showPercents(cout, percentOfLoading(_totallyBytesSend), 20, '.');
+		tune();
+		return true;
+	}
+
+	bool compressedReceived()
+	{//the whole compressed frame is in the field: the chunk is written at once
+		unsigned rawLength = field<unsigned>(0);
+		if (rawLength == 0 || rawLength > (unsigned)CompressedChunk || rawLength > _fileLength - _totallyBytesReceived)
+			return false;
+		if (_codecBuffer.size() < rawLength)
+			_codecBuffer.resize(rawLength);
+		long long start = nowUs();
+		bool decoded = LzCodec::decompress(_field.data() + sizeof(rawLength), _field.size() - sizeof(rawLength), _codecBuffer.data(), rawLength);
+		_codecTime += nowUs() - start;
+		_wireBytes += _field.size();
+		_field.clear();
+		if (!decoded || !writeFile(_totallyBytesReceived, _codecBuffer.data(), rawLength))
+			return false;
+		_rawBytes += rawLength;
+		_compressedFrames++;
+		_chunkPos = _chunkLen;
+		_totallyBytesReceived += rawLength;
+		_deadline = std::time(NULL) + _waitTimeOut;
+		journalProgress();
+		chunkReceived();
+		return true;
+	}
+
+	void queueFrame(char kind, unsigned length)
+	{
+		string header(1, kind);
+		header.append((const char*)&length, sizeof(length));
+		_output.push(header);
+	}
+
+	long long regionLeft(long long offset)const
+	{//bytes to the end of the checksum region
+		return ChecksumRegion - offset % ChecksumRegion;
+	}
+
+	int regionLength(size_t region)const
+	{
+		return (int)std::min<long long>(ChecksumRegion, _fileLength - (long long)region * ChecksumRegion);
+	}
+
+	bool regionChecksum(size_t region, uint32_t& checksum)
+	{//CRC-32C of the region of the file (what it has on the disk), false if it can't be read
+		size_t regions = (size_t)((_fileLength + ChecksumRegion - 1) / ChecksumRegion);
+		if (_regionChecksums.size() != regions)
+		{
+			_regionChecksums.assign(regions, 0);
+			_regionKnown.assign(regions, 0);
+		}
+		if (_regionKnown[region])
+		{
+			checksum = _regionChecksums[region];
+			return true;
+		}
+		if (_content)
+		{
+			checksum = Crc32c::compute(_content->data() + _rangeBegin + (long long)region * ChecksumRegion, regionLength(region));
+			return true;
+		}
+		if (_writeBehind && _writeBehind->drain(true) != WriteBehind::Drained)
+			return false;
+		if (_wrFile.is_open())
+			_wrFile.flush();
+		if (!_checkFile.is_open())
+			_checkFile.open(_fileName, ios::in | ios::binary);
+		_checkFile.clear();
+		_checkFile.seekg(_rangeBegin + (long long)region * ChecksumRegion, ios::beg);
+		if (_checkBuffer.empty())
+			_checkBuffer.resize(CompressedChunk);
+		checksum = 0;
+		for (int left = regionLength(region); left > 0;)
+		{
+			int length = std::min(left, (int)_checkBuffer.size());
+			_checkFile.read(_checkBuffer.data(), length);
+			if (_checkFile.gcount() != length)
+				return false;
+			checksum = Crc32c::compute(_checkBuffer.data(), length, checksum);
+			left -= length;
+		}
+		return true;
+	}
+
+	bool fileDigest(uint32_t& digest)
+	{//CRC-32C of the whole file by the checksums of the regions
+		static const Crc32c::Combiner appendRegion(ChecksumRegion);
+		digest = 0;
+		for (size_t region = 0; (long long)region * ChecksumRegion < _fileLength; region++)
+		{
+			uint32_t checksum;
+			if (!regionChecksum(region, checksum))
+				return false;
+			int length = regionLength(region);
+			digest = (length == ChecksumRegion) ? appendRegion(digest, checksum) : Crc32c::combine(digest, checksum, length);
+		}
+		return true;
+	}
+
+	bool queueChecksums()
+	{//sender: checksum frames of the regions which have been sent, false if the file can't be read
+		for (; _regionsAnnounced * ChecksumRegion < _fileLength &&
+			std::min<long long>((_regionsAnnounced + 1) * ChecksumRegion, _fileLength) <= _totallyBytesSend; _regionsAnnounced++)
+		{
+			uint32_t checksum;
+			if (!regionChecksum((size_t)_regionsAnnounced, checksum))
+			{//file has been truncated
+				finish(Status::Failed);
+				return false;
+			}
+			_regionKnown[(size_t)_regionsAnnounced] = 1;
+			_regionChecksums[(size_t)_regionsAnnounced] = checksum;
+			queueFrame(ChecksumFrame, ChecksumFrameLength);
+			queueOutput((uint32_t)_regionsAnnounced);
+			queueOutput(checksum);
+		}
+		return true;
+	}
+
+	void queueDigest()
+	{
+		uint32_t digest;
+		if (!fileDigest(digest))
+		{
+			finish(Status::Failed);
+			return;
+		}
+		queueFrame(DigestFrame, sizeof(digest));
+		queueOutput(digest);
+		_digestQueued = true;
+	}
+
+	bool checksumReceived()
+	{//the region is compared with the file, the corrupted one is received again:
+	 //the connection is dropped and the sender resumes from the region; false if the frame is not valid
+		size_t region = field<uint32_t>(0);
+		uint32_t expected = field<uint32_t>(sizeof(uint32_t));
+		_field.clear();
+		long long begin = (long long)region * ChecksumRegion;
+		if (begin >= _fileLength || begin + regionLength(region) > _totallyBytesReceived)
+			//the region hasn't been received
+			return false;
+		uint32_t checksum;
+		if (!regionChecksum(region, checksum))
+			return false;
+		if (checksum != expected)
+		{
+			cout << "region " << region << " is corrupted" << endl;
+			_regionKnown[region] = 0;
+			if (++_verifyFailures > MaxVerifyFailures)
+				return false;
+			_totallyBytesReceived = begin;
+			_verifiedBytes = std::min(_verifiedBytes, begin);
+			connectionLost();
+			return true;
+		}
+		_regionKnown[region] = 1;
+		_regionChecksums[region] = checksum;
+		if (begin <= _verifiedBytes)
+			_verifiedBytes = std::max(_verifiedBytes, begin + regionLength(region));
+		journalProgress();
+		nextChunk();
+		return true;
+	}
+
+	bool digestReceived()
+	{//the whole file has been received: the checksums of all regions are known
+		uint32_t expected = field<uint32_t>(0);
+		_field.clear();
+		uint32_t digest;
+		if (_totallyBytesReceived != _fileLength || !fileDigest(digest))
+			return false;
+		if (digest != expected)
+		{
+			cout << "file digest doesn't match" << endl;
+			return false;
+		}
+		allReceived();
+		return true;
+	}
+
+	bool frameStarted(char kind, long long frameLength)
+	{//header of the frame has been received, false if it's not a valid frame
+		if (kind == ProgressFrame && frameLength == 1)
+			_stage = Stage::ReceiveProgress;
+		else if (kind == DataFrame && frameLength > 0 && frameLength <= _fileLength - _totallyBytesReceived &&
+			frameLength <= std::numeric_limits<int>::max())
+		{
+			_chunkPos = 0;
+			_chunkLen = (int)frameLength;
+			_stage = Stage::ReceivePayload;
+			_rawBytes += frameLength;
+			_wireBytes += frameLength;
+		}
+		else if (kind == CompressedFrame && _protocolVersion >= CompressedFramesVersion &&
+			frameLength > (long long)sizeof(unsigned) && frameLength <= (long long)sizeof(unsigned) + CompressedChunk)
+		{//collected as a whole
+			_chunkPos = 0;
+			_chunkLen = (int)frameLength;
+			_stage = Stage::ReceiveCompressed;
+		}
+		else if (kind == ChecksumFrame && _checksummed && frameLength == ChecksumFrameLength)
+		{
+			_chunkPos = 0;
+			_chunkLen = (int)frameLength;
+			_stage = Stage::ReceiveChecksum;
+		}
+		else if (kind == DigestFrame && _checksummed && frameLength == (long long)sizeof(uint32_t))
+		{
+			_chunkPos = 0;
+			_chunkLen = (int)frameLength;
+			_stage = Stage::ReceiveDigest;
+		}
+		else
+			return false;
+		return true;
+	}
+
+	void payloadReceived(int bytesRead)
+	{
+		_chunkPos += bytesRead;
+		_totallyBytesReceived += bytesRead;
+		_deadline = std::time(NULL) + _waitTimeOut;
+		journalProgress();
+
+		if (_chunkPos == _chunkLen)
+		{
+			if (_socket->protocol() == IPPROTO_UDP || _framed)
+				chunkReceived();
+			else
+				_stage = Stage::ReceiveProgress;
+		}
+	}
+
+	void chunkReceived()
+	{
+		tune();
+		if (_socket->protocol() == IPPROTO_UDP)
+			trackReceivingDatagrams();
+		if (_socket->protocol() == IPPROTO_UDP || _framed)
+			//the receiver's own progress (the sender doesn't tell it)
+			showPercents(cout, percentOfLoading(_totallyBytesReceived), 20, '.');
+
+		if (_totallyBytesReceived == _fileLength && !_checksummed)
+			allReceived();
+		else
+			//the checksum frames and the digest frame follow
+			nextChunk();
+	}
+
+	void nextChunk()
+	{
+		if (_windowed)
+		{//the datagrams go in any order
+			_windowBase = (unsigned)(_totallyBytesReceived / _bufLen);
+			_windowMask = 0;
+			_unacknowledged = 0;
+			//room for the whole window
+			int windowBytes = 2 * WindowSize * (_bufLen + (int)sizeof(unsigned));
+			if (_socket->getReceiveBufferSize() < windowBytes)
+				_socket->setReceiveBufferSize(windowBytes);
+			wait(Stage::ReceivePayload, _timeOut >> 2);
+			return;
+		}
+		if (_framed)
+		{//the length comes with the frame
+			_chunkPos = _chunkLen = 0;
+			wait(Stage::ReceiveFrame, _timeOut >> 2);
+			return;
+		}
+		_chunkPos = 0;
+		_chunkLen = chunkLength(_totallyBytesReceived);
+		wait(Stage::ReceivePayload, _timeOut >> 2);
+	}
+
+	void allReceived()
+	{//file uploaded
+	 //transmit to sender bytes number that has received (the disk stage has written them)
+		int drained = _writeBehind ? _writeBehind->drain(_stageOwner == nullptr) : WriteBehind::Drained;
+		if (drained == WriteBehind::Failed)
+		{
+			finish(Status::Failed);
+			return;
+		}
+		if (drained == WriteBehind::Pending)
+		{//the owner is scheduled when the rest is written (see pump())
+			_stage = Stage::AwaitWrites;
+			return;
+		}
+		queueOffset(_totallyBytesReceived);
+		_stage = Stage::SendBytesCount;
+	}
+
+	void wait(Stage stage, int timeOut)
+	{
+		_stage = stage;
+		_waitTimeOut = timeOut;
+		_deadline = std::time(NULL) + timeOut;
+	}
+
+	bool transmitted(int bytesWrite)
+	{//false if nothing has been sent
+		if (bytesWrite != SOCKET_ERROR)
+			return true;
+		if (Socket::wouldBlock())
+			_blocked = true;
+		else
+			connectionLost();
+		return false;
+	}
+
+	void connectionLost()
+	{//the transfer can be continued after reconnection only when the hint data has been exchanged
+		abandonChain();
+		leaveOwner();
+		bool resumable = _stage != Stage::SendHeader && _stage != Stage::AwaitConfirm && _stage != Stage::ReceiveHeader;
+		if (resumable)
+			_status = Status::ConnectionLost;
+		else
+			finish(Status::Failed);
+	}
+
+	void finish(Status status)
+	{
+		abandonChain();
+		leaveOwner();
+		journalEnd();
+		if (_startedAt > 0 && (_status == Status::InProgress || _status == Status::ConnectionLost))
+		{//the transfer which has run in this process
+			long long moved = (isSending() ? _totallyBytesSend : _totallyBytesReceived) - _startedBytes;
+			Metrics::local().transferEnded(status == Status::Completed, moved, Metrics::nowUs() - _startedAt);
+		}
+		if (status == Status::Completed && (_compressing || _compressedFrames > 0))
+			outCompressionInfo(cout);
+		if (_tuner)
+			_tuner->outInfo(cout);
+		_tuner.reset();
+		_status = status;
+		_stage = Stage::Idle;
+		_readAhead.reset();
+		_writeBehind.reset();
+		_rdFile.close();
+		_content.reset();
+		_wrFile.close();
+		closeFileHandle();
+	}
+
+	void metricsBegin()
+	{
+		_startedAt = Metrics::nowUs();
+		_startedBytes = isSending() ? _totallyBytesSend : _totallyBytesReceived;
+	}
+
+	void journalBegin()
+	{
+		if (_journal == nullptr)
+			return;
+		TransferJournal::Entry entry;
+		entry.clientId = _journalId;
+		entry.upload = !isSending();
+		entry.version = _protocolVersion;
+		entry.bufLen = _bufLen;
+		entry.timeOut = _timeOut;
+		entry.fileLength = _fileLength;
+		entry.rangeBegin = _rangeBegin;
+		entry.rangeLength = _rangeLength;
+		entry.fileName = _fileName;
+		_journal->begin(entry);
+	}
+
+	void journalProgress()
+	{//whole chunks of the upload can be made durable by the journal (the verified ones, see checksumReceived())
+		long long received = _checksummed ? std::min(_totallyBytesReceived, _verifiedBytes) : _totallyBytesReceived;
+		if (_writeBehind)
+			received = std::min(received, _writeBehind->written());
+		if (_journal != nullptr && received - _journaled >= TransferJournal::ChunkSize)
+		{
+			_journaled = received / TransferJournal::ChunkSize * TransferJournal::ChunkSize;
+			_journal->progress(_journalId, _journaled);
+		}
+	}
+
+	void journalEnd()
+	{
+		if (_journal == nullptr)
+			return;
+		_journal->end(_journalId);
+		_journal = nullptr;
+	}
+
+	bool openForReading()
+	{//total size of the transmitting file (of the range), the cached file is not opened
+		if (_cache != nullptr)
+			_content = _cache->acquire(_fileName);
+		if (_content)
+			_fileLength = (long long)_content->size();
+		else
+		{
+			_rdFile.open(_fileName, ios::in | ios::binary);
+			if (!_rdFile.is_open())
+				return false;
+			_fileLength = getFileLength(_rdFile);
+		}
+		if (_rangeLength < 0)
+			return true;
+		//the range has to be inside the file
+		if (_rangeBegin < 0 || _rangeBegin > _fileLength || _rangeLength > _fileLength - _rangeBegin)
+		{
+			_rdFile.close();
+			_content.reset();
+			return false;
+		}
+		_fileLength = _rangeLength;
+		if (!_content)
+			_rdFile.seekg(_rangeBegin, ios::beg);
+		return true;
+	}
+
+	void startPipeline()
+	{//the disk stage of the buffered TCP transfer (see usePipeline()) when the file is open;
+	 //the compressed frames read the file as they go
+		if (_pipelineDepth <= 0 || _socket->protocol() != IPPROTO_TCP)
+			return;
+		std::shared_ptr<StageWakeUp> wakeUp = _stageWakeUp;
+		std::function<void()> ready = [wakeUp]() { wakeUp->notify(); };
+		if (isSending())
+		{
+			if (_fileHandle == -1 && !_content && !_compressing && !_readAhead)
+				_readAhead.reset(new ReadAhead(_fileName, _rangeBegin, _fileLength, _bufLen, _pipelineDepth, ready));
+		}
+		else if (_pipe[0] == -1 && !_writeBehind)
+			_writeBehind.reset(new WriteBehind([this](long long offset, const char* data, int length)
+			{
+				return writeThrough(offset, data, length);
+			}, _totallyBytesReceived, _bufLen, _pipelineDepth, ready));
+	}
+
+	bool stageHasRoom()
+	{//the receiver may take more bytes: the blocking one waits for the disk stage, the one of the event loop
+	 //leaves them in the owner's input until the disk stage is ready
+		return !_writeBehind || _writeBehind->room(_stageOwner == nullptr);
+	}
+
+	void leaveOwner()
+	{//no more wake-ups of the owner (the transfer is over or parked)
+		_stageOwner = nullptr;
+		_stageWakeUp->attach(nullptr, nullptr);
+	}
+
+	void startTuning()
+	{//the autotuning of the framed TCP transfer (see useAutotune()) from the socket buffer it has
+		if (!_autotune || !_framed || _tuner)
+			return;
+		int buffer = isSending() ? _socket->getSendBufferSize() : _socket->getReceiveBufferSize();
+		_tuner.reset(new Autotune(isSending(), _bufLen, buffer));
+	}
+
+	void tune()
+	{//the next sample of the autotuning, the new chunk goes with the next data frame
+		if (!_tuner || !_tuner->sample(_socket, isSending() ? _totallyBytesSend : _totallyBytesReceived, nowMs()))
+			return;
+		_bufLen = _tuner->chunk();
+		_frameLimit = std::min<long long>(_bufLen, (long long)MaxFrameLength);
+		if (_buffer.size() < (size_t)_bufLen)
+			_buffer.resize(_bufLen);
+	}
+
+	int readFile(long long offset, char* data, int length)
+	{//bytes of the file (of the range) from the offset, fewer if the file ends
+		TRACE_SPAN("disk read");
+		if (_content)
+		{
+			long long available = (long long)_content->size() - _rangeBegin - offset;
+			length = (int)std::max<long long>(std::min<long long>(length, available), 0);
+			memcpy(data, _content->data() + _rangeBegin + offset, length);
+			return length;
+		}
+		_rdFile.clear();
+		if ((long long)_rdFile.tellg() != _rangeBegin + offset)
+			_rdFile.seekg(_rangeBegin + offset, ios::beg);
+		_rdFile.read(data, length);
+		return (int)_rdFile.gcount();
+	}
+
+	void openFileHandle()
+	{//zero-copy download (TCP), the ifstream stays for the other transfers; the cached file is sent from the memory
+#if defined(UNIX)
+		if (_socket->protocol() == IPPROTO_TCP && !_content)
+			_fileHandle = ::open(_fileName.c_str(), O_RDONLY);
+#endif
+	}
+
+	bool openForWriting(bool truncate = true)
+	{//zero-copy upload (TCP on unix): the file descriptor and the pipe for splice;
+	 //the resumed (restored) upload and the range keep the file
+#if defined(UNIX)
+		if (_socket->protocol() == IPPROTO_TCP)
+		{
+			//the range goes into the file prepared by the caller
+			_fileHandle = ::open(_fileName.c_str(), O_WRONLY | O_CREAT | (truncate && _rangeLength < 0 ? O_TRUNC : 0), 0644);
+			if (_fileHandle == -1)
+				return false;
+			//without the pipe the received bytes are written to the descriptor
+			if (pipe(_pipe) != 0)
+				_pipe[0] = _pipe[1] = -1;
+			else
+			{
+				//large pipe -> large splice portions
+				int pipeSize = fcntl(_pipe[1], F_SETPIPE_SZ, PipeSize);
+				_pipeSize = (pipeSize > 0) ? pipeSize : fcntl(_pipe[1], F_GETPIPE_SZ);
+				if (_pipeSize <= 0)
+					closePipe();
+			}
+			return true;
+		}
+#endif
+		_wrFile.open(_fileName, (truncate && _rangeLength < 0) ? ios::out | ios::trunc | ios::binary : ios::in | ios::out | ios::binary);
+		return _wrFile.is_open();
+	}
+
+	bool writeFile(long long offset, const char* data, int length)
+	{//through the disk stage if there is one
+		if (_writeBehind)
+			return _writeBehind->write(offset, data, length);
+		return writeThrough(offset, data, length);
+	}
+
+	bool writeThrough(long long offset, const char* data, int length)
+	{//positional: the ring writes the chunks at their offsets, UDP datagrams come in any order;
+	 //offset in the range (see useRange())
+		offset += _rangeBegin;
+		if (_fileHandle == -1)
+		{
+			if ((long long)_wrFile.tellp() != offset)
+				_wrFile.seekp(offset, ios::beg);
+			_wrFile.write(data, length);
+			return !_wrFile.fail();
+		}
+#if defined(UNIX)
+		while (length > 0)
+		{
+			ssize_t bytesWrite = ::pwrite(_fileHandle, data, length, offset);
+			if (bytesWrite <= 0)
+				return false;
+			data += bytesWrite;
+			offset += (int)bytesWrite;
+			length -= (int)bytesWrite;
+		}
+#endif
+		return true;
+	}
+
+	void closeFileHandle()
+	{
+#if defined(UNIX)
+		if (_fileHandle != -1)
+			close(_fileHandle);
+#endif
+		_fileHandle = -1;
+		closePipe();
+	}
+
+	void closePipe()
+	{
+#if defined(UNIX)
+		if (_pipe[0] != -1)
+		{
+			close(_pipe[0]);
+			close(_pipe[1]);
+		}
+#endif
+		_pipe[0] = _pipe[1] = -1;
+		_pipeSize = 0;
 	}
 
 	template<typename T>
-	T generateId(int lowerBound = 0, int upperBound = 255)
+	void queueOutput(const T& obj)
+	{
+		_output.push(string((const char*)&obj, sizeof(obj)));
+	}
+
+	void queueOffset(long long offset)
+	{
+		_output.push(encodeOffset(offset));
+	}
+
+	string encodeOffset(long long offset)const
+	{
+		if (_offsetSize == sizeof(int))
+		{
+			int narrow = (int)offset;
+			return string((const char*)&narrow, sizeof(narrow));
+		}
+		return string((const char*)&offset, sizeof(offset));
+	}
+
+	long long offsetField(size_t offset)
+	{
+		return (_offsetSize == sizeof(int)) ? field<int>(offset) : field<long long>(offset);
+	}
+
+	long long maxFileLength()const
 	{
-		std::default_random_engine generator;
+		return (_offsetSize == sizeof(int)) ? std::numeric_limits<int>::max() : std::numeric_limits<long long>::max();
+	}
+
+	int chunkLength(long long offset)const
+	{
+		return (int)std::min<long long>(_bufLen, _fileLength - offset);
+	}
+
+	bool collect(const char* data, size_t length, size_t& consumed, size_t fieldLength)
+	{//gather the field which can arrive in pieces
+		size_t n = std::min(fieldLength - _field.size(), length - consumed);
+		_field.insert(_field.end(), data + consumed, data + consumed + n);
+		consumed += n;
+		return _field.size() == fieldLength;
+	}
+
+	template<typename T>
+	T field(size_t offset)
+	{
+		T value;
+		memcpy(&value, _field.data() + offset, sizeof(T));
+		return value;
+	}
+
+	static void spend(size_t& budget, int bytes)
+	{
+		budget -= std::min(budget, (size_t)bytes);
+	}
+
+	static long long getFileLength(std::ifstream& file)
+	{
+		//cursor to the end of file
+		file.seekg(0, ios::end);
+		//get it position
+		long long fileEndPos = file.tellg();
+		//cursor to the beginning
+		file.seekg(0, ios::beg);
+		//file length
+		return fileEndPos;
+	}
+
+};
+
+
+
+class Connection
+{
+	//contains mutual data end algorithms for server and client
+protected:
+	//comands and their functions (perfect hash table)
+	//реализуемые этими командами (const char* -> bool(*)(Connection*, string&))
+	CommandTable<Connection> _commandTable;
+
+	//id of the client or server
+	int _id;
+	//transfer protocol agreed with the peer (1 until the "version" command is answered)
+	int _protocolVersion;
+	//chunk of the framed transfers after TCP_INFO (see FileWorker::useAutotune())
+	bool _autotune;
+	int _bufLen;
+	int _timeOut;
+	virtual void fillCommandMap() = 0;
+
+public:
+	Connection(int bufLen, int timeOut) : _bufLen(bufLen), _timeOut(timeOut)
+	{
+		_id = generateId<int>(1, std::numeric_limits<int>::max());
+		_protocolVersion = 1;
+		_autotune = false;
+	}
+
+	virtual ~Connection() {}
+
+	//the latest transfer protocol: 64-bit file lengths and offsets, UDP sliding window, TCP frames, compression
+	static const int ProtocolVersion = FileWorker::ChecksummedFramesVersion;
+	//parallel download: streams at most, the ranges are multiples of the alignment (but the last one)
+	static const int MaxStreams = 16;
+	static const int RangeAlignment = 64 * 1024;
+
+protected:
+
+	bool catchCommand(const string& request, int& command)
+	{//command - index of the command in the table (see CommandTable::indexOf()), -1 if there is no such command
+		TRACE_TICKS(parseStart);
+		TRACE_MARK(parseStart);
+		//identifies command from request
+		StringRef rest;
+		command = _commandTable.indexOf(CommandParser::command(request, rest));
+		//check command
+		CommandTable<Connection>::Handler handler = (command >= 0) ? _commandTable.handler(command) : nullptr;
+		TRACE_SINCE("command parse", parseStart);
+		if (handler != nullptr)
+		{
+			TRACE_SPAN("command dispatch");
+			//command execution
+			string arguments = rest.str();
+			return handler(this, arguments);
+
+		}
+		//there is no such command
+		return false;
+	}
+
+	static bool checkCommandFormat(const string& message)
+	{//( )*[A-Za-z0-9_]+(( )+(.)+)?(\r\n|\n)
+		return CommandParser::checkFormat(message);
+	}
+
+	bool checkCommandExistance(const string& command)
+	{
+		//command existance check
+		return _commandTable.find(command) != nullptr;
+	}
+	//--------------------------find substring-----------------------------//
+	static std::string getFileName(const string &message)
+	{//first [A-Za-z0-9]+.[A-Za-z0-9]+
+		return CommandParser::fileName(message).str();
+	}
+
+	//---------------------------------работа с файлами----------------------------------------//
+
+	bool sendFile(Socket* socket, string& message, std::function<Socket*(int)> tryToReconnect)
+	{
+		string fileName = getFileName(message);
+		FileWorker fileWorker(socket, tryToReconnect, _bufLen, _timeOut);
+		fileWorker.useProtocol(_protocolVersion);
+		fileWorker.usePipeline(FileWorker::PipelineDepth);
+		fileWorker.useAutotune(_autotune);
+		return fileWorker.send(fileName);
+	}
+
+	bool receiveFile(Socket* socket, string& message, std::function<Socket*(int)> tryToReconnect)
+	{
+		string fileName = getFileName(message);
+		FileWorker fileWorker(socket, tryToReconnect, _bufLen, _timeOut);
+		fileWorker.useProtocol(_protocolVersion);
+		fileWorker.usePipeline(FileWorker::PipelineDepth);
+		fileWorker.useAutotune(_autotune);
+		return fileWorker.receive(fileName);
+	}
+
+	bool receiveFileParallel(string& message, const vector<long long>& bounds, std::function<Socket*(size_t)> connectStream)
+	{//the ranges of the "pdownload" reply (see parseRanges()) at once, each one over its own connection
+	 //and resumed by itself; connectStream(i) - new connection of the stream i identified by the stream's
+	 //own id (the same one every time, the server resumes the range by it)
+		string fileName = getFileName(message);
+		if (bounds.size() < 2 || !prepareFile(fileName, bounds.back()))
+			return false;
+		return transferRanges(fileName, "range " + fileName, bounds, connectStream, false);
+	}
+
+	bool sendFileParallel(string& message, int token, const vector<long long>& bounds, std::function<Socket*(size_t)> connectStream)
+	{//the ranges of the local file (see splitRanges()) at once to the upload which "pupload" has begun
+	 //(see parseUpload()), as receiveFileParallel() does; the server renames the file into place
+	 //when every range is there
+		string fileName = getFileName(message);
+		if (bounds.size() < 2)
+			return false;
+		return transferRanges(fileName, "upload_range " + toString(token), bounds, connectStream, true);
+	}
+
+	bool sendFileDelta(Socket* socket, string& message, std::function<Socket*(int)> tryToReconnect)
+	{//"dsync <file>" has been sent (message - the file): the signature of the server's copy is downloaded, only the delta
+	 //against it is uploaded by "dupload <file>" (see DeltaSync), the server rebuilds the file from them.
+	 //The server has no copy or it has changed meanwhile - the file is uploaded as it is or the upload fails
+		string fileName = getFileName(message);
+		string signatureName = fileName + ".sig";
+		string deltaName = fileName + ".delta";
+		//the transfers may reconnect, the next command goes to the new socket
+		std::function<Socket*(int)> reconnect = [&socket, tryToReconnect](int timeOut)
+		{
+			socket = tryToReconnect(timeOut);
+			return socket;
+		};
+		bool result = false;
+		{
+			FileWorker fileWorker(socket, reconnect, _bufLen, _timeOut);
+			fileWorker.useProtocol(_protocolVersion);
+			result = fileWorker.receive(signatureName);
+		}
+		//the end of the download is confirmed as "download" does
+		if (socket == nullptr || !socket->sendConfirm() || socket->receiveMessage().compare(0, 4, "fail") == 0)
+			result = false;
+		result = result && DeltaSync::encode(signatureName, fileName, deltaName);
+		std::remove(signatureName.c_str());
+		if (!result)
+		{
+			std::remove(deltaName.c_str());
+			return false;
+		}
+		string request = "dupload " + fileName;
+		if (socket->sendMessage(request))
+		{
+			FileWorker fileWorker(socket, reconnect, _bufLen, _timeOut);
+			fileWorker.useProtocol(_protocolVersion);
+			result = fileWorker.send(deltaName);
+		}
+		else
+			result = false;
+		//"file uploaded" when the file has been rebuilt
+		result = result && socket != nullptr && socket->receiveMessage().compare(0, 4, "fail") != 0;
+		std::remove(deltaName.c_str());
+		return result;
+	}
+
+	static vector<long long> splitRanges(long long fileLength, long long streams)
+	{//offsets of the parallel transfer ranges: equal, aligned (whole pages and chunks), not empty
+		streams = std::max(1LL, std::min<long long>(streams, MaxStreams));
+		long long part = (fileLength + streams - 1) / streams;
+		part = (part + RangeAlignment - 1) / RangeAlignment * RangeAlignment;
+		vector<long long> bounds(1, 0);
+		do
+			bounds.push_back(std::min(bounds.back() + part, fileLength));
+		while (bounds.back() < fileLength);
+		return bounds;
+	}
+
+	static bool parseRanges(const string& reply, vector<long long>& bounds)
+	{//"pdownload <file length> <offset 0> ... <offset n>" -> the offsets (n ranges)
+		istringstream stream(reply);
+		string word;
+		long long fileLength = 0;
+		if (!(stream >> word >> fileLength) || word != "pdownload")
+			return false;
+		bounds.clear();
+		for (long long offset = 0; stream >> offset;)
+			bounds.push_back(offset);
+		return bounds.size() >= 2 && bounds.front() == 0 && bounds.back() == fileLength &&
+			std::is_sorted(bounds.begin(), bounds.end());
+	}
+
+	static bool parseUpload(const string& reply, int& token)
+	{//"pupload <token>"
+		istringstream stream(reply);
+		string word;
+		return (stream >> word >> token) && word == "pupload";
+	}
+
+	static long long freeSpace(const string& directory)
+	{//bytes the unprivileged user may take on the disk of the directory, -1 if unknown
+#if defined(UNIX)
+		struct statvfs disk;
+		if (statvfs(directory.c_str(), &disk) != 0)
+			return -1;
+		return (long long)std::min<unsigned long long>((unsigned long long)disk.f_bavail * disk.f_frsize,
+			(unsigned long long)std::numeric_limits<long long>::max());
+#else
+		ULARGE_INTEGER available;
+		if (!GetDiskFreeSpaceExA(directory.c_str(), &available, NULL, NULL))
+			return -1;
+		return (long long)std::min<unsigned long long>(available.QuadPart, (unsigned long long)std::numeric_limits<long long>::max());
+#endif
+	}
+
+	static bool prepareFile(const string& fileName, long long length)
+	{//the file of the final length, the streams write their ranges in place
+	 //(the blocks are allocated at once where it's possible)
+#if defined(UNIX)
+		int handle = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (handle == -1)
+			return false;
+		bool prepared = length == 0 || posix_fallocate(handle, 0, length) == 0 || ftruncate(handle, length) == 0;
+		close(handle);
+		return prepared;
+#else
+		std::ofstream file(fileName, ios::out | ios::trunc | ios::binary);
+		if (!file.is_open())
+			return false;
+		if (length > 0)
+		{
+			file.seekp(length - 1, ios::beg);
+			file.put(0);
+		}
+		return !file.fail();
+#endif
+	}
+
+	static bool replaceFile(const string& from, const string& to)
+	{//atomic: the readers see the old file or the whole new one
+#if defined(WINDOWS)
+		return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+	}
+
+	template<typename T>
+	T generateId(T lowerBound = 0, T upperBound = 255)
+	{//one generator per thread seeded once: clients started in the same second
+	 //(and the streams of one client) get different ids
+		static thread_local std::mt19937_64 generator(idSeed());
 		std::uniform_int_distribution<T> distribution(lowerBound, upperBound);
-		generator.seed(time(NULL));
 		return distribution(generator);
 	}
+
+	static unsigned long long idSeed()
+	{//random_device may be deterministic (old MinGW), so the clock and the thread are mixed in
+		std::random_device device;
+		unsigned long long seed = device();
+		seed = seed * 0x9E3779B97F4A7C15ull ^ (unsigned long long)std::chrono::high_resolution_clock::now().time_since_epoch().count();
+		seed = seed * 0x9E3779B97F4A7C15ull ^ std::hash<std::thread::id>()(std::this_thread::get_id());
+		return seed;
+	}
+
+private:
+
+	bool transferRanges(const string& fileName, const string& command, const vector<long long>& bounds,
+		std::function<Socket*(size_t)> connectStream, bool upload)
+	{//one blocking transfer per range, each in its own thread and over its own connection
+		size_t streams = bounds.size() - 1;
+		vector<unique_ptr<Socket>> sockets(streams);
+		vector<char> results(streams, 0);
+		vector<std::thread> threads;
+		for (size_t i = 0; i < streams; i++)
+			threads.emplace_back([&, i]()
+			{
+				std::function<Socket*(int)> tryToReconnect = [&, i](int) -> Socket*
+				{
+					try
+					{
+						sockets[i].reset(connectStream(i));
+					}
+					catch (const exception&)
+					{
+						sockets[i].reset();
+					}
+					return sockets[i].get();
+				};
+				if (tryToReconnect(_timeOut) == nullptr)
+					return;
+				//the stream is a session of its own: the protocol is agreed again
+				string version = "version " + toString(_protocolVersion);
+				string request = version;
+				if (_protocolVersion > 1 && (!sockets[i]->sendMessage(request) || sockets[i]->receiveMessage() != version + "\r\n"))
+					return;
+				string range = command + " " + toString(bounds[i]) + " " + toString(bounds[i + 1]);
+				request = range;
+				if (!sockets[i]->sendMessage(request))
+					return;
+				//the upload begins when the server has taken the range (it repeats the command)
+				if (upload && sockets[i]->receiveMessage() != range + "\r\n")
+					return;
+				FileWorker fileWorker(sockets[i].get(), tryToReconnect, _bufLen, _timeOut);
+				fileWorker.useProtocol(_protocolVersion);
+				fileWorker.useAutotune(_autotune);
+				fileWorker.useRange(bounds[i], bounds[i + 1] - bounds[i]);
+				string name = fileName;
+				results[i] = upload ? fileWorker.send(name) : fileWorker.receive(name);
+				if (!results[i] || !sockets[i])
+					return;
+				//"range uploaded", "file uploaded" (the last range) or the failure;
+				//the end of the download is confirmed as "download" does
+				if (upload)
+					results[i] = sockets[i]->receiveMessage().compare(0, 4, "fail") != 0;
+				else if (sockets[i]->sendConfirm())
+					sockets[i]->receiveMessage();
+			});
+		for (auto& thread : threads)
+			thread.join();
+		return std::find(results.begin(), results.end(), 0) == results.end();
+	}
+
 };
 
 #endif //CONNECTION_H
\ No newline at end of file
@@ -0,0 +1,283 @@
+#ifndef DATAGRAMBATCH_H
+#define DATAGRAMBATCH_H
+
+//system headers only: the benchmark (bench/udp_bench.cpp) uses the class without the server
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#endif
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__linux__)
+//older headers (the kernel may still support them, the socket options tell)
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+class DatagramBatch
+{//many datagrams of the UDP socket per system call (recvmmsg, sendmmsg);
+ //the equal datagrams to one peer leave as one segmented message (UDP GSO),
+ //the kernel gives the received datagrams of one peer as one message (UDP GRO);
+ //available() is false where there are no such calls, the socket is used as usual then
+public:
+	struct Datagram
+	{
+		const char* data;
+		int length;
+		const sockaddr_storage* address;
+	};
+
+	//messages per recvmmsg
+	static const unsigned ReceiveMessages = 16;
+	//datagrams sent by one sendmmsg (at most)
+	static const unsigned SendDatagrams = 64;
+	//bytes of one (coalesced) message
+	static const unsigned MessageSize = 65535;
+	//segments of one GSO message (UDP_MAX_SEGMENTS of the older kernels) and their bytes (IPv4 limit)
+	static const unsigned MaxSegments = 64;
+	static const int MaxSegmented = 65507;
+private:
+	struct Pending
+	{
+		size_t offset;
+		int length;
+		sockaddr_storage address;
+	};
+
+	int _handle;
+	bool _available;
+	bool _segmentation;
+	bool _coalescing;
+
+	//receiving: the messages, then the datagrams cut out of them
+	std::vector<char> _input;
+	std::vector<sockaddr_storage> _sources;
+	std::vector<Datagram> _received;
+
+	//sending: datagrams one after another (segments of the GSO message have to be adjacent)
+	std::vector<char> _output;
+	size_t _outputLength;
+	std::vector<Pending> _pending;
+	unsigned long long _dropped;
+
+#if defined(__linux__)
+	std::vector<mmsghdr> _messages;
+	std::vector<iovec> _vectors;
+	//UDP_GRO / UDP_SEGMENT control message of every message
+	std::vector<char> _control;
+#endif
+
+	//запрет копирования и присваивания
+	DatagramBatch(DatagramBatch&);
+	DatagramBatch& operator=(DatagramBatch&);
+public:
+	//segmentation, coalescing - GSO, GRO if the kernel supports them (off - the benchmark compares)
+	DatagramBatch(int handle, bool segmentation = true, bool coalescing = true)
+		: _handle(handle), _available(false), _segmentation(false), _coalescing(false),
+		_outputLength(0), _dropped(0)
+	{
+		_output.resize(SendDatagrams * MessageSize / 4);
+#if defined(__linux__)
+		_available = true;
+		int on = 1;
+		int size = 0;
+		socklen_t sizeLength = sizeof(size);
+		//the option can be read where GSO is supported (4.18)
+		_segmentation = segmentation && getsockopt(_handle, IPPROTO_UDP, UDP_SEGMENT, &size, &sizeLength) == 0;
+		//5.0
+		_coalescing = coalescing && setsockopt(_handle, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+
+		unsigned messages = std::max<unsigned>(+ReceiveMessages, +SendDatagrams);
+		_input.resize(ReceiveMessages * MessageSize);
+		_sources.resize(ReceiveMessages);
+		_messages.resize(messages);
+		_vectors.resize(messages);
+		_control.resize(messages * CMSG_SPACE(sizeof(int)));
+#else
+		(void)segmentation;
+		(void)coalescing;
+#endif
+	}
+
+	~DatagramBatch()
+	{
+#if defined(__linux__)
+		if (_coalescing)
+		{//the socket is used as usual after the batch (coalesced datagrams would be read as one)
+			int off = 0;
+			setsockopt(_handle, IPPROTO_UDP, UDP_GRO, &off, sizeof(off));
+		}
+#endif
+	}
+
+	bool available()const { return _available; }
+	bool segmentation()const { return _segmentation; }
+	bool coalescing()const { return _coalescing; }
+	int handle()const { return _handle; }
+	//datagrams which the socket couldn't take (the protocol above retransmits them)
+	unsigned long long dropped()const { return _dropped; }
+
+	unsigned receive()
+	{//the next datagrams (0 - there are no more), valid until the next call
+		_received.clear();
+#if defined(__linux__)
+		for (unsigned i = 0; i < ReceiveMessages; i++)
+		{
+			mmsghdr& message = _messages[i];
+			memset(&message, 0, sizeof(message));
+			_vectors[i].iov_base = _input.data() + i * MessageSize;
+			_vectors[i].iov_len = MessageSize;
+			message.msg_hdr.msg_iov = &_vectors[i];
+			message.msg_hdr.msg_iovlen = 1;
+			message.msg_hdr.msg_name = &_sources[i];
+			message.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+			message.msg_hdr.msg_control = _control.data() + i * CMSG_SPACE(sizeof(int));
+			message.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+		}
+		int count = recvmmsg(_handle, _messages.data(), ReceiveMessages, MSG_DONTWAIT, NULL);
+		if (count <= 0)
+			return 0;
+		for (int i = 0; i < count; i++)
+		{
+			const char* data = (const char*)_vectors[i].iov_base;
+			int length = (int)_messages[i].msg_len;
+			//coalesced datagrams are of the segment size (the last one may be shorter)
+			int segment = length;
+			msghdr& header = _messages[i].msg_hdr;
+			for (cmsghdr* control = CMSG_FIRSTHDR(&header); control != NULL; control = CMSG_NXTHDR(&header, control))
+				if (control->cmsg_level == IPPROTO_UDP && control->cmsg_type == UDP_GRO)
+					memcpy(&segment, CMSG_DATA(control), sizeof(segment));
+			if (segment <= 0)
+				segment = length;
+			int offset = 0;
+			do
+			{
+				Datagram datagram;
+				datagram.data = data + offset;
+				datagram.length = std::min(segment, length - offset);
+				datagram.address = &_sources[i];
+				_received.push_back(datagram);
+				offset += segment;
+			} while (offset < length);
+		}
+#endif
+		return (unsigned)_received.size();
+	}
+
+	const Datagram& received(unsigned index)const { return _received[index]; }
+
+	char* append(const sockaddr_storage& address, int length)
+	{//room for the datagram to the address, sent by flush() (or by append() when the batch is full)
+		if ((size_t)length > _output.size())
+			return nullptr;
+		if (_pending.size() == SendDatagrams || _outputLength + length > _output.size())
+			flush();
+		Pending pending;
+		pending.offset = _outputLength;
+		pending.length = length;
+		pending.address = address;
+		_pending.push_back(pending);
+		_outputLength += length;
+		return _output.data() + pending.offset;
+	}
+
+	bool empty()const { return _pending.empty(); }
+
+	void flush()
+	{//datagrams the socket can't take now are dropped
+#if defined(__linux__)
+		size_t first = 0;
+		while (first < _pending.size())
+		{
+			unsigned count = 0;
+			size_t next = first;
+			while (next < _pending.size() && count < _messages.size())
+				next = prepare(count++, next);
+
+			int sent = sendmmsg(_handle, _messages.data(), count, MSG_DONTWAIT);
+			if (sent < 0 && _segmentation && (errno == EINVAL || errno == EIO || errno == EMSGSIZE))
+			{//the path doesn't take the segments (MTU, no checksum offload): the datagrams go one by one
+				_segmentation = false;
+				continue;
+			}
+			if (sent <= 0)
+			{//EAGAIN - the socket buffer is full
+				_dropped += _pending.size() - first;
+				break;
+			}
+			for (int i = 0; i < sent; i++)
+				first += segments(_messages[i]);
+		}
+#else
+		_dropped += _pending.size();
+#endif
+		_pending.clear();
+		_outputLength = 0;
+	}
+
+private:
+
+#if defined(__linux__)
+	size_t prepare(unsigned index, size_t first)
+	{//message of the datagram first and of the next ones to the same peer (of the same length),
+	 //the index of the next datagram
+		const Pending& pending = _pending[first];
+		size_t last = first + 1;
+		int total = pending.length;
+		if (_segmentation)
+			while (last < _pending.size() && last - first < MaxSegments &&
+				_pending[last - 1].length == pending.length && total + _pending[last].length <= MaxSegmented &&
+				_pending[last].length <= pending.length &&
+				memcmp(&_pending[last].address, &pending.address, addressLength(pending.address)) == 0)
+				total += _pending[last++].length;
+
+		mmsghdr& message = _messages[index];
+		memset(&message, 0, sizeof(message));
+		_vectors[index].iov_base = _output.data() + pending.offset;
+		_vectors[index].iov_len = total;
+		message.msg_hdr.msg_iov = &_vectors[index];
+		message.msg_hdr.msg_iovlen = 1;
+		message.msg_hdr.msg_name = (void*)&pending.address;
+		message.msg_hdr.msg_namelen = addressLength(pending.address);
+		if (last - first > 1)
+		{
+			message.msg_hdr.msg_control = _control.data() + index * CMSG_SPACE(sizeof(int));
+			message.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+			cmsghdr* control = CMSG_FIRSTHDR(&message.msg_hdr);
+			control->cmsg_level = IPPROTO_UDP;
+			control->cmsg_type = UDP_SEGMENT;
+			//16-bit here (int in the UDP_GRO message)
+			control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t segment = (uint16_t)pending.length;
+			memcpy(CMSG_DATA(control), &segment, sizeof(segment));
+		}
+		return last;
+	}
+
+	size_t segments(const mmsghdr& message)const
+	{
+		if (message.msg_hdr.msg_controllen == 0)
+			return 1;
+		uint16_t segment;
+		memcpy(&segment, CMSG_DATA(CMSG_FIRSTHDR((msghdr*)&message.msg_hdr)), sizeof(segment));
+		return (_vectors[&message - _messages.data()].iov_len + segment - 1) / segment;
+	}
+
+	static socklen_t addressLength(const sockaddr_storage& address)
+	{
+		return (address.ss_family == AF_INET6) ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+	}
+#endif
+};
+
+#endif //DATAGRAMBATCH_H
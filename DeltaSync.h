@@ -0,0 +1,432 @@
+#ifndef DELTASYNC_H
+#define DELTASYNC_H
+
+#include "Includes.h"
+#include "Checksum.h"
+#include <cmath>
+
+class DeltaSync
+{//rsync-like transfer of the changed file: the receiver describes its copy (the basis) by the signature -
+ //a weak rolling checksum and a strong hash of every block, the sender finds the blocks in its file
+ //at any offset and sends the delta - references to the basis blocks and the literal bytes between them.
+ //All three are files, they are transferred as the usual ones (resumed etc.). Numbers are in host order.
+ //	signature: "DSIG" <block size:4> <basis length:8> <blocks:4> {<weak:4> <strong:8>}
+ //	delta:     "DLTA" <block size:4> <file length:8> <file CRC-32C:4> {'C' <block:4> <count:4> | 'L' <length:4> <bytes>} 'E'
+public:
+	static const int MinBlockSize = 2048;
+	static const int MaxBlockSize = 64 * 1024;
+
+	static int blockSize(long long fileLength)
+	{//sqrt of the length as rsync has it: the signature and the delta both stay small
+		long long size = (long long)std::sqrt((double)fileLength);
+		size = (size + 1023) / 1024 * 1024;
+		return (int)std::max<long long>(MinBlockSize, std::min<long long>(size, MaxBlockSize));
+	}
+
+	static bool signature(const string& basisName, const string& signatureName)
+	{//no basis - the empty one (the delta is the whole file)
+		std::ifstream basis(basisName, ios::in | ios::binary | ios::ate);
+		long long basisLength = basis.is_open() ? (long long)basis.tellg() : 0;
+		int size = blockSize(basisLength);
+		uint32_t blocks = (uint32_t)((basisLength + size - 1) / size);
+		std::ofstream output(signatureName, ios::out | ios::trunc | ios::binary);
+		if (!output.is_open())
+			return false;
+		output.write("DSIG", 4);
+		put(output, (uint32_t)size);
+		put(output, basisLength);
+		put(output, blocks);
+		if (blocks > 0)
+			basis.seekg(0, ios::beg);
+		vector<char> block(size);
+		for (uint32_t i = 0; i < blocks; i++)
+		{
+			size_t length = (size_t)std::min<long long>(size, basisLength - (long long)i * size);
+			if (!basis.read(block.data(), length))
+				return false;
+			put(output, weakSum(block.data(), length));
+			put(output, strongHash(block.data(), length));
+		}
+		return !output.fail();
+	}
+
+	static bool encode(const string& signatureName, const string& fileName, const string& deltaName, long long* literalBytes = nullptr)
+	{//the delta of the file against the signature; literalBytes - how much of the file is sent as it is
+		Signature basis;
+		if (!basis.load(signatureName))
+			return false;
+		std::ifstream file(fileName, ios::in | ios::binary | ios::ate);
+		std::ofstream delta(deltaName, ios::out | ios::trunc | ios::binary);
+		if (!file.is_open() || !delta.is_open())
+			return false;
+		long long fileLength = file.tellg();
+		file.seekg(0, ios::beg);
+		delta.write("DLTA", 4);
+		put(delta, (uint32_t)basis.blockSize);
+		put(delta, fileLength);
+		//the CRC is written when the whole file is read
+		std::streampos crcPosition = delta.tellp();
+		put(delta, (uint32_t)0);
+
+		Encoder encoder(basis, delta);
+		//the window and the literal bytes before it are kept in the buffer, the rest is written out
+		size_t size = basis.blockSize;
+		vector<char> buffer(std::max<size_t>(4 * size, ReadSize + size));
+		size_t length = 0, window = 0;
+		uint32_t crc = 0;
+		bool rolled = false;
+		uint32_t a = 0, b = 0;
+		long long left = fileLength;
+		while (true)
+		{
+			if (length - window < size && left > 0)
+			{//more data: the literal bytes are written, the window moves to the beginning
+				encoder.flushLiteral(buffer.data(), window);
+				memmove(buffer.data(), buffer.data() + window, length - window);
+				encoder.shift(window);
+				length -= window;
+				window = 0;
+				size_t bytes = (size_t)std::min<long long>(left, buffer.size() - length);
+				if (!file.read(buffer.data() + length, bytes))
+					return false;
+				crc = Crc32c::compute(buffer.data() + length, bytes, crc);
+				length += bytes;
+				left -= bytes;
+				continue;
+			}
+			if (length - window < size)
+				break;
+			const char* data = buffer.data() + window;
+			if (!rolled)
+				weakSum(data, size, a, b);
+			rolled = false;
+			uint32_t block = 0;
+			if (basis.find(a, b, data, size, block))
+			{
+				encoder.copy(buffer.data(), window, block);
+				window += size;
+				continue;
+			}
+			if (window + size < length)
+			{//the window slides by one byte
+				roll(a, b, (unsigned char)data[0], (unsigned char)data[size], size);
+				rolled = true;
+			}
+			window++;
+			encoder.literalGrown(buffer.data(), window);
+		}
+		//the short tail may be the short last block of the basis
+		uint32_t block = 0;
+		if (window < length && basis.findLast(buffer.data() + window, length - window, block))
+		{
+			encoder.copy(buffer.data(), window, block);
+			window = length;
+		}
+		encoder.finish(buffer.data(), length);
+		delta.put('E');
+		delta.seekp(crcPosition);
+		put(delta, crc);
+		if (literalBytes != nullptr)
+			*literalBytes = encoder.literalBytes();
+		return !delta.fail();
+	}
+
+	static bool patch(const string& basisName, const string& deltaName, const string& outputName)
+	{//the file from the basis and the delta; false if the result is not the sender's file
+	 //(the basis has changed since its signature was made)
+		std::ifstream delta(deltaName, ios::in | ios::binary);
+		std::ifstream basis(basisName, ios::in | ios::binary);
+		std::ofstream output(outputName, ios::out | ios::trunc | ios::binary);
+		char magic[4];
+		uint32_t size = 0, fileCrc = 0;
+		long long fileLength = 0;
+		if (!output.is_open() || !delta.read(magic, 4) || memcmp(magic, "DLTA", 4) != 0 ||
+			!get(delta, size) || !get(delta, fileLength) || !get(delta, fileCrc) || size == 0)
+			return false;
+		vector<char> buffer(std::max<size_t>(size, +ReadSize));
+		uint32_t crc = 0;
+		long long written = 0;
+		char op = 0;
+		while (delta.get(op) && op != 'E')
+		{
+			uint32_t first = 0, count = 0;
+			long long bytes = 0;
+			if (op == 'C' && get(delta, first) && get(delta, count))
+			{
+				if (!basis.is_open())
+					return false;
+				basis.clear();
+				basis.seekg((long long)first * size, ios::beg);
+				bytes = (long long)count * size;
+			}
+			else if (op != 'L' || !get(delta, count))
+				return false;
+			else
+				bytes = count;
+			std::istream& source = (op == 'C') ? (std::istream&)basis : (std::istream&)delta;
+			while (bytes > 0)
+			{
+				size_t part = (size_t)std::min<long long>(bytes, buffer.size());
+				source.read(buffer.data(), part);
+				//the last block of the basis is short
+				size_t got = (size_t)source.gcount();
+				if (got == 0)
+					return false;
+				crc = Crc32c::compute(buffer.data(), got, crc);
+				output.write(buffer.data(), got);
+				written += got;
+				bytes = (got < part) ? 0 : bytes - got;
+				if (got < part && op == 'L')
+					return false;
+			}
+		}
+		output.close();
+		return op == 'E' && !output.fail() && written == fileLength && crc == fileCrc;
+	}
+
+private:
+	//bytes read from the file at once
+	static const size_t ReadSize = 1024 * 1024;
+	//literal bytes are written by pieces of this size at most
+	static const uint32_t MaxLiteral = 64 * 1024;
+
+	template<typename T>
+	static void put(std::ostream& stream, T value)
+	{
+		stream.write((const char*)&value, sizeof(value));
+	}
+
+	template<typename T>
+	static bool get(std::istream& stream, T& value)
+	{
+		return (bool)stream.read((char*)&value, sizeof(value));
+	}
+
+	static void weakSum(const char* data, size_t length, uint32_t& a, uint32_t& b)
+	{//rsync's checksum: a - sum of the bytes, b - sum of the prefix sums (both mod 2^16)
+		a = b = 0;
+		for (size_t i = 0; i < length; i++)
+		{
+			a += (unsigned char)data[i];
+			b += a;
+		}
+		a &= 0xFFFF;
+		b &= 0xFFFF;
+	}
+
+	static uint32_t weakSum(const char* data, size_t length)
+	{
+		uint32_t a, b;
+		weakSum(data, length, a, b);
+		return a | (b << 16);
+	}
+
+	static void roll(uint32_t& a, uint32_t& b, unsigned char out, unsigned char in, size_t length)
+	{//the window [i + 1, i + length] from [i, i + length - 1]
+		a = (a - out + in) & 0xFFFF;
+		b = (b - (uint32_t)(length * out) + a) & 0xFFFF;
+	}
+
+	static uint64_t strongHash(const char* data, size_t length)
+	{//MurmurHash64A (Austin Appleby, public domain): the weak checksum's candidates are checked by it
+		const uint64_t m = 0xC6A4A7935BD1E995ull;
+		const int r = 47;
+		uint64_t h = 0x8445D61A4E774912ull ^ (length * m);
+		size_t words = length / 8;
+		for (size_t i = 0; i < words; i++)
+		{
+			uint64_t k;
+			memcpy(&k, data + i * 8, 8);
+			k *= m;
+			k ^= k >> r;
+			k *= m;
+			h ^= k;
+			h *= m;
+		}
+		const unsigned char* tail = (const unsigned char*)data + words * 8;
+		if ((length & 7) != 0)
+		{
+			for (size_t i = length & 7; i > 0; i--)
+				h ^= uint64_t(tail[i - 1]) << (8 * (i - 1));
+			h *= m;
+		}
+		h ^= h >> r;
+		h *= m;
+		h ^= h >> r;
+		return h;
+	}
+
+	struct Signature
+	{
+		struct Block
+		{
+			uint32_t weak;
+			uint64_t strong;
+			uint32_t index;
+		};
+
+		int blockSize;
+		long long basisLength;
+		//whole blocks sorted by the weak checksum
+		vector<Block> blocks;
+		//the short last block of the basis (it can match only the tail of the file)
+		bool hasLast;
+		Block last;
+		//bit per weak checksum hash: most of the windows are rejected without the search
+		vector<uint64_t> filter;
+
+		bool load(const string& signatureName)
+		{
+			std::ifstream input(signatureName, ios::in | ios::binary);
+			char magic[4];
+			uint32_t size = 0, count = 0;
+			if (!input.read(magic, 4) || memcmp(magic, "DSIG", 4) != 0 ||
+				!get(input, size) || !get(input, basisLength) || !get(input, count) ||
+				size < (uint32_t)MinBlockSize || size > (uint32_t)MaxBlockSize ||
+				(long long)count != (basisLength + size - 1) / size)
+				return false;
+			blockSize = (int)size;
+			hasLast = false;
+			blocks.clear();
+			blocks.reserve(count);
+			filter.assign(FilterBits / 64, 0);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				Block block;
+				if (!get(input, block.weak) || !get(input, block.strong))
+					return false;
+				block.index = i;
+				if ((long long)(i + 1) * size > basisLength)
+				{
+					last = block;
+					hasLast = true;
+					continue;
+				}
+				blocks.push_back(block);
+				size_t bit = filterBit(block.weak);
+				filter[bit / 64] |= 1ull << (bit % 64);
+			}
+			std::sort(blocks.begin(), blocks.end(), [](const Block& x, const Block& y)
+			{
+				return x.weak < y.weak || (x.weak == y.weak && x.index < y.index);
+			});
+			return true;
+		}
+
+		bool find(uint32_t a, uint32_t b, const char* data, size_t length, uint32_t& index)const
+		{//the whole block of the basis which is the window
+			uint32_t weak = a | (b << 16);
+			size_t bit = filterBit(weak);
+			if ((filter[bit / 64] & (1ull << (bit % 64))) == 0)
+				return false;
+			Block key;
+			key.weak = weak;
+			auto it = std::lower_bound(blocks.begin(), blocks.end(), key, [](const Block& x, const Block& y) { return x.weak < y.weak; });
+			if (it == blocks.end() || it->weak != weak)
+				return false;
+			uint64_t strong = strongHash(data, length);
+			for (; it != blocks.end() && it->weak == weak; ++it)
+				if (it->strong == strong)
+				{
+					index = it->index;
+					return true;
+				}
+			return false;
+		}
+
+		bool findLast(const char* data, size_t length, uint32_t& index)const
+		{
+			if (!hasLast || (long long)last.index * blockSize + (long long)length != basisLength ||
+				weakSum(data, length) != last.weak || strongHash(data, length) != last.strong)
+				return false;
+			index = last.index;
+			return true;
+		}
+
+	private:
+		static const size_t FilterBits = 1 << 20;
+
+		static size_t filterBit(uint32_t weak)
+		{
+			return (size_t)((weak * 0x9E3779B1u) >> 12);
+		}
+	};
+
+	class Encoder
+	{//the delta operations: the consecutive blocks are one reference, the literal bytes go by pieces
+		const Signature& _basis;
+		std::ostream& _delta;
+		//the block reference not written yet
+		uint32_t _first;
+		uint32_t _count;
+		//the literal bytes begin there (in the buffer)
+		size_t _literal;
+		long long _literalBytes;
+	public:
+		Encoder(const Signature& basis, std::ostream& delta) : _basis(basis), _delta(delta)
+		{
+			_first = _count = 0;
+			_literal = 0;
+			_literalBytes = 0;
+		}
+
+		long long literalBytes()const { return _literalBytes; }
+
+		void copy(const char* buffer, size_t window, uint32_t block)
+		{//the window is the block: the bytes before it are literal
+			flushLiteral(buffer, window);
+			if (_count > 0 && block == _first + _count)
+				_count++;
+			else
+			{
+				flushCopy();
+				_first = block;
+				_count = 1;
+			}
+			_literal = window + (size_t)std::min<long long>(_basis.blockSize, _basis.basisLength - (long long)block * _basis.blockSize);
+		}
+
+		void literalGrown(const char* buffer, size_t end)
+		{
+			if (end - _literal >= MaxLiteral)
+				flushLiteral(buffer, end);
+		}
+
+		void flushLiteral(const char* buffer, size_t end)
+		{//the literal bytes up to the end
+			if (end > _literal)
+			{
+				flushCopy();
+				_delta.put('L');
+				put(_delta, (uint32_t)(end - _literal));
+				_delta.write(buffer + _literal, end - _literal);
+				_literalBytes += end - _literal;
+			}
+			_literal = end;
+		}
+
+		void shift(size_t bytes)
+		{//the buffer has been moved to the beginning by the bytes (they are written out)
+			_literal -= bytes;
+		}
+
+		void finish(const char* buffer, size_t end)
+		{
+			flushLiteral(buffer, end);
+			flushCopy();
+		}
+
+	private:
+		void flushCopy()
+		{
+			if (_count == 0)
+				return;
+			_delta.put('C');
+			put(_delta, _first);
+			put(_delta, _count);
+			_count = 0;
+		}
+	};
+};
+
+#endif //DELTASYNC_H
@@ -0,0 +1,253 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "Includes.h"
+
+class EventHandler
+{//reacts to the readiness of the watched socket
+public:
+	enum Event { Readable = 1, Writable = 2, Closed = 4 };
+
+	virtual ~EventHandler() {}
+	//events - combination of Event flags
+	virtual void handleEvents(int events) = 0;
+};
+
+class CallbackHandler : public EventHandler
+{//event handler made of a function
+private:
+	std::function<void(int)> _callback;
+public:
+	CallbackHandler() {}
+	CallbackHandler(std::function<void(int)> callback) : _callback(callback) {}
+
+	void setCallback(std::function<void(int)> callback) { _callback = callback; }
+
+	void handleEvents(int events) override
+	{
+		if (_callback) _callback(events);
+	}
+};
+
+class EventLoop
+{//single thread reactor: epoll (edge-triggered) on unix, WSAPoll on windows
+private:
+#if defined(UNIX)
+	int _epoll;
+	vector<epoll_event> _events;
+	//wakes up epoll_wait when a task is posted from the other thread
+	int _wakeUp;
+#elif defined(WINDOWS)
+	vector<WSAPOLLFD> _pollFds;
+	vector<EventHandler*> _handlers;
+#endif
+	//handlers to be called on the next iteration without waiting for the kernel
+	vector<std::pair<EventHandler*, int>> _scheduled;
+	//handlers which are called on the current iteration
+	vector<std::pair<EventHandler*, int>> _ready;
+	//handlers removed while the ready ones are being called
+	vector<EventHandler*> _removed;
+	bool _dispatching;
+
+	//tasks posted by the other threads
+	std::mutex _postedLock;
+	vector<std::function<void()>> _posted;
+	vector<std::function<void()>> _running;
+
+	//запрет копирования и присваивания
+	EventLoop(EventLoop&);
+	EventLoop& operator=(EventLoop&);
+public:
+	EventLoop(int maxEvents = 1024)
+	{
+#if defined(UNIX)
+		_epoll = epoll_create1(0);
+		if (_epoll == -1)
+			throw runtime_error("fail to create epoll instance");
+		_events.resize(maxEvents);
+
+		_wakeUp = eventfd(0, EFD_NONBLOCK);
+		if (_wakeUp == -1)
+			throw runtime_error("fail to create eventfd");
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLET;
+		//no handler, posted tasks are run after every wait
+		event.data.ptr = nullptr;
+		epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeUp, &event);
+#endif
+		_dispatching = false;
+	}
+
+	~EventLoop()
+	{
+#if defined(UNIX)
+		close(_wakeUp);
+		close(_epoll);
+#endif
+	}
+
+	bool add(SOCKET handle, EventHandler* handler)
+	{//start watching the socket, the handler has to read/write until the operation would block
+#if defined(UNIX)
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = handler;
+		return epoll_ctl(_epoll, EPOLL_CTL_ADD, handle, &event) == 0;
+#elif defined(WINDOWS)
+		WSAPOLLFD pollFd;
+		pollFd.fd = handle;
+		pollFd.events = POLLRDNORM;
+		pollFd.revents = 0;
+		_pollFds.push_back(pollFd);
+		_handlers.push_back(handler);
+		return true;
+#endif
+	}
+
+	bool remove(SOCKET handle, EventHandler* handler)
+	{
+		unschedule(handler);
+#if defined(UNIX)
+		epoll_event event;
+		return epoll_ctl(_epoll, EPOLL_CTL_DEL, handle, &event) == 0;
+#elif defined(WINDOWS)
+		int i = indexOf(handle);
+		if (i < 0) return false;
+		_pollFds[i] = _pollFds.back();
+		_pollFds.pop_back();
+		_handlers[i] = _handlers.back();
+		_handlers.pop_back();
+		return true;
+#endif
+	}
+
+	void setWriteInterest(SOCKET handle, bool enable)
+	{//level-triggered poll has to know whether the handler has something to write
+#if defined(WINDOWS)
+		int i = indexOf(handle);
+		if (i < 0) return;
+		if (enable)
+			_pollFds[i].events |= POLLWRNORM;
+		else
+			_pollFds[i].events &= ~POLLWRNORM;
+#else
+		(void)handle;
+		(void)enable;
+#endif
+	}
+
+	void schedule(EventHandler* handler, int events = 0)
+	{//handler has not finished its work (quota is spent), call it again on the next iteration
+		_scheduled.push_back(std::make_pair(handler, events));
+	}
+
+	void unschedule(EventHandler* handler)
+	{//handler is going to be destroyed
+		_scheduled.erase(std::remove_if(_scheduled.begin(), _scheduled.end(),
+			[handler](const std::pair<EventHandler*, int>& item) { return item.first == handler; }), _scheduled.end());
+		//don't call it even if it is ready on the current iteration
+		if (_dispatching)
+			_removed.push_back(handler);
+	}
+
+	void post(std::function<void()> task)
+	{//run the task in the loop thread, may be called from any thread
+		{
+			std::lock_guard<std::mutex> lock(_postedLock);
+			_posted.push_back(task);
+		}
+#if defined(UNIX)
+		uint64_t one = 1;
+		//fails only if the counter overflows, the loop is awake then anyway
+		ssize_t written = ::write(_wakeUp, &one, sizeof(one));
+		(void)written;
+#endif
+	}
+
+	int runOnce(int timeOutMs)
+	{//wait for events and call the handlers, returns number of calls
+		if (!_scheduled.empty() || hasPosted())
+			timeOutMs = 0;
+#if defined(UNIX)
+		int n = epoll_wait(_epoll, _events.data(), (int)_events.size(), timeOutMs);
+		for (int i = 0; i < n; i++)
+			if (_events[i].data.ptr == nullptr)
+			{//reset the eventfd counter
+				uint64_t count;
+				ssize_t bytesRead = ::read(_wakeUp, &count, sizeof(count));
+				(void)bytesRead;
+			}
+			else
+				_ready.push_back(std::make_pair((EventHandler*)_events[i].data.ptr, toEvents(_events[i].events)));
+#elif defined(WINDOWS)
+		int n = _pollFds.empty() ? 0 : WSAPoll(_pollFds.data(), (ULONG)_pollFds.size(), timeOutMs);
+		for (size_t i = 0; n > 0 && i < _pollFds.size(); i++)
+			if (_pollFds[i].revents)
+				_ready.push_back(std::make_pair(_handlers[i], toEvents(_pollFds[i].revents)));
+#endif
+		_ready.insert(_ready.end(), _scheduled.begin(), _scheduled.end());
+		_scheduled.clear();
+
+		_dispatching = true;
+		for (auto& item : _ready)
+			if (std::find(_removed.begin(), _removed.end(), item.first) == _removed.end())
+				item.first->handleEvents(item.second);
+		_dispatching = false;
+
+		int calls = (int)_ready.size();
+		_ready.clear();
+		_removed.clear();
+		return calls + runPosted();
+	}
+
+private:
+
+	bool hasPosted()
+	{
+		std::lock_guard<std::mutex> lock(_postedLock);
+		return !_posted.empty();
+	}
+
+	int runPosted()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_postedLock);
+			_running.swap(_posted);
+		}
+		for (auto& task : _running)
+			task();
+		int calls = (int)_running.size();
+		_running.clear();
+		return calls;
+	}
+
+#if defined(UNIX)
+	static int toEvents(uint32_t flags)
+	{
+		int events = 0;
+		if (flags & EPOLLIN) events |= EventHandler::Readable;
+		if (flags & EPOLLOUT) events |= EventHandler::Writable;
+		if (flags & (EPOLLHUP | EPOLLERR)) events |= EventHandler::Closed | EventHandler::Readable;
+		return events;
+	}
+#elif defined(WINDOWS)
+	static int toEvents(SHORT flags)
+	{
+		int events = 0;
+		if (flags & POLLRDNORM) events |= EventHandler::Readable;
+		if (flags & POLLWRNORM) events |= EventHandler::Writable;
+		if (flags & (POLLHUP | POLLERR)) events |= EventHandler::Closed | EventHandler::Readable;
+		return events;
+	}
+
+	int indexOf(SOCKET handle)
+	{
+		for (size_t i = 0; i < _pollFds.size(); i++)
+			if (_pollFds[i].fd == handle)
+				return (int)i;
+		return -1;
+	}
+#endif
+};
+
+#endif //EVENTLOOP_H
@@ -0,0 +1,273 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include "Includes.h"
+
+#include <list>
+#include <set>
+#include <unordered_map>
+
+class FileCache
+{//contents of the files which are downloaded again and again: LRU lists of the shards (each one has its own
+ //lock, the path chooses the shard) bounded by bytes. An entry is the file as it was at its modification time;
+ //the directories of the entries are watched by inotify and the changed files are dropped before the lookup,
+ //so a hit doesn't touch the file system (without inotify the modification time is checked on every lookup).
+ //The transfer keeps its content while it runs, even if the entry has been dropped
+public:
+	typedef std::shared_ptr<const vector<char>> Content;
+
+	static const size_t DefaultCapacity = 512 * 1024 * 1024;
+	static const size_t DefaultShards = 8;
+private:
+	struct Entry
+	{
+		Content content;
+		long long modified;
+		long long length;
+		std::list<string>::iterator position;
+	};
+
+	struct Shard
+	{
+		std::mutex lock;
+		//the most recently used first
+		std::list<string> order;
+		std::unordered_map<string, Entry> entries;
+		size_t bytes;
+
+		Shard() : bytes(0) {}
+	};
+
+	vector<unique_ptr<Shard>> _shards;
+	size_t _shardCapacity;
+	//larger files are read from the disk as before
+	size_t _maxEntry;
+	std::atomic<long long> _hits;
+	std::atomic<long long> _misses;
+
+	//inotify descriptor (-1 - none), the paths of the entries are prefix + name of the event
+	int _notify;
+	std::mutex _watchLock;
+	std::map<string, int> _watches;
+	std::map<int, std::set<string>> _prefixes;
+
+	//запрет копирования и присваивания
+	FileCache(FileCache&);
+	FileCache& operator=(FileCache&);
+public:
+	FileCache(size_t capacity = DefaultCapacity, size_t shards = DefaultShards) : _hits(0), _misses(0), _notify(-1)
+	{
+		shards = std::max<size_t>(shards, 1);
+		for (size_t i = 0; i < shards; i++)
+			_shards.emplace_back(new Shard());
+		_shardCapacity = capacity / shards;
+		_maxEntry = _shardCapacity / 4;
+#if defined(UNIX)
+		_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	}
+
+	~FileCache()
+	{
+#if defined(UNIX)
+		if (_notify != -1)
+			close(_notify);
+#endif
+	}
+
+	Content acquire(const string& path)
+	{//the file as it is now, from the memory or read into it;
+	 //nullptr - the file is not cached (too large, not a regular file, changed while it was read)
+		drainEvents();
+		long long modified = 0, length = 0;
+		bool checked = _notify != -1 || fileStatus(path, modified, length);
+		Shard& shard = shardOf(path);
+		{
+			std::lock_guard<std::mutex> lock(shard.lock);
+			auto it = shard.entries.find(path);
+			if (it != shard.entries.end())
+			{
+				Entry& entry = it->second;
+				if (checked && (_notify != -1 || (entry.modified == modified && entry.length == length)))
+				{
+					shard.order.splice(shard.order.begin(), shard.order, entry.position);
+					_hits++;
+					return entry.content;
+				}
+				remove(shard, it);
+			}
+		}
+		_misses++;
+		return load(path);
+	}
+
+	void invalidate(const string& path)
+	{
+		Shard& shard = shardOf(path);
+		std::lock_guard<std::mutex> lock(shard.lock);
+		auto it = shard.entries.find(path);
+		if (it != shard.entries.end())
+			remove(shard, it);
+	}
+
+	void clear()
+	{
+		for (auto& shard : _shards)
+		{
+			std::lock_guard<std::mutex> lock(shard->lock);
+			shard->entries.clear();
+			shard->order.clear();
+			shard->bytes = 0;
+		}
+	}
+
+	long long hits()const { return _hits; }
+	long long misses()const { return _misses; }
+
+	string report()
+	{//one line: counters and the size of the cache
+		size_t files = 0, bytes = 0;
+		for (auto& shard : _shards)
+		{
+			std::lock_guard<std::mutex> lock(shard->lock);
+			files += shard->entries.size();
+			bytes += shard->bytes;
+		}
+		std::ostringstream report;
+		report << "cache hits " << _hits << ", misses " << _misses << ", files " << files << ", bytes " << bytes;
+		return report.str();
+	}
+
+private:
+	Shard& shardOf(const string& path)
+	{
+		return *_shards[std::hash<string>()(path) % _shards.size()];
+	}
+
+	void remove(Shard& shard, std::unordered_map<string, Entry>::iterator it)
+	{
+		shard.bytes -= (size_t)it->second.length;
+		shard.order.erase(it->second.position);
+		shard.entries.erase(it);
+	}
+
+	Content load(const string& path)
+	{//the directory is watched before the file is read: the change made while it's read is not missed
+		if (!watch(path))
+			return nullptr;
+		long long modified, length;
+		if (!fileStatus(path, modified, length) || length > (long long)_maxEntry)
+			return nullptr;
+		vector<char> data((size_t)length);
+		std::ifstream file(path, ios::in | ios::binary);
+		file.read(data.data(), length);
+		long long modifiedAfter, lengthAfter;
+		if (file.gcount() != length || !fileStatus(path, modifiedAfter, lengthAfter) ||
+			modifiedAfter != modified || lengthAfter != length)
+			return nullptr;
+
+		Content content = std::make_shared<const vector<char>>(std::move(data));
+		Shard& shard = shardOf(path);
+		std::lock_guard<std::mutex> lock(shard.lock);
+		auto it = shard.entries.find(path);
+		if (it != shard.entries.end())
+			//loaded by the other worker
+			remove(shard, it);
+		while (!shard.order.empty() && shard.bytes + (size_t)length > _shardCapacity)
+			remove(shard, shard.entries.find(shard.order.back()));
+		shard.order.push_front(path);
+		Entry& entry = shard.entries[path];
+		entry.content = content;
+		entry.modified = modified;
+		entry.length = length;
+		entry.position = shard.order.begin();
+		shard.bytes += (size_t)length;
+		return content;
+	}
+
+	bool watch(const string& path)
+	{//false if the changes of the file can't be followed
+#if defined(UNIX)
+		if (_notify == -1)
+			return true;
+		size_t slash = path.rfind('/');
+		string prefix = (slash == string::npos) ? string() : path.substr(0, slash + 1);
+		string directory = prefix.empty() ? string(".") : prefix;
+		std::lock_guard<std::mutex> lock(_watchLock);
+		if (_watches.find(directory) != _watches.end())
+			return true;
+		int handle = inotify_add_watch(_notify, directory.c_str(), IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+			IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+		if (handle == -1)
+			return false;
+		_watches[directory] = handle;
+		//"a/x" and "./a/x" are the same directory
+		_prefixes[handle].insert(prefix);
+#endif
+		return true;
+	}
+
+	void drainEvents()
+	{//the changed files are dropped; everything is dropped if the events have been lost
+#if defined(UNIX)
+		if (_notify == -1)
+			return;
+		std::lock_guard<std::mutex> lock(_watchLock);
+		alignas(inotify_event) char buffer[4096];
+		while (true)
+		{
+			ssize_t length = read(_notify, buffer, sizeof(buffer));
+			if (length <= 0)
+				break;
+			for (char* next = buffer; next < buffer + length;)
+			{
+				const inotify_event* event = (const inotify_event*)next;
+				next += sizeof(inotify_event) + event->len;
+				if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+				{//the directory itself has gone: it's watched again with the next file
+					if (event->mask & IN_IGNORED)
+						forgetWatch(event->wd);
+					clear();
+				}
+				else if (event->len > 0)
+				{
+					auto it = _prefixes.find(event->wd);
+					if (it != _prefixes.end())
+						for (const string& prefix : it->second)
+							invalidate(prefix + event->name);
+				}
+			}
+		}
+#endif
+	}
+
+	void forgetWatch(int handle)
+	{
+		for (auto it = _watches.begin(); it != _watches.end();)
+			if (it->second == handle)
+				it = _watches.erase(it);
+			else
+				++it;
+		_prefixes.erase(handle);
+	}
+
+	static bool fileStatus(const string& path, long long& modified, long long& length)
+	{//regular file only
+#if defined(UNIX)
+		struct stat status;
+		if (::stat(path.c_str(), &status) != 0 || !S_ISREG(status.st_mode))
+			return false;
+		modified = (long long)status.st_mtim.tv_sec * 1000000000LL + status.st_mtim.tv_nsec;
+		length = (long long)status.st_size;
+#else
+		struct _stat64 status;
+		if (_stat64(path.c_str(), &status) != 0 || (status.st_mode & _S_IFREG) == 0)
+			return false;
+		modified = (long long)status.st_mtime;
+		length = (long long)status.st_size;
+#endif
+		return true;
+	}
+};
+
+#endif //FILECACHE_H
@@ -13,6 +13,8 @@
 #include <WS2tcpip.h>
 #include <Mstcpip.h>	//keep_alive
 #include <Windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>	//_stat64
 
 //for server windows,to link
 #pragma comment(lib, "Ws2_32.lib")
@@ -30,6 +32,16 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/statvfs.h>
 
 #include <errno.h>
 
@@ -44,15 +56,19 @@
 #include <algorithm>
 #include <map>
 #include <ctime>
-#include <regex>
 #include <cstring>
 #include <fstream>
 #include <queue>
+#include <deque>
 #include <memory>
 #include <time.h>
 #include <random>
 #include <memory>
 #include <limits>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 using namespace std;
 
@@ -77,8 +93,6 @@ using namespace std;
 #define SD_SEND SHUT_WR
 #endif
 
-using CommandMap = std::map< std::string, std::function<bool(string&)> >;
-
 //versions of Winsock;
 //the older, limited version
 #define SOCKET_V1 0x0101
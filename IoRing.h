@@ -0,0 +1,349 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include "EventLoop.h"
+
+struct IoOperation
+{//one operation of the linked chain
+	enum Kind { Read, Write, Send, Receive };
+
+	Kind kind;
+	int handle;
+	char* data;
+	unsigned length;
+	//file position (Read, Write)
+	long long offset;
+	//MSG_* flags (Send, Receive)
+	int flags;
+};
+
+class IoCompletion
+{//receiver of the operation results
+public:
+	virtual ~IoCompletion() {}
+	//tag - given with the chain, index - operation in the chain,
+	//result - bytes number or -errno (-ECANCELED after the failed operation of the chain)
+	virtual void completed(unsigned tag, unsigned index, int result) = 0;
+};
+
+class IoRing : public EventHandler
+{//io_uring of the event loop thread: the transfers submit chains of linked operations
+ //(many transfers in flight on one ring), completions come through eventfd watched by the loop;
+ //if the kernel doesn't support io_uring available() is false and the usual calls are used
+private:
+	struct Pending
+	{
+		IoCompletion* target;
+		//scheduled after the completion
+		EventHandler* owner;
+		unsigned tag;
+		unsigned index;
+		//memory of the operation lives until the kernel is done with it
+		std::shared_ptr<vector<char>> buffer;
+	};
+
+	EventLoop& _eventLoop;
+	int _ringHandle;
+#if defined(UNIX)
+	int _wakeUp;
+	io_uring_params _params;
+	void* _sqRing;
+	size_t _sqRingSize;
+	void* _cqRing;
+	size_t _cqRingSize;
+	io_uring_sqe* _sqes;
+	size_t _sqesSize;
+	unsigned* _sqHead;
+	unsigned* _sqTail;
+	unsigned _sqMask;
+	unsigned* _sqArray;
+	unsigned* _cqHead;
+	unsigned* _cqTail;
+	unsigned _cqMask;
+	io_uring_cqe* _cqes;
+#endif
+	//submitted operations by user_data
+	std::map<unsigned long long, Pending> _pending;
+	unsigned long long _nextId;
+	//cancel operations in flight (their completions take the places in the queue too)
+	unsigned _cancels;
+	//operations of the chains the kernel has taken partly, cancelled on the next call
+	vector<Pending> _dropped;
+	vector<EventHandler*> _owners;
+
+	//запрет копирования и присваивания
+	IoRing(IoRing&);
+	IoRing& operator=(IoRing&);
+public:
+	IoRing(EventLoop& eventLoop, unsigned entries = 256) : _eventLoop(eventLoop)
+	{
+		_ringHandle = -1;
+		_nextId = 1;
+		_cancels = 0;
+#if defined(UNIX)
+		_wakeUp = -1;
+		_sqRing = _cqRing = MAP_FAILED;
+		_sqes = (io_uring_sqe*)MAP_FAILED;
+		if (!setup(entries))
+			release();
+#endif
+	}
+
+	~IoRing()
+	{
+		release();
+	}
+
+	bool available()const { return _ringHandle != -1; }
+	EventLoop& eventLoop()const { return _eventLoop; }
+
+	bool submit(vector<IoOperation>& chain, IoCompletion* target, EventHandler* owner, unsigned tag, std::shared_ptr<vector<char>>& buffer)
+	{//operations are linked: each starts after the previous one is completed entirely,
+	 //a failure cancels the rest; false if the ring is busy (nothing is submitted)
+#if defined(UNIX)
+		unsigned count = (unsigned)chain.size();
+		unsigned first = *_sqTail;
+		unsigned tail = first;
+		unsigned long long firstId = _nextId;
+		if (count == 0 || !available() || _pending.size() + _cancels + count > _params.cq_entries ||
+			tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) + count > _params.sq_entries)
+			return false;
+
+		for (unsigned i = 0; i < count; i++, tail++)
+		{
+			unsigned long long id = _nextId++;
+			io_uring_sqe* sqe = prepare(tail, id);
+			IoOperation& operation = chain[i];
+			sqe->opcode = opcode(operation.kind);
+			sqe->fd = operation.handle;
+			sqe->addr = (unsigned long long)operation.data;
+			sqe->len = operation.length;
+			if (operation.kind == IoOperation::Read || operation.kind == IoOperation::Write)
+				sqe->off = operation.offset;
+			else
+				sqe->msg_flags = operation.flags;
+			if (i + 1 < count)
+				sqe->flags = IOSQE_IO_LINK;
+
+			Pending& pending = _pending[id];
+			pending.target = target;
+			pending.owner = owner;
+			pending.tag = tag;
+			pending.index = i;
+			pending.buffer = buffer;
+		}
+		unsigned taken = enter(first, count);
+		if (taken == 0)
+		{//the kernel has not seen the chain
+			for (unsigned i = 0; i < count; i++)
+				_pending.erase(firstId + i);
+			return false;
+		}
+		if (taken < count)
+		{//the taken operations are in flight, the rest is cancelled as after the failure in the chain
+			for (unsigned i = taken; i < count; i++)
+			{
+				auto it = _pending.find(firstId + i);
+				_dropped.push_back(it->second);
+				_pending.erase(it);
+			}
+			_eventLoop.schedule(this);
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void detach(IoCompletion* target)
+	{//the target is going to be destroyed (or moved): no more results, its operations are cancelled
+	 //while the completion queue has room (the rest complete by themselves, their results are dropped)
+		for (Pending& pending : _dropped)
+			if (pending.target == target)
+				pending.target = nullptr;
+#if defined(UNIX)
+		if (!available())
+			return;
+		unsigned first = *_sqTail;
+		unsigned count = 0;
+		for (auto& item : _pending)
+		{
+			if (item.second.target != target)
+				continue;
+			item.second.target = nullptr;
+			if (_pending.size() + _cancels + count >= _params.cq_entries)
+				continue;
+			if (first + count - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) == _params.sq_entries)
+			{
+				_cancels += enter(first, count);
+				first = *_sqTail;
+				count = 0;
+			}
+			//cancel operation has no result to report (user_data 0)
+			io_uring_sqe* sqe = prepare(first + count, 0);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = item.first;
+			count++;
+		}
+		if (count > 0)
+			_cancels += enter(first, count);
+#endif
+	}
+
+	void handleEvents(int) override
+	{//deliver the completions
+		vector<Pending> dropped;
+		dropped.swap(_dropped);
+		for (Pending& pending : dropped)
+			deliver(pending, -ECANCELED);
+#if defined(UNIX)
+		uint64_t counter;
+		ssize_t bytesRead = ::read(_wakeUp, &counter, sizeof(counter));
+		(void)bytesRead;
+
+		unsigned head = *_cqHead;
+		while (head != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+		{
+			io_uring_cqe& cqe = _cqes[head & _cqMask];
+			unsigned long long id = cqe.user_data;
+			int result = cqe.res;
+			__atomic_store_n(_cqHead, ++head, __ATOMIC_RELEASE);
+
+			if (id == 0)
+			{
+				_cancels--;
+				continue;
+			}
+			auto it = _pending.find(id);
+			if (it == _pending.end())
+				continue;
+			Pending pending = it->second;
+			_pending.erase(it);
+			deliver(pending, result);
+		}
+#endif
+		for (EventHandler* owner : _owners)
+			_eventLoop.schedule(owner);
+		_owners.clear();
+	}
+
+private:
+	void deliver(Pending& pending, int result)
+	{
+		if (pending.target == nullptr)
+			return;
+		pending.target->completed(pending.tag, pending.index, result);
+		if (std::find(_owners.begin(), _owners.end(), pending.owner) == _owners.end())
+			_owners.push_back(pending.owner);
+	}
+
+#if defined(UNIX)
+	bool setup(unsigned entries)
+	{
+		memset(&_params, 0, sizeof(_params));
+		_ringHandle = (int)syscall(__NR_io_uring_setup, entries, &_params);
+		if (_ringHandle < 0)
+		{//ENOSYS, EPERM (seccomp) and so on
+			_ringHandle = -1;
+			return false;
+		}
+
+		_sqRingSize = _params.sq_off.array + _params.sq_entries * sizeof(unsigned);
+		_cqRingSize = _params.cq_off.cqes + _params.cq_entries * sizeof(io_uring_cqe);
+		if (_params.features & IORING_FEAT_SINGLE_MMAP)
+			_sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+		_sqRing = mmap(0, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringHandle, IORING_OFF_SQ_RING);
+		if (_sqRing == MAP_FAILED)
+			return false;
+		if (_params.features & IORING_FEAT_SINGLE_MMAP)
+			_cqRing = _sqRing;
+		else
+			_cqRing = mmap(0, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringHandle, IORING_OFF_CQ_RING);
+		if (_cqRing == MAP_FAILED)
+			return false;
+		_sqesSize = _params.sq_entries * sizeof(io_uring_sqe);
+		_sqes = (io_uring_sqe*)mmap(0, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringHandle, IORING_OFF_SQES);
+		if (_sqes == MAP_FAILED)
+			return false;
+
+		char* sq = (char*)_sqRing;
+		_sqHead = (unsigned*)(sq + _params.sq_off.head);
+		_sqTail = (unsigned*)(sq + _params.sq_off.tail);
+		_sqMask = *(unsigned*)(sq + _params.sq_off.ring_mask);
+		_sqArray = (unsigned*)(sq + _params.sq_off.array);
+		char* cq = (char*)_cqRing;
+		_cqHead = (unsigned*)(cq + _params.cq_off.head);
+		_cqTail = (unsigned*)(cq + _params.cq_off.tail);
+		_cqMask = *(unsigned*)(cq + _params.cq_off.ring_mask);
+		_cqes = (io_uring_cqe*)(cq + _params.cq_off.cqes);
+
+		//completions wake up the event loop
+		_wakeUp = eventfd(0, EFD_NONBLOCK);
+		if (_wakeUp == -1)
+			return false;
+		if (syscall(__NR_io_uring_register, _ringHandle, IORING_REGISTER_EVENTFD, &_wakeUp, 1) != 0)
+			return false;
+		return _eventLoop.add(_wakeUp, this);
+	}
+
+	io_uring_sqe* prepare(unsigned tail, unsigned long long id)
+	{
+		unsigned index = tail & _sqMask;
+		io_uring_sqe* sqe = &_sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->user_data = id;
+		_sqArray[index] = index;
+		return sqe;
+	}
+
+	unsigned enter(unsigned first, unsigned count)
+	{//the entries from the first are submitted, the number the kernel has taken;
+	 //the rest are taken back from the ring (the kernel reads the tail only when it's entered)
+		__atomic_store_n(_sqTail, first + count, __ATOMIC_RELEASE);
+		long taken = syscall(__NR_io_uring_enter, _ringHandle, count, 0, 0, NULL, 0);
+		if (taken < 0)
+			taken = 0;
+		if ((unsigned)taken < count)
+			__atomic_store_n(_sqTail, first + (unsigned)taken, __ATOMIC_RELEASE);
+		return (unsigned)taken;
+	}
+
+	static unsigned char opcode(IoOperation::Kind kind)
+	{
+		switch (kind)
+		{
+		case IoOperation::Read: return IORING_OP_READ;
+		case IoOperation::Write: return IORING_OP_WRITE;
+		case IoOperation::Send: return IORING_OP_SEND;
+		default: return IORING_OP_RECV;
+		}
+	}
+#endif
+
+	void release()
+	{
+#if defined(UNIX)
+		if (_wakeUp != -1)
+		{
+			_eventLoop.remove(_wakeUp, this);
+			close(_wakeUp);
+		}
+		if (_sqes != MAP_FAILED)
+			munmap(_sqes, _sqesSize);
+		if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+			munmap(_cqRing, _cqRingSize);
+		if (_sqRing != MAP_FAILED)
+			munmap(_sqRing, _sqRingSize);
+		//the kernel cancels the operations in flight
+		if (_ringHandle != -1)
+			close(_ringHandle);
+		_wakeUp = -1;
+		_sqRing = _cqRing = MAP_FAILED;
+		_sqes = (io_uring_sqe*)MAP_FAILED;
+#endif
+		_ringHandle = -1;
+	}
+};
+
+#endif //IORING_H
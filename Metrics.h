@@ -0,0 +1,413 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "Socket.h"
+
+#include <iomanip>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+class Histogram
+{//HDR-style histogram of the non-negative values: every power of 2 is split into SubBuckets linear buckets
+ //(the relative error is within 1/SubBuckets). One thread records (no locks, no read-modify-write),
+ //any thread reads
+public:
+	static const int SubBits = 3;
+	static const int SubBuckets = 1 << SubBits;
+	//values up to 2^MaxBits - 1, the larger ones go to the last bucket
+	static const int MaxBits = 40;
+	static const int Buckets = (MaxBits - SubBits + 1) * SubBuckets;
+private:
+	std::atomic<unsigned long long> _counts[Buckets];
+	std::atomic<unsigned long long> _count;
+	std::atomic<unsigned long long> _sum;
+
+	//запрет копирования и присваивания
+	Histogram(Histogram&);
+	Histogram& operator=(Histogram&);
+public:
+	Histogram() : _count(0), _sum(0)
+	{
+		for (auto& count : _counts)
+			count.store(0, std::memory_order_relaxed);
+	}
+
+	void record(long long value)
+	{
+		unsigned long long sample = (value < 0) ? 0 : (unsigned long long)value;
+		bump(_counts[bucket(sample)], 1);
+		bump(_count, 1);
+		bump(_sum, sample);
+	}
+
+	unsigned long long count(int index)const { return _counts[index].load(std::memory_order_relaxed); }
+	unsigned long long count()const { return _count.load(std::memory_order_relaxed); }
+	unsigned long long sum()const { return _sum.load(std::memory_order_relaxed); }
+
+	static int bucket(unsigned long long value)
+	{
+		if (value < 2 * SubBuckets)
+			return (int)value;
+		int top = highestBit(value);
+		if (top >= MaxBits)
+			return Buckets - 1;
+		int shift = top - SubBits;
+		return (shift + 1) * SubBuckets + (int)(value >> shift) - SubBuckets;
+	}
+
+	static unsigned long long upper(int index)
+	{//the largest value of the bucket
+		if (index < 2 * SubBuckets)
+			return index;
+		int shift = index / SubBuckets - 1;
+		unsigned long long top = index % SubBuckets + SubBuckets;
+		return ((top + 1) << shift) - 1;
+	}
+
+	static void bump(std::atomic<unsigned long long>& value, unsigned long long amount)
+	{//the only writer: plain load and store (no lock prefix)
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+private:
+	static int highestBit(unsigned long long value)
+	{
+#if defined(_MSC_VER)
+		unsigned long index = 0;
+		_BitScanReverse64(&index, value);
+		return (int)index;
+#else
+		return 63 - __builtin_clzll(value);
+#endif
+	}
+};
+
+struct HistogramSnapshot
+{//sum of the threads' histograms of one metric
+	vector<unsigned long long> counts;
+	unsigned long long count;
+	unsigned long long sum;
+
+	HistogramSnapshot() : counts(Histogram::Buckets, 0), count(0), sum(0) {}
+
+	void add(const Histogram& histogram)
+	{
+		for (int i = 0; i < Histogram::Buckets; i++)
+			counts[i] += histogram.count(i);
+		count += histogram.count();
+		sum += histogram.sum();
+	}
+
+	unsigned long long percentile(double fraction)const
+	{//upper bound of the bucket of the rank
+		if (count == 0)
+			return 0;
+		unsigned long long rank = std::max<unsigned long long>((unsigned long long)(fraction * count + 0.5), 1);
+		unsigned long long seen = 0;
+		for (int i = 0; i < Histogram::Buckets; i++)
+			if ((seen += counts[i]) >= rank)
+				return Histogram::upper(i);
+		return Histogram::upper(Histogram::Buckets - 1);
+	}
+};
+
+struct MetricsShard
+{//counters and histograms of one thread: only the thread writes them, the registry reads them
+	static const int MaxCommands = 64;
+
+	std::atomic<unsigned long long> accepted;
+	std::atomic<unsigned long long> commands;
+	//reconnections to resume the transfer: the client's attempts, the server's reconnected clients
+	std::atomic<unsigned long long> reconnects;
+	std::atomic<unsigned long long> reconnectFailures;
+	//UDP: acknowledged offsets differ from the sent ones (nPacks window), datagrams sent again (sliding window)
+	std::atomic<unsigned long long> windowFailures;
+	std::atomic<unsigned long long> resends;
+	std::atomic<unsigned long long> transfers;
+	std::atomic<unsigned long long> transferFailures;
+	std::atomic<unsigned long long> transferBytes;
+	//bytes per second of the completed transfers
+	Histogram transferRate;
+	//dispatch latency (us) by the index of the command (see CommandTable), created by the first call;
+	//the name is set before the histogram is published
+	std::atomic<Histogram*> commandLatency[MaxCommands];
+	const char* commandNames[MaxCommands];
+	//some thread records into the shard
+	std::atomic<bool> owned;
+
+	MetricsShard() : accepted(0), commands(0), reconnects(0), reconnectFailures(0), windowFailures(0), resends(0),
+		transfers(0), transferFailures(0), transferBytes(0), owned(false)
+	{
+		for (int i = 0; i < MaxCommands; i++)
+		{
+			commandLatency[i].store(nullptr, std::memory_order_relaxed);
+			commandNames[i] = nullptr;
+		}
+	}
+
+	~MetricsShard()
+	{
+		for (auto& histogram : commandLatency)
+			delete histogram.load();
+	}
+
+	static void count(std::atomic<unsigned long long>& counter, unsigned long long amount = 1)
+	{
+		Histogram::bump(counter, amount);
+	}
+
+	void command(int index, const char* name, long long us)
+	{//name lives as long as the command table (literal)
+		if (index < 0 || index >= MaxCommands)
+			return;
+		Histogram* histogram = commandLatency[index].load(std::memory_order_relaxed);
+		if (histogram == nullptr)
+		{
+			histogram = new Histogram();
+			commandNames[index] = name;
+			commandLatency[index].store(histogram, std::memory_order_release);
+		}
+		histogram->record(us);
+	}
+
+	void transferEnded(bool completed, long long bytes, long long elapsedUs)
+	{
+		count(completed ? transfers : transferFailures);
+		count(transferBytes, (unsigned long long)std::max(bytes, 0LL));
+		if (completed && elapsedUs > 0)
+			transferRate.record(bytes * 1000000 / elapsedUs);
+	}
+};
+
+class Metrics
+{//registry of the threads' shards: the recording thread finds its own shard (thread_local) and takes no lock,
+ //the reader sums the shards under the lock. The shards are never freed: the shard of the finished thread
+ //goes to the next new one, its counts stay
+	struct ShardOwner
+	{
+		MetricsShard* shard;
+
+		ShardOwner() : shard(nullptr) {}
+		~ShardOwner()
+		{
+			if (shard != nullptr)
+				shard->owned = false;
+		}
+	};
+
+	std::mutex _lock;
+	std::deque<MetricsShard> _shards;
+	long long _startedAt;
+
+	Metrics() : _startedAt(nowUs()) {}
+	//запрет копирования и присваивания
+	Metrics(Metrics&);
+	Metrics& operator=(Metrics&);
+public:
+	static Metrics& global()
+	{//the threads may record while the process exits: the registry is not destroyed
+		static Metrics* metrics = new Metrics();
+		return *metrics;
+	}
+
+	static MetricsShard& local()
+	{
+		static thread_local ShardOwner owner;
+		if (owner.shard == nullptr)
+			owner.shard = global().take();
+		return *owner.shard;
+	}
+
+	static long long nowUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	string report()
+	{//one line for the clients reading the reply by lines
+		Totals totals;
+		collect(totals);
+		double uptime = (nowUs() - _startedAt) / 1e6;
+		std::ostringstream report;
+		report << fixed << setprecision(1)
+			<< "uptime " << uptime << " s"
+			<< ", accepted " << totals.accepted << " (" << (uptime > 0 ? totals.accepted / uptime : 0.0) << "/s)"
+			<< ", commands " << totals.commands
+			<< ", reconnects " << totals.reconnects << " (failed " << totals.reconnectFailures << ")"
+			<< ", udp window failures " << totals.windowFailures << ", udp resends " << totals.resends
+			<< ", transfers " << totals.transfers << " (failed " << totals.transferFailures
+			<< ", " << totals.transferBytes / 1e6 << " MB"
+			<< ", rate p50 " << totals.transferRate.percentile(0.5) / 1e6
+			<< " p99 " << totals.transferRate.percentile(0.99) / 1e6 << " MB/s)";
+		for (auto& item : totals.commandLatency)
+			report << "; " << item.first << " " << item.second.count
+				<< ": p50 " << item.second.percentile(0.5)
+				<< " p99 " << item.second.percentile(0.99)
+				<< " p999 " << item.second.percentile(0.999) << " us";
+		return report.str();
+	}
+
+	string prometheus()
+	{//text exposition format
+		Totals totals;
+		collect(totals);
+		std::ostringstream text;
+		text << setprecision(12);
+		gauge(text, "server_uptime_seconds", "Time since the first metric.", (nowUs() - _startedAt) / 1e6);
+		counter(text, "server_accepted_total", "TCP connections accepted.", totals.accepted);
+		counter(text, "server_commands_total", "Commands received.", totals.commands);
+		counter(text, "server_reconnects_total", "Reconnections of the clients with a transfer.", totals.reconnects);
+		counter(text, "server_reconnect_failures_total", "Reconnections which have not resumed the transfer.", totals.reconnectFailures);
+		counter(text, "server_udp_window_failures_total", "UDP windows whose acknowledged offsets differ from the sent ones.", totals.windowFailures);
+		counter(text, "server_udp_resends_total", "UDP datagrams sent again by the sliding window.", totals.resends);
+		counter(text, "server_transfers_total", "Completed transfers.", totals.transfers);
+		counter(text, "server_transfer_failures_total", "Failed transfers.", totals.transferFailures);
+		counter(text, "server_transfer_bytes_total", "Bytes moved by the finished transfers.", totals.transferBytes);
+
+		text << "# HELP server_command_duration_seconds Command dispatch latency.\n"
+			<< "# TYPE server_command_duration_seconds histogram\n";
+		for (auto& item : totals.commandLatency)
+			histogram(text, "server_command_duration_seconds", "command=\"" + item.first + "\"", item.second, 1e-6);
+		text << "# HELP server_transfer_rate_bytes_per_second Rate of the completed transfers.\n"
+			<< "# TYPE server_transfer_rate_bytes_per_second histogram\n";
+		histogram(text, "server_transfer_rate_bytes_per_second", "", totals.transferRate, 1);
+		return text.str();
+	}
+
+private:
+	struct Totals
+	{
+		unsigned long long accepted = 0;
+		unsigned long long commands = 0;
+		unsigned long long reconnects = 0;
+		unsigned long long reconnectFailures = 0;
+		unsigned long long windowFailures = 0;
+		unsigned long long resends = 0;
+		unsigned long long transfers = 0;
+		unsigned long long transferFailures = 0;
+		unsigned long long transferBytes = 0;
+		HistogramSnapshot transferRate;
+		std::map<string, HistogramSnapshot> commandLatency;
+	};
+
+	MetricsShard* take()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		for (MetricsShard& shard : _shards)
+			if (!shard.owned)
+			{
+				shard.owned = true;
+				return &shard;
+			}
+		_shards.emplace_back();
+		_shards.back().owned = true;
+		return &_shards.back();
+	}
+
+	void collect(Totals& totals)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		for (MetricsShard& shard : _shards)
+		{
+			totals.accepted += shard.accepted;
+			totals.commands += shard.commands;
+			totals.reconnects += shard.reconnects;
+			totals.reconnectFailures += shard.reconnectFailures;
+			totals.windowFailures += shard.windowFailures;
+			totals.resends += shard.resends;
+			totals.transfers += shard.transfers;
+			totals.transferFailures += shard.transferFailures;
+			totals.transferBytes += shard.transferBytes;
+			totals.transferRate.add(shard.transferRate);
+			for (int i = 0; i < MetricsShard::MaxCommands; i++)
+			{
+				Histogram* histogram = shard.commandLatency[i].load(std::memory_order_acquire);
+				if (histogram != nullptr)
+					totals.commandLatency[shard.commandNames[i]].add(*histogram);
+			}
+		}
+	}
+
+	static void counter(ostream& text, const char* name, const char* help, unsigned long long value)
+	{
+		text << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n" << name << " " << value << "\n";
+	}
+
+	static void gauge(ostream& text, const char* name, const char* help, double value)
+	{
+		text << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n" << name << " " << value << "\n";
+	}
+
+	static void histogram(ostream& text, const string& name, const string& labels, const HistogramSnapshot& snapshot, double scale)
+	{//cumulative buckets at the powers of 2 (the bounds of the HDR buckets) up to the last value
+		string prefix = labels.empty() ? "" : labels + ",";
+		int last = 0;
+		for (int i = 0; i < Histogram::Buckets; i++)
+			if (snapshot.counts[i] > 0)
+				last = i;
+		unsigned long long cumulative = 0;
+		for (int i = 0; i < Histogram::Buckets; i++)
+		{
+			cumulative += snapshot.counts[i];
+			bool bound = i >= 2 * Histogram::SubBuckets - 1 && (i + 1) % Histogram::SubBuckets == 0;
+			if (bound && (i == 2 * Histogram::SubBuckets - 1 || i - Histogram::SubBuckets < last))
+				text << name << "_bucket{" << prefix << "le=\"" << Histogram::upper(i) * scale << "\"} " << cumulative << "\n";
+		}
+		text << name << "_bucket{" << prefix << "le=\"+Inf\"} " << snapshot.count << "\n";
+		string braces = labels.empty() ? "" : "{" + labels + "}";
+		text << name << "_sum" << braces << " " << snapshot.sum * scale << "\n";
+		text << name << "_count" << braces << " " << snapshot.count << "\n";
+	}
+};
+
+class MetricsEndpoint
+{//Metrics::prometheus() over HTTP in its own thread: any request of the scraper gets the text
+	unique_ptr<ServerSocket> _socket;
+	std::thread _thread;
+	std::atomic<bool> _stop;
+
+	//запрет копирования и присваивания
+	MetricsEndpoint(MetricsEndpoint&);
+	MetricsEndpoint& operator=(MetricsEndpoint&);
+public:
+	MetricsEndpoint(char* nodeName, char* serviceName) : _socket(new ServerSocket(nodeName, serviceName)), _stop(false)
+	{
+		_thread = std::thread(&MetricsEndpoint::run, this);
+	}
+
+	~MetricsEndpoint()
+	{
+		_stop = true;
+		_thread.join();
+	}
+
+private:
+	void run()
+	{
+		while (!_stop)
+		{
+			//the stop flag is checked every second
+			if (!_socket->select(Socket::Selection::ReadCheck, 1))
+				continue;
+			unique_ptr<Socket> client(_socket->accept());
+			if (!client->isValid())
+				continue;
+			client->setReceiveTimeOut(1);
+			//the request line and the headers
+			string request;
+			char buffer[1024];
+			int bytesRead = 0;
+			while (request.find("\r\n\r\n") == string::npos && request.size() < 8 * sizeof(buffer) &&
+				(bytesRead = client->receive(buffer, sizeof(buffer))) > 0)
+				request.append(buffer, bytesRead);
+			string body = Metrics::global().prometheus();
+			string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+				toString(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+			client->sendall(response.data(), (int)response.size(), 0);
+		}
+	}
+};
+
+#endif //METRICS_H
@@ -0,0 +1,434 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "EventLoop.h"
+#include "Trace.h"
+
+#include <condition_variable>
+
+//disk stages of the buffered transfers (no sendfile, splice or io_uring): the thread of the stage works
+//with the ring of blocks while the network stage works with the socket, so the disk and the network
+//overlap; the full ring stops the faster stage (backpressure). The network stage of the blocking transfer
+//waits for the disk stage, the one of the event loop never does: the disk stage wakes the loop when
+//it's ready (see StageWakeUp). The disk work of the commands (delta signatures and patches) goes to
+//the worker's DiskTasks thread
+
+class StageWakeUp : public std::enable_shared_from_this<StageWakeUp>
+{//the disk stage's signal to the event loop which drives the transfer: the owner of the transfer is
+ //scheduled in the loop thread (EventLoop::post() wakes the loop through its eventfd, on windows the task
+ //waits for the poll time-out); nothing is scheduled when the transfer has left the owner
+	std::mutex _lock;
+	EventLoop* _eventLoop;
+	EventHandler* _owner;
+
+	//запрет копирования и присваивания
+	StageWakeUp(StageWakeUp&);
+	StageWakeUp& operator=(StageWakeUp&);
+public:
+	StageWakeUp() : _eventLoop(nullptr), _owner(nullptr) {}
+
+	void attach(EventLoop* eventLoop, EventHandler* owner)
+	{//in the loop thread; nullptr - the transfer has no owner (it's blocking or parked)
+		std::lock_guard<std::mutex> lock(_lock);
+		_eventLoop = eventLoop;
+		_owner = owner;
+	}
+
+	void notify()
+	{//in the stage thread
+		EventLoop* eventLoop = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			eventLoop = _eventLoop;
+		}
+		if (eventLoop == nullptr)
+			return;
+		std::weak_ptr<StageWakeUp> weak = shared_from_this();
+		eventLoop->post([weak, eventLoop]()
+		{
+			std::shared_ptr<StageWakeUp> wakeUp = weak.lock();
+			if (!wakeUp)
+				return;
+			std::lock_guard<std::mutex> lock(wakeUp->_lock);
+			//the transfer may have moved to the other loop meanwhile
+			if (wakeUp->_eventLoop == eventLoop && wakeUp->_owner != nullptr)
+				eventLoop->schedule(wakeUp->_owner);
+		});
+	}
+};
+
+class ReadAhead
+{//download: the file (the range) is read into the blocks ahead of the sender, the sender takes
+ //the filled blocks in order; the position out of order (resume) moves the reader to it
+public:
+	//acquire(): the block is being read
+	static const int Pending = -2;
+private:
+	struct Block
+	{
+		vector<char> data;
+		long long offset;
+		int length;
+	};
+
+	string _fileName;
+	long long _rangeBegin;
+	long long _fileLength;
+	std::function<void()> _ready;
+	vector<Block> _ring;
+	std::thread _thread;
+	std::mutex _lock;
+	std::condition_variable _filled;
+	std::condition_variable _freed;
+	//the oldest filled block, number of the filled blocks, bytes of the oldest one already sent
+	size_t _head;
+	size_t _count;
+	int _consumed;
+	//the reader: file offset of the next block, the file can't be read
+	long long _next;
+	bool _failed;
+	bool _stop;
+	//the sender has been told Pending, the moves of the sender (the block read before the move is dropped)
+	bool _waiting;
+	unsigned _moves;
+
+	//запрет копирования и присваивания
+	ReadAhead(ReadAhead&);
+	ReadAhead& operator=(ReadAhead&);
+public:
+	//ready - called by the reader when the sender may go on after Pending
+	ReadAhead(const string& fileName, long long rangeBegin, long long fileLength, int blockSize, int depth,
+		std::function<void()> ready)
+		: _fileName(fileName), _rangeBegin(rangeBegin), _fileLength(fileLength), _ready(ready), _ring(std::max(depth, 2)),
+		_head(0), _count(0), _consumed(0), _next(0), _failed(false), _stop(false), _waiting(false), _moves(0)
+	{
+		for (Block& block : _ring)
+			block.data.resize(std::max(blockSize, 1));
+		_thread = std::thread(&ReadAhead::run, this);
+	}
+
+	~ReadAhead()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stop = true;
+			_freed.notify_all();
+		}
+		_thread.join();
+	}
+
+	int acquire(long long offset, int length, const char*& data, bool wait)
+	{//the bytes from the offset (up to length, they don't cross the block); 0 - the file ends, -1 - it can't
+	 //be read, Pending - the block is not read yet (only if the sender doesn't wait for it)
+		std::unique_lock<std::mutex> lock(_lock);
+		if (_count > 0 ? _ring[_head].offset + _consumed != offset : _next != offset)
+		{//the sender has moved (resumed transfer)
+			_head = _count = 0;
+			_consumed = 0;
+			_next = offset;
+			_moves++;
+			_freed.notify_all();
+		}
+		if (wait)
+			_filled.wait(lock, [this]() { return _count > 0 || _failed || _next >= _fileLength; });
+		if (_count == 0)
+		{
+			if (_failed || _next >= _fileLength)
+				return _failed ? -1 : 0;
+			_waiting = true;
+			return Pending;
+		}
+		Block& block = _ring[_head];
+		data = block.data.data() + _consumed;
+		return std::min(length, block.length - _consumed);
+	}
+
+	void release(int length)
+	{//the acquired bytes have been sent
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_count == 0)
+			return;
+		_consumed += length;
+		if (_consumed < _ring[_head].length)
+			return;
+		_head = (_head + 1) % _ring.size();
+		_count--;
+		_consumed = 0;
+		_freed.notify_one();
+	}
+
+private:
+	void run()
+	{
+		std::ifstream file(_fileName, ios::in | ios::binary);
+		std::unique_lock<std::mutex> lock(_lock);
+		if (!file.is_open())
+		{
+			_failed = true;
+			signal(lock);
+		}
+		//the first block is read from the seek
+		unsigned moves = _moves - 1;
+		while (true)
+		{
+			_freed.wait(lock, [this]() { return _stop || (!_failed && _next < _fileLength && _count < _ring.size()); });
+			if (_stop)
+				break;
+			Block& block = _ring[(_head + _count) % _ring.size()];
+			long long offset = _next;
+			int length = (int)std::min<long long>(block.data.size(), _fileLength - offset);
+			bool seek = moves != _moves;
+			moves = _moves;
+			//the block is free, the sender doesn't touch it
+			lock.unlock();
+			if (seek)
+			{
+				file.clear();
+				file.seekg(_rangeBegin + offset, ios::beg);
+			}
+			int bytesRead = 0;
+			{
+				TRACE_SPAN("disk read ahead");
+				file.read(block.data.data(), length);
+				bytesRead = (int)file.gcount();
+			}
+			lock.lock();
+			if (_stop)
+				break;
+			if (moves != _moves)
+				//the sender has moved meanwhile
+				continue;
+			if (bytesRead != length)
+				//file has been truncated
+				_failed = true;
+			else
+			{
+				block.offset = offset;
+				block.length = length;
+				_next += length;
+				_count++;
+			}
+			signal(lock);
+		}
+	}
+
+	void signal(std::unique_lock<std::mutex>& lock)
+	{//the sender may go on
+		_filled.notify_all();
+		if (!_waiting)
+			return;
+		_waiting = false;
+		lock.unlock();
+		_ready();
+		lock.lock();
+	}
+};
+
+class WriteBehind
+{//upload: the received bytes are copied into the blocks, the thread writes them in order at their offsets;
+ //the writer is drained before the file is read back or its length is reported. The receiver asks for
+ //room before it takes more bytes: the blocks of one write may go past the depth
+public:
+	//drain(): everything is in the file, not yet, some write has failed
+	enum { Drained = 1, Pending = 0, Failed = -1 };
+private:
+	struct Block
+	{
+		vector<char> data;
+		long long offset;
+		int length;
+	};
+
+	std::function<bool(long long, const char*, int)> _write;
+	std::function<void()> _ready;
+	int _blockSize;
+	size_t _depth;
+	//the filled blocks in order (the oldest is being written), the free memory of the written ones
+	std::deque<Block> _blocks;
+	vector<vector<char>> _spare;
+	std::thread _thread;
+	std::mutex _lock;
+	std::condition_variable _filled;
+	std::condition_variable _freed;
+	//end of the block written last (the bytes before it are in the file), a write has failed
+	std::atomic<long long> _written;
+	bool _failed;
+	bool _stop;
+	//the receiver has been refused the room or the drain
+	bool _waiting;
+
+	//запрет копирования и присваивания
+	WriteBehind(WriteBehind&);
+	WriteBehind& operator=(WriteBehind&);
+public:
+	//ready - called by the writer when the receiver may go on after room() or drain() has refused it
+	WriteBehind(std::function<bool(long long, const char*, int)> write, long long written, int blockSize, int depth,
+		std::function<void()> ready)
+		: _write(write), _ready(ready), _blockSize(std::max(blockSize, 1)), _depth(std::max(depth, 2)),
+		_written(written), _failed(false), _stop(false), _waiting(false)
+	{
+		_thread = std::thread(&WriteBehind::run, this);
+	}
+
+	~WriteBehind()
+	{//the blocks in the ring are written
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stop = true;
+			_filled.notify_all();
+		}
+		_thread.join();
+	}
+
+	bool room(bool wait)
+	{//the receiver may take more bytes (waits for the room if it has to)
+		std::unique_lock<std::mutex> lock(_lock);
+		if (wait)
+			_freed.wait(lock, [this]() { return _failed || _blocks.size() < _depth; });
+		if (_failed || _blocks.size() < _depth)
+			return true;
+		_waiting = true;
+		return false;
+	}
+
+	bool write(long long offset, const char* data, int length)
+	{//false if some write has failed
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_failed)
+			return false;
+		while (length > 0)
+		{
+			Block block;
+			if (!_spare.empty())
+			{
+				block.data.swap(_spare.back());
+				_spare.pop_back();
+			}
+			block.data.resize(_blockSize);
+			block.offset = offset;
+			block.length = std::min(length, _blockSize);
+			memcpy(block.data.data(), data, block.length);
+			offset += block.length;
+			data += block.length;
+			length -= block.length;
+			_blocks.push_back(std::move(block));
+		}
+		_filled.notify_one();
+		return true;
+	}
+
+	int drain(bool wait)
+	{//everything is in the file (waits for it if it has to)
+		std::unique_lock<std::mutex> lock(_lock);
+		if (wait)
+			_freed.wait(lock, [this]() { return _failed || _blocks.empty(); });
+		if (_failed)
+			return Failed;
+		if (_blocks.empty())
+			return Drained;
+		_waiting = true;
+		return Pending;
+	}
+
+	long long written()const { return _written; }
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		while (true)
+		{
+			_filled.wait(lock, [this]() { return _stop || !_blocks.empty(); });
+			if (_blocks.empty() || _failed)
+				break;
+			//the receiver adds the blocks behind, this one stays in place
+			Block& block = _blocks.front();
+			lock.unlock();
+			bool written = _write(block.offset, block.data.data(), block.length);
+			lock.lock();
+			if (!written)
+				_failed = true;
+			else
+				_written = block.offset + block.length;
+			if (_spare.size() < _depth)
+				_spare.push_back(std::move(block.data));
+			_blocks.pop_front();
+			_freed.notify_all();
+			if (_waiting)
+			{//the receiver may go on
+				_waiting = false;
+				lock.unlock();
+				_ready();
+				lock.lock();
+			}
+		}
+		_freed.notify_all();
+		if (_waiting)
+		{
+			_waiting = false;
+			lock.unlock();
+			_ready();
+		}
+	}
+};
+
+class DiskTasks
+{//the disk work of one event loop done in order by one thread: the queue is bounded, the full one refuses
+ //the task; the tasks not started are dropped when it's destroyed, the current one is finished
+public:
+	static const size_t MaxTasks = 16;
+private:
+	std::deque<std::function<void()>> _tasks;
+	std::thread _thread;
+	std::mutex _lock;
+	std::condition_variable _queued;
+	bool _stop;
+
+	//запрет копирования и присваивания
+	DiskTasks(DiskTasks&);
+	DiskTasks& operator=(DiskTasks&);
+public:
+	DiskTasks() : _stop(false)
+	{
+		_thread = std::thread(&DiskTasks::run, this);
+	}
+
+	~DiskTasks()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stop = true;
+			_queued.notify_all();
+		}
+		_thread.join();
+	}
+
+	bool post(std::function<void()> task)
+	{//false if the queue is full
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_tasks.size() >= MaxTasks)
+			return false;
+		_tasks.push_back(std::move(task));
+		_queued.notify_one();
+		return true;
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		while (true)
+		{
+			_queued.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+			if (_stop)
+				break;
+			std::function<void()> task = std::move(_tasks.front());
+			_tasks.pop_front();
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+	}
+};
+
+#endif //PIPELINE_H
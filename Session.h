@@ -0,0 +1,520 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "Connection.h"
+#include "EventLoop.h"
+
+enum class TransferKind { Download, Upload };
+
+class Session;
+
+class SessionListener
+{//server side of the session life cycle
+public:
+	virtual ~SessionListener() {}
+	//client has sent its id
+	virtual void onIdentified(Session* session) = 0;
+	//complete command line has been received
+	virtual void onMessage(Session* session, string& message) = 0;
+	//transfer is over (successfully or not)
+	virtual void onTransferFinished(Session* session, TransferKind kind, bool result) = 0;
+	//connection has been lost in the middle of the transfer, it can be resumed by the reconnected client
+	virtual void onTransferInterrupted(Session* session, unique_ptr<FileWorker> fileWorker, TransferKind kind) = 0;
+	//session can be destroyed
+	virtual void onClosed(Session* session) = 0;
+};
+
+class UdpTransfer : public EventHandler
+{//file transfer with one client through the shared UDP socket, the server dispatches the datagrams
+private:
+	EventLoop& _eventLoop;
+	Session& _session;
+	unique_ptr<UDP_PeerSocket> _socket;
+	unique_ptr<FileWorker> _fileWorker;
+	int _clientId;
+	//waiting for the client id after the connection has been lost
+	bool _reconnecting;
+	time_t _deadline;
+	int _timeOut;
+	bool _finished;
+public:
+	UdpTransfer(EventLoop& eventLoop, Session& session, int clientId, UDP_PeerSocket* socket, FileWorker* fileWorker, int timeOut)
+		: _eventLoop(eventLoop), _session(session), _socket(socket), _fileWorker(fileWorker)
+	{
+		_clientId = clientId;
+		_timeOut = timeOut;
+		_reconnecting = false;
+		_deadline = 0;
+		_finished = false;
+		_eventLoop.schedule(this);
+	}
+
+	~UdpTransfer()
+	{
+		_eventLoop.unschedule(this);
+	}
+
+	int clientId()const { return _clientId; }
+	bool reconnecting()const { return _reconnecting; }
+	bool finished()const { return _finished; }
+
+	void onDatagram(const char* data, int length)
+	{
+		if (_finished) return;
+		if (!_reconnecting)
+			_fileWorker->consume(data, length);
+		else
+		{
+			//client id (and client address)
+			if (length != sizeof(int)) return;
+			int clientId = 0;
+			memcpy(&clientId, data, sizeof(int));
+			_socket->send(clientId);
+			//check if old client
+			if (clientId != _clientId)
+			{
+				finish(false);
+				return;
+			}
+			_reconnecting = false;
+			_fileWorker->resume(_socket.get());
+		}
+		handleEvents(0);
+	}
+
+	void reconnected(const sockaddr_storage& peerAddr, const char* data, int length)
+	{//client has come back from the other port
+		_socket.reset(new UDP_PeerSocket(_socket->handle(), peerAddr));
+		onDatagram(data, length);
+	}
+
+	void handleEvents(int events) override;
+
+	void checkRetransmission()
+	{
+		if (!_finished && !_reconnecting && _fileWorker->retransmissionDue())
+			handleEvents(0);
+	}
+
+	void checkTimeouts(time_t now)
+	{
+		if (_finished) return;
+		if (_reconnecting ? now >= _deadline : _fileWorker->expired(now))
+			handleEvents(0);
+	}
+
+private:
+	void finish(bool result);
+};
+
+class Session : public EventHandler
+{//connection with the client: command lines, replies and the transfer in progress
+private:
+	enum class State { Identification, Commands, Suspended, AwaitAck, Transfer, TransferUdp, Closed };
+
+	EventLoop& _eventLoop;
+	SessionListener& _listener;
+	unique_ptr<Socket> _socket;
+	int _clientId;
+	//negotiated by the "version" command
+	int _protocolVersion;
+	//progress frames of the downloads (ms, bytes), set by the "progress" command
+	int _progressInterval;
+	long long _progressBytes;
+	//compressed frames of the downloads, set by the "compress" command
+	bool _compression;
+	//chunk and socket buffers of the framed transfers after TCP_INFO, set by the "autotune" command
+	bool _autotune;
+	State _state;
+	//close when the current command is done
+	bool _finishing;
+
+	//received but not handled bytes (partial command line, transfer data)
+	ReadBuffer _input;
+	//replies waiting for the socket to become writable
+	string _output;
+	size_t _outputPos;
+
+	//edge-triggered readiness
+	bool _readable;
+	bool _writable;
+	bool _writeInterest;
+	//no more input
+	bool _peerClosed;
+	//no more output
+	bool _broken;
+
+	unique_ptr<FileWorker> _fileWorker;
+	unique_ptr<UdpTransfer> _udpTransfer;
+	TransferKind _transferKind;
+	std::function<void(bool)> _ackHandler;
+public:
+	//bytes moved per event before the other sessions get their turn
+	static const size_t TurnQuota = 256 * 1024;
+	//unhandled input limit (command line length)
+	static const size_t InputLimit = 64 * 1024;
+
+	Session(Socket* socket, EventLoop& eventLoop, SessionListener& listener) : _eventLoop(eventLoop), _listener(listener), _socket(socket), _input(InputLimit)
+	{
+		_clientId = 0;
+		_protocolVersion = 1;
+		_progressInterval = 0;
+		_progressBytes = 0;
+		_compression = false;
+		_autotune = false;
+		_state = State::Identification;
+		_finishing = false;
+		_outputPos = 0;
+		_readable = _writable = true;
+		_writeInterest = false;
+		_peerClosed = false;
+		_broken = false;
+
+		_socket->makeUnblocked();
+		_eventLoop.add(_socket->handle(), this);
+	}
+
+	Socket* socket() { return _socket.get(); }
+	int clientId()const { return _clientId; }
+	int protocolVersion()const { return _protocolVersion; }
+	void setProtocolVersion(int version) { _protocolVersion = version; }
+	int progressInterval()const { return _progressInterval; }
+	long long progressBytes()const { return _progressBytes; }
+	void setProgress(int interval, long long bytes) { _progressInterval = interval; _progressBytes = bytes; }
+	bool compression()const { return _compression; }
+	void setCompression(bool compression) { _compression = compression; }
+	bool autotune()const { return _autotune; }
+	void setAutotune(bool autotune) { _autotune = autotune; }
+	bool closed()const { return _state == State::Closed; }
+
+	bool sendMessage(string& message)
+	{// sending message ends with \r\n
+		if (message.empty() || message.back() != '\n')
+			message.append("\r\n");
+		_output.append(message);
+		return true;
+	}
+
+	bool sendMessage(const char* message)
+	{
+		std::string mes(message);
+		return sendMessage(mes);
+	}
+
+	void finish()
+	{//close after the current command
+		_finishing = true;
+	}
+
+	void suspend()
+	{//stop handling commands until the transfer begins
+		_state = State::Suspended;
+	}
+
+	void proceed()
+	{
+		_state = State::Commands;
+		_eventLoop.schedule(this);
+	}
+
+	void expectAck(std::function<void(bool)> ackHandler)
+	{//one byte confirmation from the client
+		_ackHandler = ackHandler;
+		_state = State::AwaitAck;
+	}
+
+	void startTransfer(unique_ptr<FileWorker> fileWorker, TransferKind kind)
+	{//transfer over the contact socket
+		_fileWorker = std::move(fileWorker);
+		_transferKind = kind;
+		_state = State::Transfer;
+		_eventLoop.schedule(this);
+	}
+
+	UdpTransfer* udpTransfer() { return _udpTransfer.get(); }
+
+	void startUdpTransfer(UdpTransfer* udpTransfer, TransferKind kind)
+	{
+		_udpTransfer.reset(udpTransfer);
+		_transferKind = kind;
+		_state = State::TransferUdp;
+	}
+
+	void udpTransferFinished(bool result)
+	{
+		_state = State::Commands;
+		_listener.onTransferFinished(this, _transferKind, result);
+		_eventLoop.schedule(this);
+	}
+
+	void checkTimeouts(time_t now)
+	{
+		if (_state == State::Transfer && _fileWorker->expired(now))
+			transferStatusChanged();
+		else if (_state == State::TransferUdp)
+			_udpTransfer->checkTimeouts(now);
+	}
+
+	void close()
+	{
+		if (_state == State::Closed) return;
+		_state = State::Closed;
+		_udpTransfer.reset();
+		_fileWorker.reset();
+		_eventLoop.remove(_socket->handle(), this);
+		_socket.reset();
+		_listener.onClosed(this);
+	}
+
+	void handleEvents(int events) override
+	{
+		if (_state == State::Closed) return;
+		if (events & EventHandler::Readable) _readable = true;
+		if (events & EventHandler::Writable) _writable = true;
+		process();
+	}
+
+private:
+
+	void process()
+	{
+		//the ring may have finished (broken) the transfer
+		transferStatusChanged();
+		if (_state == State::Closed) return;
+
+		size_t budget = TurnQuota;
+		bool progress = true;
+		while (progress && budget > 0)
+		{
+			progress = receiveInput(budget);
+			progress |= handleInput();
+			if (_state == State::Closed) return;
+			progress |= transmitOutput(budget);
+			if (_state == State::Closed) return;
+		}
+
+		if (budget == 0)
+			//let the other sessions work
+			_eventLoop.schedule(this);
+		else if (_peerClosed)
+			connectionClosed();
+		else if (_finishing && _state == State::Commands && _output.empty())
+			close();
+	}
+
+	bool receiveInput(size_t& budget)
+	{
+		bool progress = false;
+		while (_readable && budget > 0 && !_input.full())
+		{
+			int bytesRead = 0;
+			if (_input.empty() && _state == State::Transfer && _fileWorker->receiveThroughRing())
+				//upload goes through io_uring, the ring schedules the session
+				break;
+			if (_input.empty() && _state == State::Transfer && _fileWorker->receivesDirectly())
+			{//upload goes from the socket to the file (splice)
+				bytesRead = _fileWorker->receiveDirectly(budget);
+				if (bytesRead > 0)
+				{
+					transferStatusChanged();
+					progress = true;
+					if (_state == State::Closed) break;
+					continue;
+				}
+			}
+			else
+			{
+				//straight into the input buffer
+				bytesRead = _socket->receive(_input.space(), (int)std::min(_input.spaceSize(), budget));
+				if (bytesRead > 0)
+				{
+					_input.produced(bytesRead);
+					budget -= std::min(budget, (size_t)bytesRead);
+					progress = true;
+					continue;
+				}
+			}
+			_readable = false;
+			//connection has been gracefully closed or обрыв соединения
+			if (bytesRead == 0)
+				_peerClosed = true;
+			else if (!Socket::wouldBlock())
+				_peerClosed = _broken = true;
+		}
+		return progress;
+	}
+
+	bool handleInput()
+	{
+		bool progress = false;
+		while (!_input.empty() && _state != State::Closed)
+		{
+			size_t consumed = handleInput(_input.data(), _input.size());
+			if (consumed == 0) break;
+			_input.consume(consumed);
+			progress = true;
+		}
+		return progress;
+	}
+
+	size_t handleInput(const char* data, size_t length)
+	{
+		switch (_state)
+		{
+		case State::Identification:
+		{
+			if (length < sizeof(int)) return 0;
+			memcpy(&_clientId, data, sizeof(int));
+			_state = State::Commands;
+			_listener.onIdentified(this);
+			return sizeof(int);
+		}
+		case State::Commands:
+		{
+			if (_finishing) return 0;
+			size_t lineLength = _input.lineLength();
+			if (lineLength == 0 && length < InputLimit) return 0;
+			//too long line is handled as is
+			if (lineLength == 0) lineLength = length;
+			string message(data, lineLength);
+			_listener.onMessage(this, message);
+			return lineLength;
+		}
+		case State::AwaitAck:
+		{
+			std::function<void(bool)> ackHandler;
+			ackHandler.swap(_ackHandler);
+			_state = State::Commands;
+			ackHandler(data[0] != 0);
+			return 1;
+		}
+		case State::Transfer:
+		{
+			size_t consumed = _fileWorker->consume(data, length);
+			transferStatusChanged();
+			return consumed;
+		}
+		default:
+			return 0;
+		}
+	}
+
+	bool transmitOutput(size_t& budget)
+	{
+		bool progress = false;
+		while (_writable && _outputPos < _output.size() && budget > 0)
+		{
+			int bytesWrite = _socket->send(_output.data() + _outputPos, (int)(_output.size() - _outputPos));
+			if (bytesWrite == SOCKET_ERROR)
+			{
+				_writable = false;
+				if (!Socket::wouldBlock())
+					_peerClosed = _broken = true;
+				break;
+			}
+			_outputPos += bytesWrite;
+			budget -= std::min(budget, (size_t)bytesWrite);
+			progress = true;
+		}
+		if (_outputPos == _output.size())
+		{
+			_output.clear();
+			_outputPos = 0;
+		}
+
+		//the transfer goes after the replies
+		if (_output.empty() && _writable && _state == State::Transfer)
+		{
+			progress |= _fileWorker->pump(budget);
+			if (_fileWorker->blocked())
+				_writable = false;
+			transferStatusChanged();
+		}
+
+		bool writeInterest = !_writable && !_broken;
+		if (writeInterest != _writeInterest && _state != State::Closed)
+		{
+			_eventLoop.setWriteInterest(_socket->handle(), writeInterest);
+			_writeInterest = writeInterest;
+		}
+		return progress;
+	}
+
+	void transferStatusChanged()
+	{
+		if (_state != State::Transfer) return;
+
+		FileWorker::Status status = _fileWorker->status();
+		if (status == FileWorker::Status::InProgress)
+			return;
+		if (status == FileWorker::Status::ConnectionLost)
+		{
+			interruptTransfer();
+			return;
+		}
+		_fileWorker.reset();
+		_state = State::Commands;
+		_listener.onTransferFinished(this, _transferKind, status == FileWorker::Status::Completed);
+	}
+
+	void interruptTransfer()
+	{//the client may reconnect and continue
+		_state = State::Suspended;
+		_listener.onTransferInterrupted(this, std::move(_fileWorker), _transferKind);
+		close();
+	}
+
+	void connectionClosed()
+	{
+		if (_state == State::Transfer)
+		{
+			_fileWorker->interrupt();
+			transferStatusChanged();
+			if (_state == State::Closed) return;
+		}
+		//the client may still read the replies
+		if (!_broken && !_output.empty())
+			return;
+		close();
+	}
+};
+
+inline void UdpTransfer::handleEvents(int)
+{
+	if (_finished) return;
+
+	if (!_reconnecting)
+	{
+		size_t budget = Session::TurnQuota;
+		_fileWorker->pump(budget);
+
+		FileWorker::Status status = _fileWorker->status();
+		if (status == FileWorker::Status::Completed || status == FileWorker::Status::Failed)
+		{
+			finish(status == FileWorker::Status::Completed);
+			return;
+		}
+		if (status == FileWorker::Status::ConnectionLost)
+		{//wait for client id
+			_reconnecting = true;
+			_deadline = std::time(NULL) + _timeOut;
+		}
+		else if (budget == 0 || _fileWorker->blocked())
+			//let the other sessions work
+			_eventLoop.schedule(this);
+	}
+
+	if (_reconnecting && std::time(NULL) >= _deadline)
+		finish(false);
+}
+
+inline void UdpTransfer::finish(bool result)
+{
+	_finished = true;
+	_eventLoop.unschedule(this);
+	_fileWorker.reset();
+	_socket.reset();
+	_session.udpTransferFinished(result);
+}
+
+#endif //SESSION_H
@@ -0,0 +1,164 @@
+#ifndef SESSIONTABLE_H
+#define SESSIONTABLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+template<typename V>
+class SessionTable
+{//state of the clients by client id: open addressing with linear probing in a power-of-two array,
+ //thousands of reconnectable clients are found in O(1) (std::map walks a tree of them).
+ //Erased slots become tombstones, so erasing while iterating doesn't move the other items;
+ //the table is rebuilt on insertion when items and tombstones fill 3/4 of it
+	enum SlotState : unsigned char { Empty, Full, Erased };
+public:
+	typedef std::pair<int, V> value_type;
+
+	class iterator
+	{
+		friend class SessionTable;
+		SessionTable* _table;
+		size_t _slot;
+
+		iterator(SessionTable* table, size_t slot) : _table(table), _slot(slot) { skip(); }
+
+		void skip()
+		{
+			while (_slot < _table->_states.size() && _table->_states[_slot] != Full)
+				_slot++;
+		}
+	public:
+		value_type& operator*()const { return _table->_slots[_slot]; }
+		value_type* operator->()const { return &_table->_slots[_slot]; }
+		iterator& operator++() { _slot++; skip(); return *this; }
+		bool operator==(const iterator& other)const { return _slot == other._slot; }
+		bool operator!=(const iterator& other)const { return _slot != other._slot; }
+	};
+
+	SessionTable() : _size(0), _erased(0) {}
+
+	size_t size()const { return _size; }
+	bool empty()const { return _size == 0; }
+
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, _states.size()); }
+
+	iterator find(int key)
+	{
+		size_t slot = 0;
+		return lookup(key, slot) ? iterator(this, slot) : end();
+	}
+
+	V& operator[](int key)
+	{//inserts the default value if there is no key
+		size_t slot = 0;
+		if (lookup(key, slot))
+			return _slots[slot].second;
+		if (_states.empty() || (_size + _erased + 1) * 4 > _states.size() * 3)
+		{
+			rehash();
+			lookup(key, slot);
+		}
+		if (_states[slot] == Erased)
+			_erased--;
+		_states[slot] = Full;
+		_slots[slot] = value_type(key, V());
+		_size++;
+		return _slots[slot].second;
+	}
+
+	iterator erase(iterator it)
+	{//returns the next item
+		release(it._slot);
+		++it;
+		return it;
+	}
+
+	size_t erase(int key)
+	{
+		size_t slot = 0;
+		if (!lookup(key, slot))
+			return 0;
+		release(slot);
+		return 1;
+	}
+
+	void clear()
+	{
+		_slots.clear();
+		_states.clear();
+		_size = _erased = 0;
+	}
+
+private:
+	std::vector<value_type> _slots;
+	std::vector<SlotState> _states;
+	size_t _size;
+	size_t _erased;
+
+	static size_t hash(int key)
+	{//Fibonacci hashing: sequential ids don't fall into neighbouring slots
+		return (size_t)(((uint64_t)(uint32_t)key * 0x9E3779B97F4A7C15ull) >> 32);
+	}
+
+	bool lookup(int key, size_t& slot)const
+	{//slot of the key, or the slot to insert it into (the first tombstone on the way)
+		if (_states.empty())
+			return false;
+		size_t mask = _states.size() - 1;
+		bool found = false;
+		for (size_t i = hash(key) & mask;; i = (i + 1) & mask)
+		{
+			if (_states[i] == Empty)
+			{
+				if (!found) slot = i;
+				return false;
+			}
+			if (_states[i] == Full && _slots[i].first == key)
+			{
+				slot = i;
+				return true;
+			}
+			if (_states[i] == Erased && !found)
+			{
+				slot = i;
+				found = true;
+			}
+		}
+	}
+
+	void release(size_t slot)
+	{
+		_states[slot] = Erased;
+		_slots[slot].second = V();
+		_size--;
+		_erased++;
+	}
+
+	void rehash()
+	{//twice as many slots if the items fill half of them, otherwise only the tombstones are dropped
+		size_t capacity = _states.empty() ? 16 : _states.size();
+		if ((_size + 1) * 2 > capacity)
+			capacity *= 2;
+		std::vector<value_type> slots(capacity);
+		std::vector<SlotState> states(capacity, Empty);
+		_slots.swap(slots);
+		_states.swap(states);
+		_erased = 0;
+		size_t mask = capacity - 1;
+		for (size_t i = 0; i < states.size(); i++)
+		{
+			if (states[i] != Full)
+				continue;
+			size_t slot = hash(slots[i].first) & mask;
+			while (_states[slot] != Empty)
+				slot = (slot + 1) & mask;
+			_states[slot] = Full;
+			_slots[slot] = std::move(slots[i]);
+		}
+	}
+};
+
+#endif //SESSIONTABLE_H
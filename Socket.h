@@ -48,6 +48,85 @@ struct InetAddress
 	}
 };
 
+class ReadBuffer
+{//bytes read ahead from the stream: filled by large reads, handed out by lines or blocks
+private:
+	vector<char> _data;
+	//unread bytes are [_begin, _end)
+	size_t _begin;
+	size_t _end;
+	//unread bytes which have been searched for the end of line
+	size_t _scanned;
+public:
+	ReadBuffer(size_t capacity = 16 * 1024) : _data(capacity), _begin(0), _end(0), _scanned(0) {}
+
+	const char* data()const { return _data.data() + _begin; }
+	size_t size()const { return _end - _begin; }
+	bool empty()const { return _begin == _end; }
+	bool full()const { return size() == _data.size(); }
+
+	char* space()
+	{//free space after the unread bytes
+		if (_begin > 0 && _end == _data.size())
+		{//move the unread bytes to the beginning
+			memmove(_data.data(), _data.data() + _begin, size());
+			_end -= _begin;
+			_begin = 0;
+		}
+		return _data.data() + _end;
+	}
+
+	size_t spaceSize()const
+	{
+		return (_begin > 0 && _end == _data.size()) ? _begin : _data.size() - _end;
+	}
+
+	void produced(size_t length)
+	{//bytes have been written to space()
+		_end += length;
+	}
+
+	void consume(size_t length)
+	{
+		_begin += length;
+		_scanned = (_scanned > length) ? _scanned - length : 0;
+		if (_begin == _end)
+			_begin = _end = 0;
+	}
+
+	size_t lineLength()
+	{//length of the complete line including '\n', 0 if there is no one yet
+		const char* end = (const char*)memchr(data() + _scanned, '\n', size() - _scanned);
+		if (end == nullptr)
+		{//don't search the same bytes again
+			_scanned = size();
+			return 0;
+		}
+		return end - data() + 1;
+	}
+
+	size_t read(char* buffer, size_t length)
+	{
+		length = std::min(length, size());
+		memcpy(buffer, data(), length);
+		consume(length);
+		return length;
+	}
+};
+
+struct TcpStats
+{//state of the TCP connection (see Socket::getTcpStats()), 0 - the system doesn't tell it
+	//smoothed round trip of the sender, round trip seen by the receiver, microseconds
+	long long rtt;
+	long long receiveRtt;
+	//congestion window, bytes
+	long long congestionWindow;
+	//recent delivery rate of the sender, bytes per second
+	long long deliveryRate;
+
+	TcpStats() : rtt(0), receiveRtt(0), congestionWindow(0), deliveryRate(0) {}
+};
+
 class Socket
 {
 public:
@@ -70,11 +149,16 @@ protected:
 	*/
 	//for UDP
 	sockaddr_storage _peerAddr;
-	static int _peerAddrLen;
+	int _peerAddrLen;
+	//several sockets (worker threads) are bound to the same port
+	bool _reusePort;
 
 	//address socket connected to (not localmashine)
 	InetAddress _inetAddress;
 
+	//bytes received after the end of the last message line
+	ReadBuffer _readBuffer;
+
 	int _protocol;
 
 	u_long _keepAliveTimeOut;
@@ -154,6 +238,9 @@ public:
 			);
 		if (result != 0)
 			throw new runtime_error("WSAStartup failed");
+#elif defined(UNIX)
+		//sendfile has no MSG_NOSIGNAL, closed connection is reported by EPIPE
+		signal(SIGPIPE, SIG_IGN);
 #endif
 		return result;
 	}
@@ -173,9 +260,34 @@ public:
 		return raw_send(buffer, length, flags);
 	}
 
+	int sendFile(int fileHandle, long long offset, int length)
+	{//file pages go from the page cache to the socket without copying through the user space (TCP),
+	 //the file position is not changed
+#if defined(UNIX)
+		off_t pos = (off_t)offset;
+		return (int)::sendfile(_handle, fileHandle, &pos, length);
+#else
+		return SOCKET_ERROR;
+#endif
+	}
+
+	int receiveToPipe(int pipeHandle, int length)
+	{//received bytes are moved to the pipe without copying through the user space (TCP),
+	 //blocks (or not) as the socket does
+#if defined(UNIX)
+		return (int)::splice(_handle, NULL, pipeHandle, NULL, length, SPLICE_F_MOVE);
+#else
+		return SOCKET_ERROR;
+#endif
+	}
+
 	int send_OOB_byte(char byte)
 	{
-		return raw_send((char*)&byte, 1, MSG_OOB);
+		int flags = MSG_OOB;
+#if defined(UNIX)
+		flags |= MSG_NOSIGNAL;
+#endif
+		return raw_send((char*)&byte, 1, flags);
 	}
 
 	bool sendMessage(string& message)
@@ -204,6 +316,9 @@ public:
 
 	int receive(char* buffer, int length)
 	{
+		//the bytes read ahead with the message go first
+		if (!_readBuffer.empty())
+			return (int)_readBuffer.read(buffer, length);
 		return raw_receive(buffer, length, 0);
 	}
 
@@ -256,61 +371,56 @@ public:
 	string receiveMessage()
 	{//nothrows
 		string message;
-		message.reserve(_messageMaxSize);
-		//кол-во принятых байт
-		int bytesAccepted = 0;
-		char data = 0;
-		while (true)
-		{
-			bytesAccepted = recv(_handle, &data, 1, 0);
-
-			if (bytesAccepted == 0 || bytesAccepted == SOCKET_ERROR)
-			{
-				//connection has been gracefully closed or обрыв соединения
-				return message;
-			}
-
-			//запись данных
-			message.push_back(data);
-			//если это были последние данные, выход
-			if (data == '\n')
-				break;
-
-		}
-
+		//connection has been gracefully closed or обрыв соединения -> the received part
+		receiveLine(message);
 		return message;
 	}
 
 	string receiveMessage_()
 	{//throw runtime_error
 		string message;
+		int retValue = receiveLine(message);
+		if (retValue == 0)
+			//connection has been gracefully closed
+			throw runtime_error("connection close");
+		else if (retValue == SOCKET_ERROR)
+			//disconnection
+			socketError("disconnection");
+		return message;
+	}
+
+	int receiveLine(string& message)
+	{//message ends with '\n', the bytes after it stay in the read buffer;
+	 //returns message length, 0 or SOCKET_ERROR if the connection is over before the end of line
 		message.reserve(_messageMaxSize);
-		//кол-во принятых байт
-		int bytesAccepted = 0;
-		char data = 0;
 		while (true)
 		{
-			bytesAccepted = recv(_handle, &data, 1, 0);
-
-			if (bytesAccepted == 0)
+			size_t lineLength = _readBuffer.lineLength();
+			if (lineLength > 0)
 			{
-				//connection has been gracefully closed
-				throw runtime_error("connection close");
+				message.append(_readBuffer.data(), lineLength);
+				_readBuffer.consume(lineLength);
+				return (int)message.size();
+			}
+			if (_readBuffer.full())
+			{//line is longer than the buffer
+				message.append(_readBuffer.data(), _readBuffer.size());
+				_readBuffer.consume(_readBuffer.size());
 			}
-			else if (bytesAccepted == SOCKET_ERROR)
-				//disconnection
-				socketError("disconnection");
-			//data writing
-			message.push_back(data);
-			//if last data portion->exit
-			if (data == '\n')
-				break;
 
+			int bytesAccepted = raw_receive(_readBuffer.space(), (int)_readBuffer.spaceSize(), 0);
+			if (bytesAccepted == 0 || bytesAccepted == SOCKET_ERROR)
+			{
+				message.append(_readBuffer.data(), _readBuffer.size());
+				_readBuffer.consume(_readBuffer.size());
+				return bytesAccepted;
+			}
+			_readBuffer.produced(bytesAccepted);
 		}
-
-		return message;
 	}
 
+	bool hasBufferedData()const { return !_readBuffer.empty(); }
+
 	int sendall(const char* buf, int len, int flags)
 	{
 		int total = 0;
@@ -333,7 +443,7 @@ public:
 
 		while (total < len)
 		{
-			n = raw_receive(buf + total, len - total, flags);
+			n = (flags == 0) ? receive(buf + total, len - total) : raw_receive(buf + total, len - total, flags);
 			if (n == SOCKET_ERROR) break;
 			if (n == 0) n;	//connection is broken
 			total += n;
@@ -346,6 +456,18 @@ public:
 		return _handle != INVALID_SOCKET;
 	}
 
+	static bool wouldBlock()
+	{//last operation on the unblocked socket has failed only because it would block
+#if defined(WINDOWS)
+		return WSAGetLastError() == WSAEWOULDBLOCK;
+#elif defined(UNIX)
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+	}
+
+	//address of the last datagram sender (UDP)
+	const sockaddr_storage& peerAddress()const { return _peerAddr; }
+
 	bool setBlocking(unsigned int blockMode)
 	{//set/reset blocking mode of socket
 	 //(nonblockingIO) a nonzero value if the nonblocking mode should be enabled
@@ -459,6 +581,50 @@ public:
 		return bufferSize;
 	}
 
+	bool getTcpStats(TcpStats& stats)
+	{//TCP_INFO of linux (SIO_TCP_INFO of windows 10), false if there is none
+#if defined(UNIX)
+		//the fields of the kernel past the ones of glibc (the kernel fills as many as it has)
+		struct
+		{
+			tcp_info base;
+			uint64_t pacingRate;
+			uint64_t maxPacingRate;
+			uint64_t bytesAcked;
+			uint64_t bytesReceived;
+			uint32_t segsOut;
+			uint32_t segsIn;
+			uint32_t notsentBytes;
+			uint32_t minRtt;
+			uint32_t dataSegsIn;
+			uint32_t dataSegsOut;
+			uint64_t deliveryRate;
+		} info;
+		memset(&info, 0, sizeof(info));
+		socklen_t length = sizeof(info);
+		if (::getsockopt(_handle, IPPROTO_TCP, TCP_INFO, &info, &length) != 0 || length < sizeof(info.base))
+			return false;
+		stats.rtt = info.base.tcpi_rtt;
+		stats.receiveRtt = info.base.tcpi_rcv_rtt;
+		stats.congestionWindow = (long long)info.base.tcpi_snd_cwnd * info.base.tcpi_snd_mss;
+		stats.deliveryRate = (length >= sizeof(info)) ? (long long)info.deliveryRate : 0;
+		return true;
+#elif defined(WINDOWS) && defined(SIO_TCP_INFO)
+		DWORD version = 0, bytesReturned = 0;
+		TCP_INFO_v0 info;
+		if (WSAIoctl(_handle, SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &bytesReturned, NULL, NULL) != 0)
+			return false;
+		//no delivery rate: the caller measures it
+		stats.rtt = info.RttUs;
+		stats.receiveRtt = 0;
+		stats.congestionWindow = info.Cwnd;
+		stats.deliveryRate = 0;
+		return true;
+#else
+		return false;
+#endif
+	}
+
 
 	bool setReceiveTimeOut(int timeOutSec)
 	{
@@ -472,6 +638,17 @@ public:
 		timeout.tv_sec = timeOutSec;
 		timeout.tv_usec = 0;
 		return setSockOpt(SOL_SOCKET, SO_RCVTIMEO, timeout);
+#endif
+	}
+	bool setReceiveTimeOutMs(int timeOutMs)
+	{
+#if defined(WINDOWS)
+		return setSockOpt(SOL_SOCKET, SO_RCVTIMEO, timeOutMs);
+#elif defined(UNIX)
+		timeval timeout;
+		timeout.tv_sec = timeOutMs / 1000;
+		timeout.tv_usec = (timeOutMs % 1000) * 1000;
+		return setSockOpt(SOL_SOCKET, SO_RCVTIMEO, timeout);
 #endif
 	}
 	bool disableReceiveTimeOut()
@@ -520,6 +697,24 @@ public:
 		return setSockOpt(SOL_SOCKET, SO_REUSEADDR, true);
 	}
 
+	bool reusePort()
+	{
+		//the kernel balances the connections (datagrams) between the sockets bound to the same port,
+		//has to be set prior to bind too
+#if defined(UNIX)
+		return setSockOpt(SOL_SOCKET, SO_REUSEPORT, 1);
+#else
+		return false;
+#endif
+	}
+
+	bool setOOBInline()
+	{
+		//urgent data is received in the normal data stream at its position,
+		//recv with MSG_OOB is not used
+		return setSockOpt(SOL_SOCKET, SO_OOBINLINE, 1);
+	}
+
 	static void closeWinsock()
 	{
 #if defined(WINDOWS)
@@ -542,6 +737,8 @@ protected:
 		_inetAddress.port = port;
 
 		_protocol = IPPROTO_TCP;
+		_peerAddrLen = sizeof(sockaddr_storage);
+		_reusePort = false;
 	}
 	template<typename T>
 	bool setSockOpt(int level, int optname, T optval)
@@ -659,6 +856,12 @@ protected:
 			if (!socket(ptr))
 				continue;
 
+			if (_reusePort && !reusePort())
+			{
+				closeSocket();
+				continue;
+			}
+
 			if (bind(ptr))
 				return true;
 		}
@@ -761,9 +964,6 @@ protected:
 	}
 
 };
-//static vars
-int Socket::_peerAddrLen = sizeof(sockaddr_storage);
-
 
 class ServerSocket : public Socket
 {
@@ -775,9 +975,10 @@ protected:
 	//размер очереди клиентов
 	int _nConnections;
 public:
-	ServerSocket(char* IP, char* port, int nConnections = 5) : Socket(IP, port)
+	ServerSocket(char* IP, char* port, int nConnections = 5, bool reusePort = false) : Socket(IP, port)
 	{
 		_nConnections = nConnections;
+		_reusePort = reusePort;
 		getAddrInfo_(AF_INET,//family
 			SOCK_STREAM,
 			IPPROTO_TCP,
@@ -837,8 +1038,9 @@ private:
 	UDP_ServerSocket(UDP_ServerSocket&);
 	UDP_ServerSocket& operator=(UDP_ServerSocket&);
 public:
-	UDP_ServerSocket(char* IP, char* port) : Socket(IP, port)
+	UDP_ServerSocket(char* IP, char* port, bool reusePort = false) : Socket(IP, port)
 	{
+		_reusePort = reusePort;
 		getAddrInfo_(AF_UNSPEC,	//allow IPv4,IPv6
 			SOCK_DGRAM,	//datagram socket
 			IPPROTO_UDP,
@@ -860,6 +1062,39 @@ public:
 
 };
 
+class UDP_PeerSocket : public Socket
+{//datagrams to one peer through the shared UDP socket, the owner of the socket receives them
+private:
+	//запрет присваиваиня
+	UDP_PeerSocket(UDP_PeerSocket&);
+	UDP_PeerSocket& operator=(UDP_PeerSocket&);
+public:
+	UDP_PeerSocket(SOCKET handle, const sockaddr_storage& peerAddr)
+	{
+		_handle = handle;
+		_peerAddr = peerAddr;
+		_protocol = IPPROTO_UDP;
+	}
+
+	~UDP_PeerSocket()
+	{//handle belongs to the shared socket
+		resetHande();
+	}
+
+	int raw_receive(char* buffer, int length, int flags) override
+	{
+		sockaddr_storage peerAddr;
+		socklen_t peerAddrLen = sizeof(peerAddr);
+		return ::recvfrom(_handle, buffer, length, flags, (sockaddr*)&peerAddr, &peerAddrLen);
+	}
+
+	int raw_send(const char* buffer, int length, int flags) override
+	{
+		socklen_t peerAddrLen = (_peerAddr.ss_family == AF_INET6) ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+		return ::sendto(_handle, buffer, length, flags, (sockaddr*)&_peerAddr, peerAddrLen);
+	}
+};
+
 class ClientSocket : public Socket
 {
 private:
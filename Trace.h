@@ -0,0 +1,234 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "Includes.h"
+
+#include <iomanip>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define TRACE_TSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+//spans of the hot path (disk reads, sends, progress bytes, acknowledgement waits, commands) for the stalled
+//transfers: every thread writes its own ring of the last spans, the dump is the Chrome/Perfetto trace-event
+//JSON (chrome://tracing, ui.perfetto.dev). The spans are compiled in with TRACING defined
+//(cmake -DTRACING=ON); without it the macros are empty and nothing is recorded or stored
+
+class TraceBuffer
+{//the last Capacity spans of one thread: the thread writes without locks, a reader copies them
+ //and drops the ones overwritten while it copied
+public:
+	static const size_t Capacity = 1 << 16;
+
+	struct Span
+	{
+		const char* name;
+		unsigned long long start;
+		unsigned long long end;
+	};
+private:
+	struct Slot
+	{
+		std::atomic<const char*> name;
+		std::atomic<unsigned long long> start;
+		std::atomic<unsigned long long> end;
+	};
+
+	unique_ptr<Slot[]> _slots;
+	//spans written so far
+	std::atomic<unsigned long long> _head;
+	int _id;
+
+	//запрет копирования и присваивания
+	TraceBuffer(TraceBuffer&);
+	TraceBuffer& operator=(TraceBuffer&);
+public:
+	//some thread writes into the buffer
+	std::atomic<bool> owned;
+
+	explicit TraceBuffer(int id) : _slots(new Slot[Capacity]), _head(0), _id(id), owned(false) {}
+
+	int id()const { return _id; }
+
+	void add(const char* name, unsigned long long start, unsigned long long end)
+	{
+		unsigned long long head = _head.load(std::memory_order_relaxed);
+		Slot& slot = _slots[head & (Capacity - 1)];
+		slot.name.store(name, std::memory_order_relaxed);
+		slot.start.store(start, std::memory_order_relaxed);
+		slot.end.store(end, std::memory_order_relaxed);
+		_head.store(head + 1, std::memory_order_release);
+	}
+
+	void copy(vector<Span>& spans)const
+	{
+		unsigned long long head = _head.load(std::memory_order_acquire);
+		unsigned long long first = (head > Capacity) ? head - Capacity : 0;
+		vector<Span> copied;
+		copied.reserve((size_t)(head - first));
+		for (unsigned long long i = first; i < head; i++)
+		{
+			const Slot& slot = _slots[i & (Capacity - 1)];
+			Span span = { slot.name.load(std::memory_order_relaxed), slot.start.load(std::memory_order_relaxed),
+				slot.end.load(std::memory_order_relaxed) };
+			copied.push_back(span);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		//the writer has gone round over the oldest ones; the slot of the span being written
+		//(number after) may be torn too
+		unsigned long long after = _head.load(std::memory_order_relaxed);
+		size_t overwritten = (after >= Capacity + first) ? (size_t)std::min(after - Capacity - first + 1, head - first) : 0;
+		spans.insert(spans.end(), copied.begin() + overwritten, copied.end());
+	}
+};
+
+class Tracer
+{//registry of the threads' buffers (see Metrics for the same ownership): the buffer of the finished thread
+ //goes to the next new one. Timestamps are TSC ticks (steady clock nanoseconds without TSC), the dump
+ //converts them to microseconds by the rate measured since the start
+	struct BufferOwner
+	{
+		TraceBuffer* buffer;
+
+		BufferOwner() : buffer(nullptr) {}
+		~BufferOwner()
+		{
+			if (buffer != nullptr)
+				buffer->owned = false;
+		}
+	};
+
+	std::mutex _lock;
+	std::deque<TraceBuffer> _buffers;
+	unsigned long long _startTicks;
+	long long _startUs;
+
+	Tracer() : _startTicks(ticks()), _startUs(nowUs()) {}
+	//запрет копирования и присваивания
+	Tracer(Tracer&);
+	Tracer& operator=(Tracer&);
+public:
+	static Tracer& global()
+	{//the threads may record while the process exits: the registry is not destroyed
+		static Tracer* tracer = new Tracer();
+		return *tracer;
+	}
+
+	static TraceBuffer& local()
+	{
+		static thread_local BufferOwner owner;
+		if (owner.buffer == nullptr)
+			owner.buffer = global().take();
+		return *owner.buffer;
+	}
+
+	static unsigned long long ticks()
+	{
+#if defined(TRACE_TSC)
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	static void record(const char* name, unsigned long long start)
+	{
+		local().add(name, start, ticks());
+	}
+
+	size_t dump(ostream& stream)
+	{//trace-event JSON of the spans in the buffers, the number of the spans
+		double ticksPerUs = 1000.0;
+		long long elapsedUs = nowUs() - _startUs;
+		unsigned long long elapsedTicks = ticks() - _startTicks;
+		if (elapsedUs > 0 && elapsedTicks > 0)
+			ticksPerUs = (double)elapsedTicks / elapsedUs;
+
+		std::lock_guard<std::mutex> lock(_lock);
+		vector<vector<TraceBuffer::Span>> spans(_buffers.size());
+		//the first span may have begun before the registry
+		unsigned long long base = _startTicks;
+		size_t count = 0;
+		for (size_t i = 0; i < _buffers.size(); i++)
+		{
+			_buffers[i].copy(spans[i]);
+			for (const TraceBuffer::Span& span : spans[i])
+				base = std::min(base, span.start);
+			count += spans[i].size();
+		}
+		stream << fixed << setprecision(3) << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+		for (size_t i = 0; i < _buffers.size(); i++)
+		{
+			int id = _buffers[i].id();
+			stream << (i == 0 ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << id
+				<< ", \"args\": {\"name\": \"thread " << id << "\"}}";
+			for (const TraceBuffer::Span& span : spans[i])
+			{
+				double dur = (span.end >= span.start) ? (span.end - span.start) / ticksPerUs : 0;
+				stream << ",\n{\"name\": \"" << span.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << id
+					<< ", \"ts\": " << (span.start - base) / ticksPerUs << ", \"dur\": " << dur << "}";
+			}
+		}
+		stream << "\n]}\n";
+		return count;
+	}
+
+private:
+	static long long nowUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	TraceBuffer* take()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		for (TraceBuffer& buffer : _buffers)
+			if (!buffer.owned)
+			{
+				buffer.owned = true;
+				return &buffer;
+			}
+		_buffers.emplace_back((int)_buffers.size() + 1);
+		_buffers.back().owned = true;
+		return &_buffers.back();
+	}
+};
+
+class TraceSpan
+{//span of the scope
+	const char* _name;
+	unsigned long long _start;
+
+	//запрет копирования и присваивания
+	TraceSpan(TraceSpan&);
+	TraceSpan& operator=(TraceSpan&);
+public:
+	explicit TraceSpan(const char* name) : _name(name), _start(Tracer::ticks()) {}
+	~TraceSpan() { Tracer::record(_name, _start); }
+};
+
+#define TRACE_JOIN_(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN_(a, b)
+
+#if defined(TRACING)
+//the rest of the scope
+#define TRACE_SPAN(name) TraceSpan TRACE_JOIN(traceSpan, __LINE__)(name)
+//span across the calls: the start is kept in the variable (declared with TRACE_TICKS) until TRACE_SINCE,
+//the first mark counts
+#define TRACE_TICKS(variable) unsigned long long variable = 0
+#define TRACE_MARK(variable) ((variable) = ((variable) != 0) ? (variable) : Tracer::ticks())
+#define TRACE_SINCE(name, variable) \
+	do { if ((variable) != 0) { Tracer::record(name, variable); (variable) = 0; } } while (false)
+#else
+#define TRACE_SPAN(name)
+#define TRACE_TICKS(variable)
+#define TRACE_MARK(variable)
+#define TRACE_SINCE(name, variable)
+#endif
+
+#endif //TRACE_H
@@ -0,0 +1,448 @@
+#ifndef TRANSFERJOURNAL_H
+#define TRANSFERJOURNAL_H
+
+#include "Includes.h"
+#include "Checksum.h"
+#include "SessionTable.h"
+
+class TransferJournal
+{//TCP transfers in progress kept on the disk: after a crash (a deploy) the restarted server resumes
+ //them when their clients reconnect. The records go to the buffer and are written by flush() with one
+ //fsync per FlushInterval for all the transfers; the uploaded files are synced before their offsets
+ //are recorded, so the recorded offset is durable. One line per record:
+ //	B <client id> <D|U> <version> <bufLen> <timeOut> <file length> <range begin> <range length> <file name>
+ //	O <client id> <durable offset> <first chunk> <CRC-32C of the chunks from the first one, hex>...
+ //	E <client id>
+ //the torn last line is ignored, the journal is rewritten with the live transfers when it grows
+public:
+	struct Entry
+	{
+		int clientId;
+		bool upload;
+		int version;
+		int bufLen;
+		int timeOut;
+		long long fileLength;
+		long long rangeBegin;
+		long long rangeLength;
+		string fileName;
+		//upload: bytes which are on the disk for sure and the checksums of their chunks
+		long long durable;
+		vector<uint32_t> checksums;
+
+		Entry() : clientId(0), upload(false), version(1), bufLen(0), timeOut(0), fileLength(0),
+			rangeBegin(0), rangeLength(-1), durable(0) {}
+	};
+
+	//checksummed piece of the upload, the durable offset is a multiple of it
+	static const int ChunkSize = 1024 * 1024;
+	//the journal is written (synced) at most once per interval, ms
+	static const int FlushInterval = 200;
+	//the journal is rewritten when it is larger
+	static const long long CompactSize = 4 * 1024 * 1024;
+	//transfers of the previous run wait for their clients, s
+	static const int RestoreWindow = 600;
+private:
+	struct Live
+	{
+		Entry entry;
+		//bytes received by the upload, durable after the next flush
+		long long received;
+		//transfers of one client id one after another
+		unsigned serial;
+		//transfer of the previous run until its client comes back
+		bool restorable;
+		time_t deadline;
+	};
+	struct Dirty
+	{//upload whose new chunks are synced by the flush
+		int clientId;
+		unsigned serial;
+		string fileName;
+		long long rangeBegin;
+		long long from;
+		long long to;
+		vector<uint32_t> checksums;
+	};
+
+	string _path;
+	std::mutex _lock;
+	SessionTable<Live> _live;
+	//records to be written
+	string _pending;
+	unsigned _serial;
+	//there is something for the next flush
+	std::atomic<bool> _dirty;
+
+	//one flush at a time (the other workers don't wait for it)
+	std::mutex _flushLock;
+	std::atomic<long long> _lastFlush;
+	long long _size;
+#if defined(UNIX)
+	int _handle;
+#else
+	std::ofstream _file;
+#endif
+
+	//запрет копирования и присваивания
+	TransferJournal(TransferJournal&);
+	TransferJournal& operator=(TransferJournal&);
+public:
+	TransferJournal(const string& path) : _path(path), _serial(0), _dirty(false), _lastFlush(0), _size(0)
+	{//the transfers of the previous run are read, the journal is rewritten with them
+#if defined(UNIX)
+		_handle = -1;
+#endif
+		load();
+		compact();
+	}
+
+	~TransferJournal()
+	{
+		flush(true);
+		closeJournal();
+	}
+
+	//the workers don't wait for the events longer than FlushInterval then
+	bool dirty()const { return _dirty; }
+
+	void begin(const Entry& entry)
+	{//the transfer has exchanged its hint data (the other transfer of the client is forgotten)
+		std::lock_guard<std::mutex> lock(_lock);
+		Live& live = _live[entry.clientId];
+		live.entry = entry;
+		live.received = entry.durable;
+		live.serial = ++_serial;
+		live.restorable = false;
+		live.deadline = 0;
+		_pending += beginRecord(entry);
+		_dirty = true;
+	}
+
+	void progress(int clientId, long long received)
+	{//upload has received the bytes (a multiple of ChunkSize)
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _live.find(clientId);
+		if (it != _live.end())
+			it->second.received = std::max(it->second.received, received);
+		_dirty = true;
+	}
+
+	void end(int clientId)
+	{//the transfer is over (or it won't be resumed)
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_live.erase(clientId) > 0)
+		{
+			_pending += "E " + toString(clientId) + "\n";
+			_dirty = true;
+		}
+	}
+
+	bool take(int clientId, Entry& entry)
+	{//transfer of the previous run for the reconnected client: its durable offset is checked
+	 //against the file (the chunks after the first bad one are received again)
+		unsigned serial;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			auto it = _live.find(clientId);
+			if (it == _live.end() || !it->second.restorable)
+				return false;
+			it->second.restorable = false;
+			entry = it->second.entry;
+			serial = it->second.serial;
+		}
+		if (!entry.upload)
+			return true;
+
+		long long verified = verify(entry);
+		if (verified == entry.durable)
+			return true;
+		entry.durable = verified;
+		entry.checksums.resize((size_t)(verified / ChunkSize));
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _live.find(clientId);
+		if (it != _live.end() && it->second.serial == serial)
+		{
+			it->second.entry.durable = it->second.received = verified;
+			it->second.entry.checksums = entry.checksums;
+			_pending += offsetRecord(clientId, verified, entry.checksums.size(), vector<uint32_t>());
+			_dirty = true;
+		}
+		return true;
+	}
+
+	void checkTimeouts(time_t now)
+	{//the clients of the previous run which have not come back
+		std::lock_guard<std::mutex> lock(_lock);
+		for (auto it = _live.begin(); it != _live.end();)
+			if (it->second.restorable && now >= it->second.deadline)
+			{
+				_pending += "E " + toString(it->first) + "\n";
+				_dirty = true;
+				it = _live.erase(it);
+			}
+			else
+				++it;
+	}
+
+	void flush(bool force = false)
+	{//called by every worker on each iteration: the new chunks of the uploads are synced,
+	 //then the records are written and synced at once
+		long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		if (!force && now - _lastFlush < FlushInterval)
+			return;
+		std::unique_lock<std::mutex> flushing(_flushLock, std::try_to_lock);
+		if (!flushing.owns_lock())
+			return;
+		_lastFlush = now;
+
+		string records;
+		vector<Dirty> dirty;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			records.swap(_pending);
+			_dirty = false;
+			for (auto& item : _live)
+			{
+				const Live& live = item.second;
+				if (!live.entry.upload || live.restorable || live.received <= live.entry.durable)
+					continue;
+				Dirty upload;
+				upload.clientId = item.first;
+				upload.serial = live.serial;
+				upload.fileName = live.entry.fileName;
+				upload.rangeBegin = (live.entry.rangeLength >= 0) ? live.entry.rangeBegin : 0;
+				upload.from = live.entry.durable;
+				upload.to = live.received;
+				dirty.push_back(upload);
+			}
+		}
+		for (Dirty& upload : dirty)
+			if (syncChunks(upload))
+				records += offsetRecord(upload.clientId, upload.to, (size_t)(upload.from / ChunkSize), upload.checksums);
+		if (records.empty())
+			return;
+		if (!writeJournal(records))
+		{//the next flush tries again
+			std::lock_guard<std::mutex> lock(_lock);
+			_pending.insert(0, records);
+			_dirty = true;
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(_lock);
+		for (Dirty& upload : dirty)
+		{
+			auto it = _live.find(upload.clientId);
+			if (it == _live.end() || it->second.serial != upload.serial || upload.checksums.empty())
+				continue;
+			Entry& entry = it->second.entry;
+			entry.checksums.resize((size_t)(upload.from / ChunkSize));
+			entry.checksums.insert(entry.checksums.end(), upload.checksums.begin(), upload.checksums.end());
+			entry.durable = upload.to;
+		}
+		if (_size > CompactSize)
+			compactLocked();
+	}
+
+private:
+
+	void load()
+	{
+		std::ifstream file(_path, ios::in | ios::binary);
+		string line;
+		time_t deadline = std::time(NULL) + RestoreWindow;
+		while (std::getline(file, line))
+		{
+			//the last line may be torn by the crash
+			if (file.eof())
+				break;
+			istringstream record(line);
+			char kind = 0;
+			int clientId = 0;
+			if (!(record >> kind >> clientId))
+				continue;
+			if (kind == 'B')
+			{
+				Entry entry;
+				char direction = 0;
+				entry.clientId = clientId;
+				if (!(record >> direction >> entry.version >> entry.bufLen >> entry.timeOut >> entry.fileLength >>
+					entry.rangeBegin >> entry.rangeLength >> entry.fileName))
+					continue;
+				entry.upload = direction == 'U';
+				Live& live = _live[clientId];
+				live.entry = entry;
+				live.received = 0;
+				live.serial = ++_serial;
+				live.restorable = true;
+				live.deadline = deadline;
+			}
+			else if (kind == 'O')
+			{
+				auto it = _live.find(clientId);
+				long long offset = 0;
+				size_t first = 0;
+				if (it == _live.end() || !(record >> offset >> first))
+					continue;
+				Entry& entry = it->second.entry;
+				if (first > entry.checksums.size())
+					continue;
+				entry.checksums.resize(first);
+				uint32_t checksum = 0;
+				while (record >> std::hex >> checksum)
+					entry.checksums.push_back(checksum);
+				if ((long long)entry.checksums.size() * ChunkSize < offset)
+				{//the chunks have not been recorded
+					entry.checksums.clear();
+					offset = 0;
+				}
+				entry.durable = offset;
+				it->second.received = offset;
+			}
+			else if (kind == 'E')
+				_live.erase(clientId);
+		}
+	}
+
+	void compact()
+	{
+		std::lock_guard<std::mutex> flushing(_flushLock);
+		std::lock_guard<std::mutex> lock(_lock);
+		compactLocked();
+	}
+
+	void compactLocked()
+	{//the live transfers to the new journal which replaces the old one (the pending records may repeat them)
+		string records;
+		for (auto& item : _live)
+		{
+			const Entry& entry = item.second.entry;
+			records += beginRecord(entry);
+			if (entry.durable > 0)
+				records += offsetRecord(entry.clientId, entry.durable, 0, entry.checksums);
+		}
+		string temporary = _path + ".tmp";
+		{
+			std::ofstream file(temporary, ios::out | ios::trunc | ios::binary);
+			file.write(records.data(), records.size());
+			file.flush();
+			if (file.fail())
+				return;
+		}
+		syncFile(temporary);
+		closeJournal();
+#if defined(WINDOWS)
+		MoveFileExA(temporary.c_str(), _path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+		std::rename(temporary.c_str(), _path.c_str());
+#endif
+		_size = (long long)records.size();
+	}
+
+	bool syncChunks(Dirty& upload)
+	{//checksums of the new chunks, then the file data is synced (any descriptor of the file will do)
+		vector<char> chunk(ChunkSize);
+		std::ifstream file(upload.fileName, ios::in | ios::binary);
+		if (!file.is_open())
+			return false;
+		file.seekg(upload.rangeBegin + upload.from, ios::beg);
+		for (long long offset = upload.from; offset < upload.to; offset += ChunkSize)
+		{
+			int length = (int)std::min<long long>(ChunkSize, upload.to - offset);
+			file.read(chunk.data(), length);
+			if (file.gcount() != length)
+				return false;
+			upload.checksums.push_back(Crc32c::compute(chunk.data(), length));
+		}
+		return syncFile(upload.fileName);
+	}
+
+	static long long verify(const Entry& entry)
+	{//the durable offset as far as the chunks are intact
+		vector<char> chunk(ChunkSize);
+		std::ifstream file(entry.fileName, ios::in | ios::binary);
+		if (!file.is_open())
+			return 0;
+		file.seekg((entry.rangeLength >= 0) ? entry.rangeBegin : 0, ios::beg);
+		for (size_t i = 0; i < entry.checksums.size(); i++)
+		{
+			int length = (int)std::min<long long>(ChunkSize, entry.durable - (long long)i * ChunkSize);
+			file.read(chunk.data(), length);
+			if (file.gcount() != length || Crc32c::compute(chunk.data(), length) != entry.checksums[i])
+				return (long long)i * ChunkSize;
+		}
+		return entry.durable;
+	}
+
+	static string beginRecord(const Entry& entry)
+	{
+		return "B " + toString(entry.clientId) + (entry.upload ? " U " : " D ") + toString(entry.version) + " " +
+			toString(entry.bufLen) + " " + toString(entry.timeOut) + " " + toString(entry.fileLength) + " " +
+			toString(entry.rangeBegin) + " " + toString(entry.rangeLength) + " " + entry.fileName + "\n";
+	}
+
+	static string offsetRecord(int clientId, long long offset, size_t first, const vector<uint32_t>& checksums)
+	{
+		ostringstream record;
+		record << "O " << clientId << " " << offset << " " << first << std::hex;
+		for (uint32_t checksum : checksums)
+			record << " " << checksum;
+		record << "\n";
+		return record.str();
+	}
+
+	bool writeJournal(const string& records)
+	{//appended and synced
+#if defined(UNIX)
+		if (_handle == -1)
+			_handle = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (_handle == -1)
+			return false;
+		for (size_t written = 0; written < records.size();)
+		{
+			ssize_t bytesWrite = ::write(_handle, records.data() + written, records.size() - written);
+			if (bytesWrite <= 0)
+				return false;
+			written += bytesWrite;
+		}
+		fdatasync(_handle);
+#else
+		if (!_file.is_open())
+			_file.open(_path, ios::out | ios::app | ios::binary);
+		_file.write(records.data(), records.size());
+		_file.flush();
+		if (_file.fail())
+			return false;
+#endif
+		_size += (long long)records.size();
+		return true;
+	}
+
+	void closeJournal()
+	{
+#if defined(UNIX)
+		if (_handle != -1)
+			close(_handle);
+		_handle = -1;
+#else
+		_file.close();
+#endif
+	}
+
+	static bool syncFile(const string& fileName)
+	{//the data of the file reaches the disk (the flushed stream buffers on windows)
+#if defined(UNIX)
+		int handle = ::open(fileName.c_str(), O_RDONLY);
+		if (handle == -1)
+			return false;
+		bool synced = fdatasync(handle) == 0;
+		close(handle);
+		return synced;
+#else
+		return true;
+#endif
+	}
+};
+
+#endif //TRANSFERJOURNAL_H
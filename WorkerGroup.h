@@ -0,0 +1,503 @@
+#ifndef WORKERGROUP_H
+#define WORKERGROUP_H
+
+#include "Session.h"
+#include "SessionTable.h"
+
+class Server;
+
+struct WorkerStats
+{//counters of one worker thread, read by the others
+	std::atomic<unsigned long long> accepted;
+	std::atomic<unsigned long long> sessions;
+	std::atomic<unsigned long long> commands;
+	std::atomic<unsigned long long> transfers;
+	std::atomic<unsigned long long> events;
+
+	WorkerStats() : accepted(0), sessions(0), commands(0), transfers(0), events(0) {}
+};
+
+class WorkerGroup
+{//state shared by the servers which listen to the same port in different threads:
+ //a client may reconnect (or send its datagrams) to any of them
+public:
+	enum class Claim { None, Resumed, Await };
+	//end of the transfer of the client: not a range of the parallel upload,
+	//the range is in the staging file, the whole file is (it has to be renamed), the range has failed
+	enum class RangeEnd { None, Range, File, Failed };
+	//transfer of the delta upload (see DeltaSync): not one, the signature of the file, the delta
+	enum class DeltaStage { None, Signature, Delta };
+	//datagrams of the client kept until its UDP command is handled
+	static const size_t EarlyDatagrams = 256;
+
+	struct Waiter
+	{//reconnected client waiting for its old connection to be found lost
+		Server* worker;
+		Session* session;
+	};
+private:
+	struct ParkedTransfer
+	{//transfer waiting for its client to reconnect
+		unique_ptr<FileWorker> fileWorker;
+		TransferKind kind;
+		time_t deadline;
+	};
+	struct UdpRequest
+	{//UDP command waiting for the datagram with the client address
+		Server* worker;
+		int serial;
+		string host;
+		time_t deadline;
+	};
+	struct UdpPeer
+	{//client address received before the command, the datagrams of the transfer which have followed it
+		sockaddr_storage address;
+		string host;
+		string key;
+		vector<string> early;
+		time_t deadline;
+	};
+	struct ChunkedUpload
+	{//file uploaded by ranges over many connections (the order doesn't matter):
+	 //they are written into the staging file, the file is renamed into place when every chunk is there
+		string fileName;
+		string stagingName;
+		long long fileLength;
+		//chunk i = bytes [i * Connection::RangeAlignment, (i + 1) * Connection::RangeAlignment)
+		vector<bool> chunks;
+		size_t chunksLeft;
+		//ranges being received or parked, without them the upload is forgotten after timeOut seconds
+		int ranges;
+		int timeOut;
+		time_t deadline;
+	};
+	struct RangeUpload
+	{
+		int token;
+		long long begin;
+		long long end;
+	};
+	struct DeltaUpload
+	{//the temporary file is removed if the client doesn't finish its transfer
+		string fileName;
+		string tempName;
+		DeltaStage stage;
+		int timeOut;
+		time_t deadline;
+	};
+
+	std::mutex _lock;
+	std::deque<WorkerStats> _stats;
+	//TCP transfers on the disk (it has its own lock)
+	TransferJournal _journal;
+	//contents of the downloaded files (it has its own locks)
+	FileCache _fileCache;
+
+	//interrupted transfers by client id
+	SessionTable<ParkedTransfer> _parkedTransfers;
+	//workers running the TCP transfers by client id
+	SessionTable<Server*> _transfers;
+	SessionTable<Waiter> _waiters;
+
+	std::deque<UdpRequest> _udpRequests;
+	std::deque<UdpPeer> _udpPeers;
+	//worker which handles the datagrams of the client address
+	std::map<string, Server*> _udpRoutes;
+	//worker which runs the UDP transfer of the client
+	SessionTable<Server*> _udpClients;
+
+	//parallel uploads by token
+	std::map<int, ChunkedUpload> _uploads;
+	//ranges being uploaded by client id (of the stream's connection)
+	SessionTable<RangeUpload> _rangeUploads;
+	int _uploadSerial;
+	//signatures being downloaded and deltas being uploaded by client id
+	SessionTable<DeltaUpload> _deltaUploads;
+
+	//запрет копирования и присваивания
+	WorkerGroup(WorkerGroup&);
+	WorkerGroup& operator=(WorkerGroup&);
+public:
+	WorkerGroup(const string& journalPath = "transfers.journal") : _journal(journalPath), _uploadSerial(0) {}
+
+	TransferJournal& journal() { return _journal; }
+	FileCache& fileCache() { return _fileCache; }
+
+	WorkerStats& addWorker()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_stats.emplace_back();
+		return _stats.back();
+	}
+
+	string statsReport()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		std::ostringstream report;
+		//one line for the clients reading the reply by lines
+		for (size_t i = 0; i < _stats.size(); i++)
+		{
+			if (i > 0) report << "; ";
+			report << "worker " << i
+				<< ": accepted " << _stats[i].accepted
+				<< ", sessions " << _stats[i].sessions
+				<< ", commands " << _stats[i].commands
+				<< ", transfers " << _stats[i].transfers
+				<< ", events " << _stats[i].events;
+		}
+		return report.str();
+	}
+
+	//-------------------------------- reconnection ----------------------------------//
+
+	void beginTransfer(int clientId, Server* worker)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_transfers[clientId] = worker;
+	}
+
+	bool endTransfer(int clientId, Server* worker, Waiter& waiter)
+	{//returns true if the reconnected client is waiting for the transfer
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _transfers.find(clientId);
+		if (it == _transfers.end() || it->second != worker)
+			return false;
+		_transfers.erase(it);
+		return takeWaiter(clientId, waiter);
+	}
+
+	bool park(int clientId, Server* worker, unique_ptr<FileWorker> fileWorker, TransferKind kind, time_t deadline, Waiter& waiter)
+	{//returns true if the reconnected client is waiting for the transfer
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _transfers.find(clientId);
+		if (it != _transfers.end() && it->second == worker)
+			_transfers.erase(it);
+
+		ParkedTransfer& parked = _parkedTransfers[clientId];
+		parked.fileWorker = std::move(fileWorker);
+		parked.kind = kind;
+		parked.deadline = deadline;
+		return takeWaiter(clientId, waiter);
+	}
+
+	Claim claim(int clientId, Server* worker, Session* session, unique_ptr<FileWorker>& fileWorker, TransferKind& kind)
+	{//the client has connected: resume its transfer,
+	 //or wait if its old connection has not been found lost yet (it may be served by the other worker)
+		std::lock_guard<std::mutex> lock(_lock);
+		if (unparkLocked(clientId, fileWorker, kind))
+			return Claim::Resumed;
+		if (_transfers.find(clientId) == _transfers.end())
+			return Claim::None;
+		Waiter& waiter = _waiters[clientId];
+		waiter.worker = worker;
+		waiter.session = session;
+		return Claim::Await;
+	}
+
+	bool unpark(int clientId, unique_ptr<FileWorker>& fileWorker, TransferKind& kind)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return unparkLocked(clientId, fileWorker, kind);
+	}
+
+	//-------------------------------- UDP rendezvous ----------------------------------//
+
+	bool requestUdpPeer(Server* worker, int serial, const string& host, time_t deadline, sockaddr_storage& address, vector<string>& early)
+	{//take the address received from the host (and the datagrams which have followed it) or wait for it
+		std::lock_guard<std::mutex> lock(_lock);
+		for (auto it = _udpPeers.begin(); it != _udpPeers.end(); ++it)
+			if (it->host == host)
+			{
+				address = it->address;
+				early.swap(it->early);
+				_udpPeers.erase(it);
+				return true;
+			}
+		UdpRequest request;
+		request.worker = worker;
+		request.serial = serial;
+		request.host = host;
+		request.deadline = deadline;
+		_udpRequests.push_back(request);
+		return false;
+	}
+
+	bool takeUdpRequest(const sockaddr_storage& address, const string& host, const string& key, time_t deadline, Server*& worker, int& serial)
+	{//client address for the UDP command:
+	 //the first request from the same host, the oldest one otherwise
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = std::find_if(_udpRequests.begin(), _udpRequests.end(),
+			[&](const UdpRequest& request) { return request.host == host; });
+		if (it == _udpRequests.end())
+			it = _udpRequests.begin();
+
+		if (it == _udpRequests.end())
+		{//command has not been received yet
+			UdpPeer peer;
+			peer.address = address;
+			peer.host = host;
+			peer.key = key;
+			peer.deadline = deadline;
+			_udpPeers.push_back(peer);
+			return false;
+		}
+		worker = it->worker;
+		serial = it->serial;
+		_udpRequests.erase(it);
+		_udpRoutes[key] = worker;
+		return true;
+	}
+
+	bool holdUdpDatagram(const string& key, const char* data, int length)
+	{//the client of the waiting address has begun its transfer (the upload) before the command has been
+	 //handled: the datagram waits for the transfer (the window sends the rest again)
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = std::find_if(_udpPeers.begin(), _udpPeers.end(), [&](const UdpPeer& peer) { return peer.key == key; });
+		if (it == _udpPeers.end())
+			return false;
+		if (it->early.size() < EarlyDatagrams)
+			it->early.emplace_back(data, length);
+		return true;
+	}
+
+	void cancelUdpRequest(Server* worker, int serial)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_udpRequests.erase(std::remove_if(_udpRequests.begin(), _udpRequests.end(),
+			[&](const UdpRequest& request) { return request.worker == worker && request.serial == serial; }), _udpRequests.end());
+	}
+
+	Server* udpRoute(const string& key)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _udpRoutes.find(key);
+		return it == _udpRoutes.end() ? nullptr : it->second;
+	}
+
+	void setUdpRoute(const string& key, Server* worker)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_udpRoutes[key] = worker;
+	}
+
+	void removeUdpRoute(const string& key, Server* worker)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _udpRoutes.find(key);
+		if (it != _udpRoutes.end() && it->second == worker)
+			_udpRoutes.erase(it);
+	}
+
+	Server* udpClient(int clientId)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _udpClients.find(clientId);
+		return it == _udpClients.end() ? nullptr : it->second;
+	}
+
+	void setUdpClient(int clientId, Server* worker)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_udpClients[clientId] = worker;
+	}
+
+	void removeUdpClient(int clientId, Server* worker)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _udpClients.find(clientId);
+		if (it != _udpClients.end() && it->second == worker)
+			_udpClients.erase(it);
+	}
+
+	//-------------------------------- parallel upload ----------------------------------//
+
+	int beginUpload(const string& fileName, long long fileLength, int timeOut, string& stagingName)
+	{//token of the new upload (0 - no memory for it), the caller creates the staging file (or cancels the upload)
+		std::lock_guard<std::mutex> lock(_lock);
+		int token = ++_uploadSerial;
+		ChunkedUpload& upload = _uploads[token];
+		upload.fileName = fileName;
+		upload.stagingName = stagingName = fileName + "." + toString(token) + ".part";
+		upload.fileLength = fileLength;
+		//the last chunk may be shorter (no overflow near the largest length)
+		long long chunks = fileLength / Connection::RangeAlignment + (fileLength % Connection::RangeAlignment != 0 ? 1 : 0);
+		try
+		{
+			upload.chunks.assign((size_t)chunks, false);
+		}
+		catch (const std::bad_alloc&)
+		{
+			_uploads.erase(token);
+			return 0;
+		}
+		upload.chunksLeft = upload.chunks.size();
+		upload.ranges = 0;
+		upload.timeOut = timeOut;
+		upload.deadline = std::time(NULL) + timeOut;
+		return token;
+	}
+
+	void cancelUpload(int token)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_uploads.erase(token);
+	}
+
+	bool beginRange(int token, int clientId, long long begin, long long end, string& stagingName)
+	{//the range of whole chunks (the last one may be shorter) is going to be received by the client's connection
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _uploads.find(token);
+		if (it == _uploads.end() || _rangeUploads.find(clientId) != _rangeUploads.end())
+			return false;
+		ChunkedUpload& upload = it->second;
+		//(the empty file is the empty range)
+		if (begin < 0 || (begin >= end && upload.fileLength > 0) || begin > end || end > upload.fileLength ||
+			begin % Connection::RangeAlignment != 0 || (end % Connection::RangeAlignment != 0 && end != upload.fileLength))
+			return false;
+		RangeUpload& range = _rangeUploads[clientId];
+		range.token = token;
+		range.begin = begin;
+		range.end = end;
+		upload.ranges++;
+		stagingName = upload.stagingName;
+		return true;
+	}
+
+	RangeEnd endRange(int clientId, bool result, string& stagingName, string& fileName)
+	{//the transfer of the client is over; File - every chunk has been received,
+	 //the caller renames the staging file (the upload is forgotten)
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _rangeUploads.find(clientId);
+		if (it == _rangeUploads.end())
+			return RangeEnd::None;
+		RangeUpload range = it->second;
+		_rangeUploads.erase(it);
+		auto found = _uploads.find(range.token);
+		if (found == _uploads.end())
+			return RangeEnd::Failed;
+		ChunkedUpload& upload = found->second;
+		upload.ranges--;
+		upload.deadline = std::time(NULL) + upload.timeOut;
+		if (!result)
+			return RangeEnd::Failed;
+
+		size_t last = (size_t)((range.end + Connection::RangeAlignment - 1) / Connection::RangeAlignment);
+		for (size_t chunk = (size_t)(range.begin / Connection::RangeAlignment); chunk < last; chunk++)
+			if (!upload.chunks[chunk])
+			{
+				upload.chunks[chunk] = true;
+				upload.chunksLeft--;
+			}
+		if (upload.chunksLeft > 0)
+			return RangeEnd::Range;
+		stagingName = upload.stagingName;
+		fileName = upload.fileName;
+		_uploads.erase(found);
+		return RangeEnd::File;
+	}
+
+	//-------------------------------- delta upload ----------------------------------//
+
+	void beginDelta(int clientId, const string& fileName, const string& tempName, DeltaStage stage, int timeOut)
+	{//the transfer of the temporary file begins (the previous one of the client is forgotten)
+		std::lock_guard<std::mutex> lock(_lock);
+		DeltaUpload& delta = _deltaUploads[clientId];
+		if (!delta.tempName.empty() && delta.tempName != tempName)
+			std::remove(delta.tempName.c_str());
+		delta.fileName = fileName;
+		delta.tempName = tempName;
+		delta.stage = stage;
+		delta.timeOut = timeOut;
+		delta.deadline = std::time(NULL) + timeOut;
+	}
+
+	DeltaStage endDelta(int clientId, string& fileName, string& tempName)
+	{//the transfer of the client is over, the caller removes (or applies) the temporary file
+		std::lock_guard<std::mutex> lock(_lock);
+		auto it = _deltaUploads.find(clientId);
+		if (it == _deltaUploads.end())
+			return DeltaStage::None;
+		fileName = it->second.fileName;
+		tempName = it->second.tempName;
+		DeltaStage stage = it->second.stage;
+		_deltaUploads.erase(it);
+		return stage;
+	}
+
+	void checkTimeouts(time_t now)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		for (auto it = _parkedTransfers.begin(); it != _parkedTransfers.end();)
+			if (now >= it->second.deadline)
+			{
+				//the range of the parallel upload won't come
+				auto range = _rangeUploads.find(it->first);
+				if (range != _rangeUploads.end())
+				{
+					auto upload = _uploads.find(range->second.token);
+					if (upload != _uploads.end())
+					{
+						upload->second.ranges--;
+						upload->second.deadline = now + upload->second.timeOut;
+					}
+					_rangeUploads.erase(range);
+				}
+				it = _parkedTransfers.erase(it);
+			}
+			else
+				++it;
+
+		for (auto it = _uploads.begin(); it != _uploads.end();)
+			if (it->second.ranges == 0 && now >= it->second.deadline)
+			{//the client has gone
+				std::remove(it->second.stagingName.c_str());
+				it = _uploads.erase(it);
+			}
+			else
+				++it;
+
+		for (auto it = _deltaUploads.begin(); it != _deltaUploads.end();)
+			if (_transfers.find(it->first) != _transfers.end() || _parkedTransfers.find(it->first) != _parkedTransfers.end())
+			{//the time runs from the end of the transfer
+				it->second.deadline = now + it->second.timeOut;
+				++it;
+			}
+			else if (now >= it->second.deadline)
+			{
+				std::remove(it->second.tempName.c_str());
+				it = _deltaUploads.erase(it);
+			}
+			else
+				++it;
+
+		while (!_udpPeers.empty() && now >= _udpPeers.front().deadline)
+			_udpPeers.pop_front();
+
+		_journal.checkTimeouts(now);
+	}
+
+private:
+
+	bool unparkLocked(int clientId, unique_ptr<FileWorker>& fileWorker, TransferKind& kind)
+	{
+		auto it = _parkedTransfers.find(clientId);
+		if (it == _parkedTransfers.end())
+			return false;
+		fileWorker = std::move(it->second.fileWorker);
+		kind = it->second.kind;
+		_parkedTransfers.erase(it);
+		return true;
+	}
+
+	bool takeWaiter(int clientId, Waiter& waiter)
+	{
+		auto it = _waiters.find(clientId);
+		if (it == _waiters.end())
+			return false;
+		waiter = it->second;
+		_waiters.erase(it);
+		return true;
+	}
+};
+
+#endif //WORKERGROUP_H
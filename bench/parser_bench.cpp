@@ -0,0 +1,166 @@
+//command line parsing: std::regex (as the server did it) against CommandParser
+//the results are compared on the sample and random lines before the timing
+
+#include "../CommandParser.h"
+
+#include <regex>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+
+namespace regexParser
+{
+	bool checkFormat(const string& message)
+	{
+		std::regex regExp("( )*[A-Za-z0-9_]+(( )+(.)+)?(\r\n|\n)");
+		return std::regex_match(message, regExp);
+	}
+
+	string cut(string& message, const string& pattern)
+	{
+		std::regex regExp(pattern);
+		std::smatch matches;
+		std::regex_search(message, matches, regExp);
+		string result = matches.empty() ? string("") : matches[0];
+		message = matches.suffix().str();
+		return result;
+	}
+
+	string first(const string& message, const string& pattern)
+	{
+		std::regex regExp(pattern);
+		std::smatch matches;
+		std::regex_search(message, matches, regExp);
+		return matches.empty() ? string("") : matches[0];
+	}
+}
+
+struct Parsed
+{
+	bool valid;
+	string command;
+	string rest;
+	string fileName;
+	string echo;
+	bool exit;
+
+	bool operator==(const Parsed& other)const
+	{
+		return valid == other.valid && command == other.command && rest == other.rest &&
+			fileName == other.fileName && echo == other.echo && exit == other.exit;
+	}
+};
+
+static Parsed parseWithRegex(const string& line)
+{
+	Parsed parsed;
+	parsed.valid = regexParser::checkFormat(line);
+	parsed.rest = line;
+	parsed.command = regexParser::cut(parsed.rest, "[A-Za-z0-9_]+");
+	parsed.fileName = regexParser::first(parsed.rest, "[A-Za-z0-9]+.[A-Za-z0-9]+");
+	parsed.echo = parsed.rest;
+	regexParser::cut(parsed.echo, "( )+");
+	parsed.exit = std::regex_search(line, std::regex("quit|exit|close"));
+	return parsed;
+}
+
+static Parsed parseWithParser(const string& line)
+{
+	Parsed parsed;
+	parsed.valid = CommandParser::checkFormat(line);
+	StringRef rest;
+	parsed.command = CommandParser::command(line, rest).str();
+	parsed.rest = rest.str();
+	parsed.fileName = CommandParser::fileName(rest).str();
+	parsed.echo = CommandParser::afterSpaces(rest).str();
+	parsed.exit = CommandParser::contains(line, "quit") || CommandParser::contains(line, "exit") || CommandParser::contains(line, "close");
+	return parsed;
+}
+
+static string escape(const string& line)
+{
+	string result;
+	for (char c : line)
+		if (c == '\r') result += "\\r";
+		else if (c == '\n') result += "\\n";
+		else result += c;
+	return result;
+}
+
+template<typename Parse>
+static double measure(const vector<string>& lines, int rounds, Parse parse, size_t& checksum)
+{//nanoseconds per line
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; i++)
+		for (const string& line : lines)
+			checksum += parse(line);
+	auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+	return (double)elapsed.count() / ((double)rounds * lines.size());
+}
+
+int main(int argc, char** argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+
+	vector<string> lines = {
+		"echo hello world\r\n", "time\r\n", "quit\n", "download file.txt\r\n", "upload up_huge.bin\r\n",
+		"download_udp big.bin\n", "  workers\r\n", "echo  \r\n", "echo \r\n", "echo\r\n", "bad-command\r\n",
+		"echo a\rb\r\n", "echo x\n\n", "\r\n", "", "echo close the door\r\n", "download a.b.c.d\r\n",
+		"download .bin x.y\r\n", "download ab\r\n", "upload 1_2\r\n"
+	};
+	//random lines over the grammar alphabet
+	std::mt19937 generator(7);
+	const char alphabet[] = "ab_1. -\r\nqx";
+	for (int i = 0; i < 2000; i++)
+	{
+		string line;
+		int length = generator() % 24;
+		for (int j = 0; j < length; j++)
+			line += alphabet[generator() % (sizeof(alphabet) - 1)];
+		if (generator() % 2) line += "\r\n";
+		lines.push_back(line);
+	}
+
+	int mismatches = 0;
+	for (const string& line : lines)
+		if (!(parseWithRegex(line) == parseWithParser(line)))
+		{
+			if (mismatches++ < 10)
+				cerr << "mismatch: \"" << escape(line) << "\"" << endl;
+		}
+	if (mismatches > 0)
+	{
+		cerr << mismatches << " mismatches" << endl;
+		return 1;
+	}
+
+	//the requests as the server gets them
+	vector<string> requests(lines.begin(), lines.begin() + 20);
+	size_t checksum = 0;
+	double regexTime = measure(requests, rounds / 10 + 1, [](const string& line)
+	{
+		string rest = line;
+		bool valid = regexParser::checkFormat(line);
+		string command = regexParser::cut(rest, "[A-Za-z0-9_]+");
+		return valid + command.size() + regexParser::first(rest, "[A-Za-z0-9]+.[A-Za-z0-9]+").size() +
+			std::regex_search(line, std::regex("quit|exit|close"));
+	}, checksum);
+	double parserTime = measure(requests, rounds * 10, [](const string& line)
+	{
+		StringRef rest;
+		bool valid = CommandParser::checkFormat(line);
+		StringRef command = CommandParser::command(line, rest);
+		return valid + command.size + CommandParser::fileName(rest).size +
+			(CommandParser::contains(line, "quit") || CommandParser::contains(line, "exit") || CommandParser::contains(line, "close"));
+	}, checksum);
+
+	cout << lines.size() << " lines parsed equally" << endl;
+	cout << "std::regex:    " << regexTime << " ns/line" << endl;
+	cout << "CommandParser: " << parserTime << " ns/line" << endl;
+	cout << "speedup:       " << regexTime / parserTime << "x" << " (checksum " << checksum << ")" << endl;
+	return 0;
+}
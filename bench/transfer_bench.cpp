@@ -0,0 +1,503 @@
+//transfers and commands on the loopback: the servers run in this process (one per chunk size, each on its
+//own port), the clients are ClientSocket/UDP_ClientSocket connections as the real client has them.
+//download, upload, download_udp and upload_udp are swept over the file sizes, chunk sizes and numbers of
+//concurrent clients; echo and time are timed one by one. JSON goes to the output file (stdout by default):
+//throughput, p50/p99/p999 latency, CPU time and system calls per MB (perf tracepoint raw_syscalls:sys_enter
+//if the kernel allows it, null otherwise; context switches per MB always) - to compare the versions
+//
+//bench [--sizes 65536,1048576,8388608] [--chunks 1024,8192,32768] [--concurrency 1,4,16]
+//      [--ops download,upload,download_udp,upload_udp] [--repeat 2] [--commands 2000]
+//      [--workers 1] [--version 6] [--port 17100] [--out bench.json] [--quick]
+
+#include "../Includes.h"
+#include "../server.h"
+
+#if defined(UNIX)
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#endif
+
+#include <chrono>
+#include <iomanip>
+
+//the chunk of the server which answers the commands when there are no transfers (as main.cpp has it)
+static const int CommandChunk = 1024;
+
+struct Options
+{
+	vector<long long> sizes = { 64 * 1024, 1024 * 1024, 8 * 1024 * 1024 };
+	vector<long long> chunks = { 1024, 8192, 32768 };
+	vector<long long> concurrency = { 1, 4, 16 };
+	vector<string> ops = { "download", "upload", "download_udp", "upload_udp" };
+	int repeat = 2;
+	int commands = 2000;
+	int workers = 1;
+	int version = Connection::ProtocolVersion;
+	int port = 17100;
+	string out;
+};
+
+struct Usage
+{//the whole process: the servers and the clients
+	double cpuSeconds;
+	long long syscalls;
+	long long contextSwitches;
+};
+
+class SyscallCounter
+{//system calls of the process (the threads started after it too), -1 - the kernel doesn't tell
+	int _handle;
+public:
+	SyscallCounter() : _handle(-1)
+	{
+#if defined(UNIX)
+		const char* paths[] = { "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+			"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" };
+		long long id = -1;
+		for (const char* path : paths)
+		{
+			std::ifstream file(path);
+			if (file >> id)
+				break;
+			id = -1;
+		}
+		if (id < 0)
+			return;
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_TRACEPOINT;
+		attr.config = (unsigned long long)id;
+		attr.inherit = 1;
+		attr.exclude_kernel = 0;
+		_handle = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+
+	~SyscallCounter()
+	{
+#if defined(UNIX)
+		if (_handle != -1)
+			close(_handle);
+#endif
+	}
+
+	bool available()const { return _handle != -1; }
+
+	long long count()const
+	{
+		long long value = -1;
+#if defined(UNIX)
+		if (_handle != -1 && read(_handle, &value, sizeof(value)) != sizeof(value))
+			value = -1;
+#endif
+		return value;
+	}
+};
+
+static SyscallCounter* syscallCounter = nullptr;
+
+static Usage usage()
+{
+	Usage usage = Usage();
+	usage.syscalls = syscallCounter->count();
+#if defined(UNIX)
+	rusage resources;
+	getrusage(RUSAGE_SELF, &resources);
+	usage.cpuSeconds = resources.ru_utime.tv_sec + resources.ru_utime.tv_usec / 1e6 +
+		resources.ru_stime.tv_sec + resources.ru_stime.tv_usec / 1e6;
+	usage.contextSwitches = resources.ru_nvcsw + resources.ru_nivcsw;
+#elif defined(WINDOWS)
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	auto seconds = [](const FILETIME& time) { return (((unsigned long long)time.dwHighDateTime << 32) | time.dwLowDateTime) / 1e7; };
+	usage.cpuSeconds = seconds(kernel) + seconds(user);
+	usage.contextSwitches = -1;
+#endif
+	return usage;
+}
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double percentile(vector<double> values, double fraction)
+{//nearest rank
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	size_t rank = (size_t)std::ceil(fraction * values.size());
+	return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+class BenchClient : public Connection
+{//one client: the command connection, the UDP socket of the datagram transfers
+	string _host;
+	string _port;
+	unique_ptr<Socket> _tcp;
+	unique_ptr<Socket> _udp;
+public:
+	BenchClient(const string& host, const string& port, int chunk, int version) : Connection(chunk, 30), _host(host), _port(port)
+	{
+		_tcp.reset(new ClientSocket((char*)_host.c_str(), (char*)_port.c_str()));
+		_tcp->send(_id);
+		string reply = command("version " + toString(version));
+		_protocolVersion = atoi(CommandParser::afterSpaces(reply).str().c_str());
+	}
+
+	string command(const string& line)
+	{
+		string message = line;
+		_tcp->sendMessage(message);
+		return _tcp->receiveMessage();
+	}
+
+	bool download(const string& fileName, const string& localName)
+	{
+		string message = "download " + fileName;
+		_tcp->sendMessage(message);
+		string local = localName;
+		bool received = receiveFile(_tcp.get(), local, nullptr);
+		_tcp->sendConfirm();
+		return received && CommandParser::contains(_tcp->receiveMessage(), "downloaded");
+	}
+
+	bool upload(const string& fileName, const string& remoteName)
+	{
+		string message = "upload " + remoteName;
+		_tcp->sendMessage(message);
+		string local = fileName;
+		bool sent = sendFile(_tcp.get(), local, nullptr);
+		return sent && CommandParser::contains(_tcp->receiveMessage(), "uploaded");
+	}
+
+	bool downloadUdp(const string& fileName, const string& localName)
+	{
+		startUdp("download_udp " + fileName);
+		string local = localName;
+		bool received = receiveFile(_udp.get(), local, nullptr);
+		_tcp->sendConfirm();
+		return received && CommandParser::contains(_tcp->receiveMessage(), "downloaded");
+	}
+
+	bool uploadUdp(const string& fileName, const string& remoteName)
+	{
+		startUdp("upload_udp " + remoteName);
+		string local = fileName;
+		bool sent = sendFile(_udp.get(), local, nullptr);
+		return sent && CommandParser::contains(_tcp->receiveMessage(), "uploaded");
+	}
+
+private:
+	void fillCommandMap() override {}
+
+	void startUdp(const string& line)
+	{//the first datagram tells the server the client's address; the server pairs the datagrams with
+	 //the commands of the same host in order, so the clients of this process don't interleave them
+		static std::mutex handshake;
+		_udp.reset(new UDP_ClientSocket((char*)_host.c_str(), (char*)_port.c_str()));
+		std::lock_guard<std::mutex> lock(handshake);
+		string message = line;
+		_tcp->sendMessage(message);
+		char hello = 1;
+		_udp->send(hello);
+	}
+};
+
+static string startServer(int port, int chunk, int workers)
+{//the workers never stop (the process ends with _Exit)
+	string service = toString(port);
+	std::thread([service, chunk, workers]()
+	{
+		try
+		{
+			WorkerGroup* group = new WorkerGroup();
+			vector<Server*> servers;
+			for (int i = 0; i < workers; i++)
+				servers.push_back(new Server((char*)"127.0.0.1", (char*)service.c_str(), *group, workers > 1, SOMAXCONN, chunk));
+			for (int i = 1; i < workers; i++)
+				std::thread(&Server::workWithClients, servers[i]).detach();
+			servers[0]->workWithClients();
+		}
+		catch (exception& e)
+		{
+			cerr << "server " << service << ": " << e.what() << endl;
+		}
+	}).detach();
+	//ready when it accepts
+	for (int attempt = 0; attempt < 100; attempt++)
+	{
+		try
+		{
+			ClientSocket probe((char*)"127.0.0.1", (char*)service.c_str());
+			return service;
+		}
+		catch (exception&)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	}
+	throw runtime_error("server " + service + " doesn't start");
+}
+
+static void writeFile(const string& fileName, long long size)
+{
+	std::ofstream file(fileName, ios::out | ios::trunc | ios::binary);
+	std::mt19937 generator((unsigned)size);
+	vector<char> block(64 * 1024);
+	for (long long written = 0; written < size; written += block.size())
+	{
+		for (char& byte : block)
+			byte = (char)generator();
+		file.write(block.data(), (std::streamsize)std::min<long long>(block.size(), size - written));
+	}
+}
+
+static string sourceName(long long size)
+{//[A-Za-z0-9]+.[A-Za-z0-9]+ as the commands take it
+	return "bench" + toString(size) + ".bin";
+}
+
+static string latencyJson(const vector<double>& values, double scale)
+{
+	ostringstream json;
+	json << fixed << setprecision(3) << "{\"p50\": " << percentile(values, 0.5) * scale << ", \"p99\": "
+		<< percentile(values, 0.99) * scale << ", \"p999\": " << percentile(values, 0.999) * scale << "}";
+	return json.str();
+}
+
+static string perMb(long long count, double megabytes)
+{
+	if (count < 0 || megabytes <= 0)
+		return "null";
+	ostringstream value;
+	value << fixed << setprecision(1) << count / megabytes;
+	return value.str();
+}
+
+static string transferCase(const Options& options, const string& service, const string& op, long long size, int chunk, int clients)
+{//clients at once, each one makes repeat transfers; one JSON object
+	std::atomic<int> failed(0);
+	vector<vector<double>> latencies(clients);
+	Usage before = usage();
+	auto start = std::chrono::steady_clock::now();
+	vector<std::thread> threads;
+	for (int c = 0; c < clients; c++)
+		threads.emplace_back([&, c]()
+		{
+			try
+			{
+				BenchClient client("127.0.0.1", service, chunk, options.version);
+				for (int i = 0; i < options.repeat; i++)
+				{
+					string own = "bench" + toString(chunk) + "c" + toString(c) + "n" + toString(i) + ".bin";
+					auto transferStart = std::chrono::steady_clock::now();
+					bool done = false;
+					if (op == "download")
+						done = client.download(sourceName(size), own);
+					else if (op == "upload")
+						done = client.upload(sourceName(size), own);
+					else if (op == "download_udp")
+						done = client.downloadUdp(sourceName(size), own);
+					else if (op == "upload_udp")
+						done = client.uploadUdp(sourceName(size), own);
+					latencies[c].push_back(seconds(transferStart));
+					std::remove(own.c_str());
+					if (!done)
+						failed++;
+				}
+				client.command("quit");
+			}
+			catch (exception&)
+			{
+				failed += options.repeat;
+			}
+		});
+	for (auto& thread : threads)
+		thread.join();
+	double elapsed = seconds(start);
+	Usage after = usage();
+
+	vector<double> all;
+	for (auto& values : latencies)
+		all.insert(all.end(), values.begin(), values.end());
+	long long transfers = (long long)clients * options.repeat;
+	double megabytes = (double)size * (transfers - failed) / 1e6;
+	ostringstream json;
+	json << fixed << setprecision(3)
+		<< "{\"op\": \"" << op << "\", \"file_size\": " << size << ", \"chunk\": " << chunk
+		<< ", \"concurrency\": " << clients << ", \"transfers\": " << transfers << ", \"failed\": " << failed
+		<< ", \"seconds\": " << elapsed << ", \"throughput_mb_s\": " << (elapsed > 0 ? megabytes / elapsed : 0.0)
+		<< ", \"latency_ms\": " << latencyJson(all, 1e3)
+		<< ", \"cpu_seconds\": " << after.cpuSeconds - before.cpuSeconds
+		<< ", \"syscalls_per_mb\": " << perMb(before.syscalls < 0 ? -1 : after.syscalls - before.syscalls, megabytes)
+		<< ", \"context_switches_per_mb\": " << perMb(before.contextSwitches < 0 ? -1 : after.contextSwitches - before.contextSwitches, megabytes)
+		<< "}";
+	return json.str();
+}
+
+static string commandCase(const Options& options, const string& service, const string& line)
+{//round trips of one client, one by one
+	vector<double> latencies;
+	latencies.reserve(options.commands);
+	Usage before = usage();
+	auto start = std::chrono::steady_clock::now();
+	int failed = 0;
+	{
+		BenchClient client("127.0.0.1", service, CommandChunk, options.version);
+		for (int i = 0; i < options.commands; i++)
+		{
+			auto commandStart = std::chrono::steady_clock::now();
+			if (client.command(line).empty())
+				failed++;
+			latencies.push_back(seconds(commandStart));
+		}
+		client.command("quit");
+	}
+	double elapsed = seconds(start);
+	Usage after = usage();
+	ostringstream json;
+	json << fixed << setprecision(3)
+		<< "{\"command\": \"" << line << "\", \"count\": " << options.commands << ", \"failed\": " << failed
+		<< ", \"seconds\": " << elapsed << ", \"latency_us\": " << latencyJson(latencies, 1e6)
+		<< ", \"cpu_seconds\": " << after.cpuSeconds - before.cpuSeconds
+		<< ", \"syscalls_per_command\": ";
+	if (before.syscalls < 0 || options.commands == 0)
+		json << "null";
+	else
+		json << setprecision(1) << (double)(after.syscalls - before.syscalls) / options.commands;
+	json << "}";
+	return json.str();
+}
+
+template<typename T>
+static vector<T> parseList(const string& text)
+{
+	vector<T> values;
+	istringstream stream(text);
+	string item;
+	while (std::getline(stream, item, ','))
+	{
+		T value;
+		istringstream(item) >> value;
+		values.push_back(value);
+	}
+	return values;
+}
+
+static Options parseOptions(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		string name = argv[i];
+		if (name == "--quick")
+		{//a minute at most
+			options.sizes = { 64 * 1024, 1024 * 1024 };
+			options.chunks = { 8192 };
+			options.concurrency = { 1, 4 };
+			options.repeat = 1;
+			options.commands = 500;
+			continue;
+		}
+		if (i + 1 >= argc)
+			throw runtime_error("no value of " + name);
+		string value = argv[++i];
+		if (name == "--sizes")
+			options.sizes = parseList<long long>(value);
+		else if (name == "--chunks")
+			options.chunks = parseList<long long>(value);
+		else if (name == "--concurrency")
+			options.concurrency = parseList<long long>(value);
+		else if (name == "--ops")
+			options.ops = parseList<string>(value);
+		else if (name == "--repeat")
+			options.repeat = std::max(atoi(value.c_str()), 1);
+		else if (name == "--commands")
+			options.commands = std::max(atoi(value.c_str()), 0);
+		else if (name == "--workers")
+			options.workers = std::max(atoi(value.c_str()), 1);
+		else if (name == "--version")
+			options.version = atoi(value.c_str());
+		else if (name == "--port")
+			options.port = atoi(value.c_str());
+		else if (name == "--out")
+			options.out = value;
+		else
+			throw runtime_error("unknown option " + name);
+	}
+	return options;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	try
+	{
+		options = parseOptions(argc, argv);
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << endl;
+		return 2;
+	}
+	Socket::initializeWinsock_();
+	//before any thread: the counter is inherited by the servers and the clients
+	SyscallCounter counter;
+	syscallCounter = &counter;
+
+	for (long long size : options.sizes)
+		writeFile(sourceName(size), size);
+	//the transfers report their progress to cout
+	std::streambuf* console = cout.rdbuf(nullptr);
+
+	ostringstream json;
+	json << "{\n  \"protocol_version\": " << options.version << ",\n  \"workers\": " << options.workers
+		<< ",\n  \"repeat\": " << options.repeat << ",\n  \"syscall_counter\": " << (counter.available() ? "true" : "false")
+		<< ",\n  \"transfers\": [";
+	int status = 0;
+	try
+	{
+		bool first = true;
+		int port = options.port;
+		string commandService;
+		for (long long chunk : options.chunks)
+		{
+			string service = startServer(port++, (int)chunk, options.workers);
+			if (commandService.empty())
+				commandService = service;
+			for (const string& op : options.ops)
+				for (long long size : options.sizes)
+					for (long long clients : options.concurrency)
+					{
+						cerr << op << " " << size << " bytes, chunk " << chunk << ", " << clients << " clients" << endl;
+						json << (first ? "\n    " : ",\n    ") << transferCase(options, service, op, size, (int)chunk, (int)clients);
+						first = false;
+					}
+		}
+		if (commandService.empty())
+			commandService = startServer(port++, CommandChunk, options.workers);
+		json << "\n  ],\n  \"commands\": [\n    " << commandCase(options, commandService, "echo hello")
+			<< ",\n    " << commandCase(options, commandService, "time") << "\n  ]\n}\n";
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << endl;
+		status = 1;
+	}
+
+	cout.rdbuf(console);
+	for (long long size : options.sizes)
+		std::remove(sourceName(size).c_str());
+	if (status == 0)
+	{
+		if (options.out.empty())
+			cout << json.str();
+		else
+			std::ofstream(options.out) << json.str();
+	}
+	cout.flush();
+	//the servers are still running
+	std::_Exit(status);
+}
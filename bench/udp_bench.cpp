@@ -0,0 +1,160 @@
+//UDP on the loopback: one datagram per sendto/recvfrom (as the server did it) against DatagramBatch
+//with sendmmsg/recvmmsg only and with UDP GSO/GRO; the sender floods for the given time,
+//packets per second of both sides and CPU time (both threads) per received gigabyte are reported
+
+#include "../DatagramBatch.h"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+using namespace std;
+
+enum class Mode { Single, Batch, Segmented };
+
+struct Result
+{
+	unsigned long long sent;
+	unsigned long long received;
+	unsigned long long receivedBytes;
+	double seconds;
+	double cpuSeconds;
+	bool segmentation;
+	bool coalescing;
+};
+
+static double cpuTime()
+{
+	timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int udpSocket(sockaddr_in& address)
+{
+	int handle = socket(AF_INET, SOCK_DGRAM, 0);
+	int bufferSize = 4 << 20;
+	setsockopt(handle, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+	setsockopt(handle, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(handle, (sockaddr*)&address, sizeof(address));
+	socklen_t length = sizeof(address);
+	getsockname(handle, (sockaddr*)&address, &length);
+	return handle;
+}
+
+static Result run(Mode mode, int datagramSize, double seconds)
+{
+	sockaddr_in receiverAddress, senderAddress;
+	int receiver = udpSocket(receiverAddress);
+	int sender = udpSocket(senderAddress);
+	sockaddr_storage destination;
+	memset(&destination, 0, sizeof(destination));
+	memcpy(&destination, &receiverAddress, sizeof(receiverAddress));
+
+	Result result = Result();
+	std::atomic<bool> stop(false);
+	std::thread receiving([&]()
+	{
+		vector<char> buffer(65535);
+		DatagramBatch batch(receiver, false, mode == Mode::Segmented);
+		result.coalescing = batch.coalescing();
+		pollfd descriptor = { receiver, POLLIN, 0 };
+		while (!stop)
+		{
+			if (poll(&descriptor, 1, 10) <= 0)
+				continue;
+			if (mode == Mode::Single)
+			{
+				ssize_t length;
+				while ((length = recvfrom(receiver, buffer.data(), buffer.size(), MSG_DONTWAIT, NULL, NULL)) >= 0)
+				{
+					result.received++;
+					result.receivedBytes += length;
+				}
+				continue;
+			}
+			unsigned count;
+			while ((count = batch.receive()) > 0)
+				for (unsigned i = 0; i < count; i++)
+				{
+					result.received++;
+					result.receivedBytes += batch.received(i).length;
+				}
+		}
+	});
+
+	double cpuStart = cpuTime();
+	auto start = std::chrono::steady_clock::now();
+	auto deadline = start + std::chrono::microseconds((long long)(seconds * 1e6));
+	vector<char> datagram(datagramSize, 'x');
+	DatagramBatch batch(sender, mode == Mode::Segmented, false);
+	result.segmentation = batch.segmentation();
+	while (std::chrono::steady_clock::now() < deadline)
+	{
+		for (unsigned i = 0; i < DatagramBatch::SendDatagrams; i++)
+		{
+			if (mode == Mode::Single)
+			{
+				if (sendto(sender, datagram.data(), datagramSize, 0, (sockaddr*)&receiverAddress, sizeof(receiverAddress)) < 0)
+					continue;
+			}
+			else
+				memcpy(batch.append(destination, datagramSize), datagram.data(), datagramSize);
+			result.sent++;
+		}
+		if (mode != Mode::Single)
+		{
+			unsigned long long dropped = batch.dropped();
+			batch.flush();
+			result.sent -= batch.dropped() - dropped;
+		}
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	//the last datagrams on the way
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	stop = true;
+	receiving.join();
+	result.cpuSeconds = cpuTime() - cpuStart;
+	close(sender);
+	close(receiver);
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	int datagramSize = argc > 1 ? atoi(argv[1]) : 1472;
+	double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+
+	const char* names[] = { "sendto/recvfrom", "sendmmsg/recvmmsg", "GSO/GRO" };
+	Mode modes[] = { Mode::Single, Mode::Batch, Mode::Segmented };
+	cout << "datagram " << datagramSize << " bytes, " << seconds << " s per mode" << endl;
+	cout << left << setw(20) << "mode" << right << setw(14) << "sent pps" << setw(14) << "received pps"
+		<< setw(12) << "Gbit/s" << setw(16) << "CPU s per GB" << endl;
+	for (int i = 0; i < 3; i++)
+	{
+		Result result = run(modes[i], datagramSize, seconds);
+		double gigabytes = result.receivedBytes / 1e9;
+		string name = names[i];
+		if (modes[i] == Mode::Segmented && (!result.segmentation || !result.coalescing))
+			name += result.segmentation ? " (no GRO)" : " (no GSO)";
+		cout << left << setw(20) << name << right << fixed << setprecision(0)
+			<< setw(14) << result.sent / result.seconds
+			<< setw(14) << result.received / result.seconds
+			<< setprecision(2) << setw(12) << gigabytes * 8 / result.seconds
+			<< setprecision(3) << setw(16) << (gigabytes > 0 ? result.cpuSeconds / gigabytes : 0.0) << endl;
+	}
+	return 0;
+}
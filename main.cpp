@@ -9,8 +9,16 @@ int main(int argc,char* argv[])
 	{
 		Socket::initializeWinsock_();
 
-		Server server("192.168.1.3","7000");
-		server.workWithClients();
+		//server [number of worker threads] [port of the metrics (Prometheus)]
+		int nWorkers = 1;
+		if (argc > 1)
+		{
+			string threads(argv[1]);
+			nWorkers = toNumber<int>(threads);
+		}
+		char* metricsPort = (argc > 2) ? argv[2] : nullptr;
+
+		Server::runWorkers("192.168.1.3","7000", nWorkers, metricsPort);
 		//some comments
 	}
 	catch (exception e)
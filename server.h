@@ -1,205 +1,903 @@
+
 #ifndef SERVER_H
 #define SERVER_H
 
-#include "Connection.h"
+#include "WorkerGroup.h"
 
-class Server : public Connection
+class Server : public Connection, public SessionListener
 {
 private:
+	struct UdpRequest
+	{//session waiting for the datagram with the client address
+		Session* session;
+		TransferKind kind;
+		string fileName;
+		time_t deadline;
+	};
+
+	//event loop wait (ms) while there are UDP transfers
+	static const int RetransmissionTick = 10;
+	static const int UdpReceiveBuffer = 4 * 1024 * 1024;
+
+	WorkerGroup& _group;
+	WorkerStats& _stats;
+
 	unique_ptr<ServerSocket> _serverSocket;
-	unique_ptr<Socket> _contactSocket;
-	    
+
 	unique_ptr<UDP_ServerSocket> _udpServerSocket;
-	std::queue<int> _clients;
+	//datagrams of the UDP socket by many per system call (unavailable on windows)
+	unique_ptr<DatagramBatch> _datagrams;
+
+	EventLoop _eventLoop;
+	//TCP transfers of the worker (unavailable on windows and old kernels)
+	IoRing _ring;
+	//delta signatures and patches, joined before the event loop is destroyed
+	DiskTasks _diskTasks;
+	CallbackHandler _acceptHandler;
+	CallbackHandler _udpHandler;
+
+	//client connections
+	std::map<Session*, unique_ptr<Session>> _sessions;
+	vector<Session*> _closedSessions;
+	//session whose command is being handled
+	Session* _session;
+
+	//UDP commands by serial number
+	std::map<int, UdpRequest> _udpRequests;
+	int _udpSerial;
+	//sessions by the client UDP address
+	std::map<string, Session*> _udpTransfers;
+	vector<char> _datagram;
+	time_t _lastTimeoutsCheck;
 public:
-	Server(char* nodeName, char* serviceName, int nConnections = 5, int sendBufLen = 1024, int timeOut = 30) : Connection(sendBufLen,timeOut)
+	Server(char* nodeName, char* serviceName, WorkerGroup& group, bool reusePort = false, int nConnections = SOMAXCONN, int sendBufLen = 1024, int timeOut = 30)
+		: Connection(sendBufLen,timeOut), _group(group), _stats(group.addWorker()), _ring(_eventLoop)
 	{//ethernet frame = 1460 bytes
-		_serverSocket.reset(new ServerSocket(nodeName,serviceName, nConnections));
-		_contactSocket = nullptr;
-
-		_udpServerSocket.reset(new UDP_ServerSocket(nodeName, serviceName));
+		_serverSocket.reset(new ServerSocket(nodeName,serviceName, nConnections, reusePort));
+		_serverSocket->makeUnblocked();
+		//progress bytes of the uploads are read in-band, the accepted sockets inherit the option
+		//(the client may send them before the connection is accepted)
+		_serverSocket->setOOBInline();
+		_acceptHandler.setCallback(std::bind(&Server::acceptNewClients, this));
+		_eventLoop.add(_serverSocket->handle(), &_acceptHandler);
+
+		_udpServerSocket.reset(new UDP_ServerSocket(nodeName, serviceName, reusePort));
+		_udpServerSocket->makeUnblocked();
+		//the windows of the transfers come to any worker's socket (the kernel limits the size by rmem_max)
+		_udpServerSocket->setReceiveBufferSize(UdpReceiveBuffer);
+		_udpHandler.setCallback(std::bind(&Server::receiveDatagrams, this));
+		_datagram.resize(std::numeric_limits<unsigned short>::max());
+		_datagrams.reset(new DatagramBatch((int)_udpServerSocket->handle()));
+		_eventLoop.add(_udpServerSocket->handle(), &_udpHandler);
+
+		_session = nullptr;
+		_udpSerial = 0;
+		_lastTimeoutsCheck = std::time(NULL);
+		//the uptime of the metrics is counted from the start
+		Metrics::global();
 
 		fillCommandMap();
 	}
-   
+
 	void workWithClients()
-	{   
+	{
 		while (true)
 		{
-			//try to accept()
-			if (acceptNewClient())
-				//interact with new client
-				clientCommandsHandling();
+			//handle ready clients, UDP transfers need the retransmission timer, the journal is written in time
+			int timeOut = _udpTransfers.empty() ? 1000 : RetransmissionTick;
+			if (_group.journal().dirty())
+				timeOut = std::min(timeOut, +TransferJournal::FlushInterval);
+			_stats.events += _eventLoop.runOnce(timeOut);
+			removeClosedSessions();
+			checkRetransmissions();
+			checkTimeouts();
+			//the datagrams queued by the transfers during the iteration
+			if (!_datagrams->empty())
+			{
+				TRACE_SPAN("send datagrams");
+				_datagrams->flush();
+			}
+			//the transfers' records (one of the workers writes them)
+			_group.journal().flush();
 		}
 	}
 
+	static void runWorkers(char* nodeName, char* serviceName, int nWorkers, char* metricsService = nullptr)
+	{//every worker has its own listening socket, event loop and commands,
+	 //the kernel spreads the new connections among the sockets;
+	 //the metrics are served over HTTP on their own port if it is given
+#if !defined(UNIX)
+		//no SO_REUSEPORT
+		nWorkers = 1;
+#endif
+		nWorkers = std::max(nWorkers, 1);
+		unique_ptr<MetricsEndpoint> metricsEndpoint;
+		if (metricsService != nullptr)
+			metricsEndpoint.reset(new MetricsEndpoint(nodeName, metricsService));
+		WorkerGroup group;
+		vector<unique_ptr<Server>> workers;
+		for (int i = 0; i < nWorkers; i++)
+			workers.emplace_back(new Server(nodeName, serviceName, group, nWorkers > 1));
+
+		vector<std::thread> threads;
+		for (int i = 1; i < nWorkers; i++)
+			threads.emplace_back(&Server::workWithClients, workers[i].get());
+		workers[0]->workWithClients();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
 protected:
 
-	virtual void clientCommandsHandling()
+	void onMessage(Session* session, string& message) override
 	{
-		while (true)
+		_session = session;
+		_stats.commands++;
+		MetricsShard& metrics = Metrics::local();
+		metrics.count(metrics.commands);
+		long long began = Metrics::nowUs();
+		//index of the command, resolved once by catchCommand()
+		int command = -1;
+
+		if (!checkCommandFormat(message))
 		{
-			string message = _contactSocket->receiveMessage();
-			if (message.empty()) break;
-	
-			if (!checkStringFormat(message, "( )*[A-Za-z0-9_]+(( )+(.)+)?(\r\n|\n)"))
-			{  
-                std::string errorMessage = string("invalid command format \"") + message;
-				_contactSocket->sendMessage(errorMessage);
-				continue;
-			}
+			std::string errorMessage = string("invalid command format \"") + message;
+			session->sendMessage(errorMessage);
+		}
+		else if (!catchCommand(message, command))
+			session->sendMessage("unknown command");
 
-			if (!catchCommand(message))
-			{
-				_contactSocket->sendMessage("unknown command");
-				continue;
-			}
-			
-			if (std::regex_search(message, std::regex("quit|exit|close")))
-				break;
+		else if (CommandParser::contains(message, "quit") || CommandParser::contains(message, "exit") || CommandParser::contains(message, "close"))
+			session->finish();
+
+		//dispatch latency of the known commands (the transfers go on in the loop)
+		if (command >= 0)
+			metrics.command(command, _commandTable.name(command), Metrics::nowUs() - began);
+		_session = nullptr;
+	}
+
+	void onIdentified(Session* session) override
+	{
+		//check if old client
+		unique_ptr<FileWorker> fileWorker;
+		TransferKind kind;
+		WorkerGroup::Claim claim = _group.claim(session->clientId(), this, session, fileWorker, kind);
+		MetricsShard& metrics = Metrics::local();
+		if (claim == WorkerGroup::Claim::Resumed)
+		{
+			metrics.count(metrics.reconnects);
+			resumeTransfer(session, std::move(fileWorker), kind);
+		}
+		else if (claim == WorkerGroup::Claim::Await)
+		{
+			metrics.count(metrics.reconnects);
+			//old connection is still open
+			session->suspend();
+		}
+		else
+			restoreTransfer(session);
+	}
+
+	bool restoreTransfer(Session* session)
+	{//transfer of the previous run (the server has been restarted in the middle of it)
+		TransferJournal::Entry entry;
+		if (!_group.journal().take(session->clientId(), entry))
+			return false;
+		unique_ptr<FileWorker> fileWorker(new FileWorker(session->socket(), entry.bufLen, entry.timeOut));
+		fileWorker->useJournal(&_group.journal(), session->clientId());
+		fileWorker->useCache(&_group.fileCache());
+		MetricsShard& metrics = Metrics::local();
+		metrics.count(metrics.reconnects);
+		if (!fileWorker->restore(entry))
+		{//the file has changed, the client's reconnection fails
+			metrics.count(metrics.reconnectFailures);
+			return false;
+		}
+		resumeTransfer(session, std::move(fileWorker), entry.upload ? TransferKind::Upload : TransferKind::Download);
+		return true;
+	}
+
+	void resumeTransfer(Session* session, unique_ptr<FileWorker> fileWorker, TransferKind kind)
+	{
+		//the new connection speaks the protocol of the transfer
+		session->setProtocolVersion(fileWorker->protocolVersion());
+		_group.beginTransfer(session->clientId(), this);
+		fileWorker->resume(session->socket());
+		fileWorker->useRing(&_ring, session);
+		session->startTransfer(std::move(fileWorker), kind);
+	}
+
+	void transferReleased(Session* session, int clientId)
+	{//old connection of the waiting client is over
+		auto it = _sessions.find(session);
+		if (it == _sessions.end() || session->closed() || session->clientId() != clientId)
+			return;
+		unique_ptr<FileWorker> fileWorker;
+		TransferKind kind;
+		if (_group.unpark(clientId, fileWorker, kind))
+			resumeTransfer(session, std::move(fileWorker), kind);
+		else
+			session->proceed();
+	}
+
+	static void notifyWaiter(const WorkerGroup::Waiter& waiter, int clientId)
+	{
+		Server* worker = waiter.worker;
+		Session* session = waiter.session;
+		worker->_eventLoop.post([worker, session, clientId]() { worker->transferReleased(session, clientId); });
+	}
+
+	void onTransferFinished(Session* session, TransferKind kind, bool result) override
+	{
+		_stats.transfers++;
+		WorkerGroup::Waiter waiter;
+		if (_group.endTransfer(session->clientId(), this, waiter))
+			notifyWaiter(waiter, session->clientId());
+
+		string fileName, tempName;
+		WorkerGroup::DeltaStage stage = _group.endDelta(session->clientId(), fileName, tempName);
+		if (stage == WorkerGroup::DeltaStage::Delta)
+		{
+			patchFile(session, fileName, tempName, result);
+			return;
+		}
+		if (stage == WorkerGroup::DeltaStage::Signature)
+			std::remove(tempName.c_str());
 
+		if (kind == TransferKind::Upload)
+		{
+			if (!rangeUploaded(session, result))
+				result ? session->sendMessage("file uploaded\n") : session->sendMessage("fail to upload the file\n");
+			return;
 		}
+		//client confirms the end of downloading
+		session->expectAck([session, result](bool)
+		{
+			result ? session->sendMessage("file downloaded\n") : session->sendMessage("fail to download the file\n");
+		});
+	}
+
+	void onTransferInterrupted(Session* session, unique_ptr<FileWorker> fileWorker, TransferKind kind) override
+	{
+		WorkerGroup::Waiter waiter;
+		if (_group.park(session->clientId(), this, std::move(fileWorker), kind, std::time(NULL) + _timeOut, waiter))
+			notifyWaiter(waiter, session->clientId());
+	}
+
+	void onClosed(Session* session) override
+	{
+		forgetUdpTransfers(session);
+		_group.removeUdpClient(session->clientId(), this);
+		for (auto it = _udpRequests.begin(); it != _udpRequests.end();)
+			if (it->second.session == session)
+			{
+				_group.cancelUdpRequest(this, it->first);
+				it = _udpRequests.erase(it);
+			}
+			else
+				++it;
+		_closedSessions.push_back(session);
 	}
 
 	//---------------------------------  ----------------------------------------//
 
 	bool sendFile(string& message)
 	{
-		bool retVal = Connection::sendFile(_contactSocket.get(), message, std::bind(&Server::tryToReconnect, this, std::placeholders::_1));
-	  
-		_contactSocket->receiveAck();
-	       
-		retVal ? _contactSocket->sendMessage("file downloaded\n") : _contactSocket->sendMessage("fail to download the file\n");
-		return retVal;
+		string fileName = getFileName(message);
+		return startDownload(fileName, 0, -1);
+	}
+
+	bool sendFileParallel(string& message)
+	{//"pdownload <file> <streams>" -> "pdownload <file length> <offset 0> ... <offset n>",
+	 //the client downloads every range over its own connection by "range" (see Connection::receiveFileParallel())
+		StringRef name = CommandParser::fileName(message);
+		long long streams = strtoll(name.end(), nullptr, 10);
+		std::ifstream file(name.str(), ios::in | ios::binary | ios::ate);
+		if (name.empty() || !file.is_open())
+			return _session->sendMessage("fail to download the file\n");
+		vector<long long> bounds = splitRanges(file.tellg(), streams);
+		string reply = "pdownload " + toString(bounds.back());
+		for (long long offset : bounds)
+			reply += " " + toString(offset);
+		return _session->sendMessage(reply);
+	}
+
+	bool sendRange(string& message)
+	{//one stream of the parallel download: "range <file> <begin> <end>", 0 <= begin <= end <= the file length,
+	 //the stream's connection has its own client id, the range is resumed by it
+		StringRef name = CommandParser::fileName(message);
+		char* end = nullptr;
+		char* next = nullptr;
+		long long begin = strtoll(name.end(), &end, 10);
+		long long last = strtoll(end, &next, 10);
+		string fileName = name.str();
+		std::ifstream file(fileName, ios::in | ios::binary | ios::ate);
+		if (name.empty() || end == name.end() || next == end || begin < 0 || last < begin ||
+			!file.is_open() || last > (long long)file.tellg())
+			return _session->sendMessage("fail to download the file\n");
+		return startDownload(fileName, begin, last - begin);
+	}
+
+	bool startDownload(string& fileName, long long rangeBegin, long long rangeLength, bool journaled = true)
+	{
+		unique_ptr<FileWorker> fileWorker(new FileWorker(_session->socket(), _bufLen, _timeOut));
+		fileWorker->useProtocol(_session->protocolVersion());
+		fileWorker->reportProgress(_session->progressInterval(), _session->progressBytes());
+		fileWorker->useCompression(_session->compression());
+		fileWorker->useAutotune(_session->autotune());
+		fileWorker->usePipeline(FileWorker::PipelineDepth);
+		if (rangeLength >= 0)
+			fileWorker->useRange(rangeBegin, rangeLength);
+		if (journaled)
+		{//the temporary files are neither journaled nor cached
+			fileWorker->useJournal(&_group.journal(), _session->clientId());
+			fileWorker->useCache(&_group.fileCache());
+		}
+		fileWorker->beginSend(fileName);
+		fileWorker->useRing(&_ring, _session);
+		_group.beginTransfer(_session->clientId(), this);
+		_session->startTransfer(std::move(fileWorker), TransferKind::Download);
+		return true;
 	}
 	bool receiveFile(string& message)
 	{
-		bool retVal = Connection::receiveFile(_contactSocket.get(), message, std::bind(&Server::tryToReconnect, this, std::placeholders::_1));
-		retVal ? _contactSocket->sendMessage("file uploaded\n") : _contactSocket->sendMessage("fail to upload the file\n");
-		return retVal;
+		string fileName = getFileName(message);
+		return startUpload(fileName, 0, -1);
 	}
 
-	bool sendFileUdp(string& message)
+	bool receiveFileParallel(string& message)
+	{//"pupload <file> <length>" -> "pupload <token>", the client uploads the ranges of the file over
+	 //many connections by "upload_range" (see Connection::sendFileParallel()), they are written
+	 //into the staging file which becomes the file when every chunk is there; the file has to fit
+	 //into the free space of the disk
+		StringRef name = CommandParser::fileName(message);
+		long long fileLength = strtoll(name.end(), nullptr, 10);
+		string stagingName;
+		int token = 0;
+		if (!name.empty() && fileLength >= 0 && fileLength <= freeSpace("."))
+			token = _group.beginUpload(name.str(), fileLength, _timeOut, stagingName);
+		if (token != 0 && !prepareFile(stagingName, fileLength))
+		{
+			_group.cancelUpload(token);
+			token = 0;
+		}
+		if (token == 0)
+			return _session->sendMessage("fail to upload the file\n");
+		string reply = "pupload " + toString(token);
+		return _session->sendMessage(reply);
+	}
+
+	bool receiveRange(string& message)
+	{//one stream of the parallel upload: "upload_range <token> <begin> <end>", the range of whole chunks
+	 //(see Connection::RangeAlignment) is written in place; the command is repeated when the range is taken
+		char* end = nullptr;
+		int token = (int)strtol(message.c_str(), &end, 10);
+		long long begin = strtoll(end, &end, 10);
+		long long last = strtoll(end, nullptr, 10);
+		string stagingName;
+		if (!_group.beginRange(token, _session->clientId(), begin, last, stagingName))
+			return _session->sendMessage("fail to upload the file\n");
+		string reply = "upload_range " + toString(token) + " " + toString(begin) + " " + toString(last);
+		_session->sendMessage(reply);
+		return startUpload(stagingName, begin, last - begin);
+	}
+
+	bool rangeUploaded(Session* session, bool result)
+	{//the end of the parallel upload's range, false if it's the usual upload
+		string stagingName, fileName;
+		WorkerGroup::RangeEnd end = _group.endRange(session->clientId(), result, stagingName, fileName);
+		if (end == WorkerGroup::RangeEnd::None)
+			return false;
+		if (end == WorkerGroup::RangeEnd::File && !replaceFile(stagingName, fileName))
+			end = WorkerGroup::RangeEnd::Failed;
+		if (end == WorkerGroup::RangeEnd::Range)
+			session->sendMessage("range uploaded\n");
+		else
+			end == WorkerGroup::RangeEnd::File ? session->sendMessage("file uploaded\n") : session->sendMessage("fail to upload the file\n");
+		return true;
+	}
+
+	bool startUpload(string& fileName, long long rangeBegin, long long rangeLength, bool journaled = true)
+	{
+		unique_ptr<FileWorker> fileWorker(new FileWorker(_session->socket(), _bufLen, _timeOut));
+		fileWorker->useProtocol(_session->protocolVersion());
+		fileWorker->useAutotune(_session->autotune());
+		fileWorker->usePipeline(FileWorker::PipelineDepth);
+		//the ranges of the parallel upload are not restored (the staging file is forgotten with the group)
+		if (rangeLength >= 0)
+			fileWorker->useRange(rangeBegin, rangeLength);
+		else if (journaled)
+			fileWorker->useJournal(&_group.journal(), _session->clientId());
+		fileWorker->beginReceive(fileName);
+		fileWorker->useRing(&_ring, _session);
+		_group.beginTransfer(_session->clientId(), this);
+		_session->startTransfer(std::move(fileWorker), TransferKind::Upload);
+		return true;
+	}
+
+	bool syncFile(string& message)
+	{//delta upload, "dsync <file>": the signature of the server's copy is downloaded (as "download" does),
+	 //the client uploads the delta against it by "dupload" (see DeltaSync and Connection::sendFileDelta()).
+	 //The file is read by the disk tasks' thread, the session waits for the signature
+		string fileName = getFileName(message);
+		if (fileName.empty())
+			return sendFile(message);
+		Server* worker = this;
+		Session* session = _session;
+		int clientId = session->clientId();
+		string signatureName = fileName + "." + toString(clientId) + ".sig";
+		bool queued = _diskTasks.post([worker, session, clientId, fileName, signatureName]()
+		{
+			bool made = DeltaSync::signature(fileName, signatureName);
+			worker->_eventLoop.post([worker, session, clientId, fileName, signatureName, made]()
+			{
+				worker->signatureMade(session, clientId, fileName, signatureName, made);
+			});
+		});
+		if (!queued)
+			return session->sendMessage("fail to download the file\n");
+		session->suspend();
+		return true;
+	}
+
+	void signatureMade(Session* session, int clientId, const string& fileName, string signatureName, bool made)
 	{
-		//get client address
-		char arg;
-		_udpServerSocket->receive<char>(arg);
+		if (!made)
+			std::remove(signatureName.c_str());
+		auto it = _sessions.find(session);
+		if (it == _sessions.end() || session->closed() || session->clientId() != clientId)
+		{
+			std::remove(signatureName.c_str());
+			return;
+		}
+		session->proceed();
+		//the signature which has not been made fails as the missing file
+		_group.beginDelta(clientId, fileName, signatureName, WorkerGroup::DeltaStage::Signature, _timeOut);
+		_session = session;
+		startDownload(signatureName, 0, -1, false);
+		_session = nullptr;
+	}
 
-		bool retVal = Connection::sendFile(_udpServerSocket.get(), message, std::bind(&Server::tryToReconnectUdp, this, std::placeholders::_1));
+	bool receiveDelta(string& message)
+	{//"dupload <file>": the delta is uploaded (as "upload" does) and applied to the file by the disk tasks,
+	 //the file is replaced when it's the client's one (see patchFile())
+		string fileName = getFileName(message);
+		if (fileName.empty())
+			return receiveFile(message);
+		string deltaName = fileName + "." + toString(_session->clientId()) + ".delta";
+		_group.beginDelta(_session->clientId(), fileName, deltaName, WorkerGroup::DeltaStage::Delta, _timeOut);
+		//the delta is forgotten with the group, so it's not restored after the restart
+		return startUpload(deltaName, 0, -1, false);
+	}
+
+	void patchFile(Session* session, const string& fileName, const string& deltaName, bool result)
+	{
+		if (!result)
+		{
+			std::remove(deltaName.c_str());
+			session->sendMessage("fail to upload the file\n");
+			return;
+		}
+		Server* worker = this;
+		int clientId = session->clientId();
+		bool queued = _diskTasks.post([worker, session, clientId, fileName, deltaName]()
+		{
+			string stagingName = fileName + "." + toString(clientId) + ".part";
+			bool patched = DeltaSync::patch(fileName, deltaName, stagingName) && replaceFile(stagingName, fileName);
+			if (!patched)
+				std::remove(stagingName.c_str());
+			std::remove(deltaName.c_str());
+			worker->_eventLoop.post([worker, session, clientId, patched]() { worker->filePatched(session, clientId, patched); });
+		});
+		if (!queued)
+		{
+			std::remove(deltaName.c_str());
+			session->sendMessage("fail to upload the file\n");
+			return;
+		}
+		session->suspend();
+	}
 
-		_contactSocket->receiveAck();
+	void filePatched(Session* session, int clientId, bool patched)
+	{
+		auto it = _sessions.find(session);
+		if (it == _sessions.end() || session->closed() || session->clientId() != clientId)
+			return;
+		session->proceed();
+		patched ? session->sendMessage("file uploaded\n") : session->sendMessage("fail to upload the file\n");
+	}
 
-		retVal ? _contactSocket->sendMessage("file downloaded\n") : _contactSocket->sendMessage("fail to download the file\n");
-		return retVal;
+	bool sendFileUdp(string& message)
+	{
+		requestUdpTransfer(TransferKind::Download, message);
+		return true;
 	}
 
 	bool receiveFileUdp(string& message)
 	{
-		//get client address
-		char arg;
-		_udpServerSocket->receive<char>(arg);
+		requestUdpTransfer(TransferKind::Upload, message);
+		return true;
+	}
 
-		bool retVal = Connection::receiveFile(_udpServerSocket.get(), message, std::bind(&Server::tryToReconnectUdp, this, std::placeholders::_1));
-		retVal ? _contactSocket->sendMessage("file uploaded\n") : _contactSocket->sendMessage("fail to upload the file\n");
-		return retVal;
+	void requestUdpTransfer(TransferKind kind, string& message)
+	{
+		int serial = ++_udpSerial;
+		UdpRequest& request = _udpRequests[serial];
+		request.session = _session;
+		request.kind = kind;
+		request.fileName = getFileName(message);
+		request.deadline = std::time(NULL) + _timeOut;
+		_session->suspend();
+
+		//get client address (it may have come to the other worker)
+		sockaddr_storage address;
+		vector<string> early;
+		if (!_group.requestUdpPeer(this, serial, _session->socket()->IP(), request.deadline, address, early))
+			return;
+		_group.setUdpRoute(peerKey(address), this);
+		startUdpTransfer(serial, address, early);
 	}
 
-	void registerNewClient(int clientId)
+	void receiveDatagrams()
 	{
-		if (_clients.size() == 2)
-			_clients.pop();
-		_clients.push(clientId);
+		if (_datagrams->available())
+		{
+			unsigned count = 0;
+			while ((count = _datagrams->receive()) > 0)
+				for (unsigned i = 0; i < count; i++)
+				{
+					const DatagramBatch::Datagram& datagram = _datagrams->received(i);
+					dispatchDatagram(*datagram.address, datagram.data, datagram.length);
+				}
+			return;
+		}
+		int bytesRead = 0;
+		while ((bytesRead = _udpServerSocket->receive(_datagram.data(), (int)_datagram.size())) != SOCKET_ERROR)
+			dispatchDatagram(_udpServerSocket->peerAddress(), _datagram.data(), bytesRead);
 	}
-	bool acceptNewClient()
+
+	void dispatchDatagram(const sockaddr_storage& address, const char* data, int length)
 	{
-		_contactSocket.reset(_serverSocket->accept());
-	  
-		bool result = _contactSocket->handle() != INVALID_SOCKET;
-		if (result)
+		string key = peerKey(address);
+		auto it = _udpTransfers.find(key);
+		if (it != _udpTransfers.end())
 		{
-			int clientId;
-			_contactSocket->receive(clientId);
-			registerNewClient(clientId);
+			UdpTransfer* udpTransfer = it->second->udpTransfer();
+			if (udpTransfer != nullptr && !udpTransfer->finished())
+			{
+				udpTransfer->onDatagram(data, length);
+				return;
+			}
+			_udpTransfers.erase(it);
+			_group.removeUdpRoute(key, this);
+		}
+		//the kernel has chosen the other worker's socket for this client
+		Server* worker = _group.udpRoute(key);
+		if (worker != nullptr && worker != this)
+		{
+			forwardDatagram(worker, address, data, length);
+			return;
 		}
-		return result;
+		//the client's transfer has begun before its command has been handled
+		if (_group.holdUdpDatagram(key, data, length))
+			return;
+		//client id from the new address
+		if (length == sizeof(int) && resumeUdpTransfer(key, address, data, length))
+			return;
+		//the client announces its address by one byte,
+		//late datagrams of the finished transfer must not take the next command of the host
+		if (length == sizeof(char))
+			receiveUdpPeer(address);
 	}
 
-	Socket* tryToReconnect(int timeOut)
-	{    
-	 
-		if (!_serverSocket->makeUnblocked())
-			return nullptr;
-		//fcntl(_serverSocket->handle(),F_SETFL,O_NONBLOCK);
-		if (!_serverSocket->select(Socket::Selection::ReadCheck ,timeOut))
-		{	
-			_serverSocket->makeBlocked();
-			return nullptr ;
+	static void forwardDatagram(Server* worker, const sockaddr_storage& address, const char* data, int length)
+	{
+		string datagram(data, length);
+		worker->_eventLoop.post([worker, address, datagram]()
+		{
+			worker->dispatchDatagram(address, datagram.data(), (int)datagram.size());
+		});
+	}
+
+	bool resumeUdpTransfer(const string& key, const sockaddr_storage& address, const char* data, int length)
+	{
+		int clientId = 0;
+		memcpy(&clientId, data, sizeof(int));
+
+		Server* worker = _group.udpClient(clientId);
+		if (worker == nullptr)
+			return false;
+		if (worker != this)
+		{
+			_group.setUdpRoute(key, worker);
+			forwardDatagram(worker, address, data, length);
+			return true;
 		}
 
-		if (!_serverSocket->makeBlocked())
-			return nullptr;
+		for (auto& item : _sessions)
+		{
+			UdpTransfer* udpTransfer = item.first->udpTransfer();
+			if (udpTransfer == nullptr || !udpTransfer->reconnecting() || udpTransfer->clientId() != clientId)
+				continue;
+			forgetUdpTransfers(item.first);
+			_udpTransfers[key] = item.first;
+			_group.setUdpRoute(key, this);
+			MetricsShard& metrics = Metrics::local();
+			metrics.count(metrics.reconnects);
+			udpTransfer->reconnected(address, data, length);
+			return true;
+		}
+		return false;
+	}
 
-		acceptNewClient();
-	
-		if (_clients.front() == _clients.back())
-			return _contactSocket.get();
-	
-		return nullptr;
+	void receiveUdpPeer(const sockaddr_storage& address)
+	{//the command may have been received by the other worker
+		Server* worker = nullptr;
+		int serial = 0;
+		if (!_group.takeUdpRequest(address, hostOf(address), peerKey(address), std::time(NULL) + _timeOut, worker, serial))
+			return;
+		if (worker == this)
+			startUdpTransfer(serial, address);
+		else
+			worker->_eventLoop.post([worker, serial, address]() { worker->startUdpTransfer(serial, address); });
 	}
 
-	Socket* tryToReconnectUdp(int timeOut)
+	void startUdpTransfer(int serial, const sockaddr_storage& address, const vector<string>& early = vector<string>())
 	{
-		_udpServerSocket->setReceiveTimeOut(timeOut);
-		//wait for client id (and client address)
-		int clientId = 0;
-		_udpServerSocket->receive<int>(clientId);
-		_udpServerSocket->send(clientId);
+		auto it = _udpRequests.find(serial);
+		if (it == _udpRequests.end())
+		{//session has been closed
+			_group.removeUdpRoute(peerKey(address), this);
+			return;
+		}
+		UdpRequest request = it->second;
+		_udpRequests.erase(it);
 
-		registerNewClient(clientId);
+		Session* session = request.session;
+		unique_ptr<UDP_PeerSocket> udpSocket(new UDP_PeerSocket(_udpServerSocket->handle(), address));
 
-		_udpServerSocket->disableReceiveTimeOut();
+		unique_ptr<FileWorker> fileWorker(new FileWorker(udpSocket.get(), _bufLen, _timeOut));
+		fileWorker->useProtocol(session->protocolVersion());
+		fileWorker->useBatch(_datagrams.get());
+		if (request.kind == TransferKind::Download)
+		{
+			fileWorker->useCache(&_group.fileCache());
+			fileWorker->beginSend(request.fileName);
+		}
+		else
+			fileWorker->beginReceive(request.fileName);
+
+		forgetUdpTransfers(session);
+		_udpTransfers[peerKey(address)] = session;
+		_group.setUdpRoute(peerKey(address), this);
+		_group.setUdpClient(session->clientId(), this);
+		UDP_PeerSocket* socket = udpSocket.release();
+		session->startUdpTransfer(new UdpTransfer(_eventLoop, *session, session->clientId(), socket, fileWorker.release(), _timeOut), request.kind);
+		//the datagrams which have come before the command
+		for (const string& datagram : early)
+			session->udpTransfer()->onDatagram(datagram.data(), (int)datagram.size());
+	}
 
-		//check if old client
-		if (_clients.front() == _clients.back())
-			return _udpServerSocket.get();
+	void forgetUdpTransfers(Session* session)
+	{
+		for (auto it = _udpTransfers.begin(); it != _udpTransfers.end();)
+			if (it->second == session)
+			{
+				_group.removeUdpRoute(it->first, this);
+				it = _udpTransfers.erase(it);
+			}
+			else
+				++it;
+	}
+
+	static string peerKey(const sockaddr_storage& address)
+	{//port and IP of the datagram sender
+		if (address.ss_family == AF_INET6)
+		{
+			const sockaddr_in6& addr = (const sockaddr_in6&)address;
+			return string((const char*)&addr.sin6_port, sizeof(addr.sin6_port)) + string((const char*)&addr.sin6_addr, sizeof(addr.sin6_addr));
+		}
+		const sockaddr_in& addr = (const sockaddr_in&)address;
+		return string((const char*)&addr.sin_port, sizeof(addr.sin_port)) + string((const char*)&addr.sin_addr, sizeof(addr.sin_addr));
+	}
+
+	void refuseUdpTransfer(Session* session, TransferKind kind)
+	{
+		session->proceed();
+		kind == TransferKind::Download ? session->sendMessage("fail to download the file\n") : session->sendMessage("fail to upload the file\n");
+	}
 
-		return nullptr;
+	static string hostOf(const sockaddr_storage& address)
+	{
+		sockaddr_in addr;
+		memcpy(&addr, &address, sizeof(addr));
+		return InetAddress(addr).IP;
+	}
+
+	void acceptNewClients()
+	{
+		while (true)
+		{
+			unique_ptr<Socket> contactSocket(_serverSocket->accept());
+			if (!contactSocket->isValid())
+				break;
+			//the client sends its id first
+			Session* session = new Session(contactSocket.release(), _eventLoop, *this);
+			_sessions[session].reset(session);
+			_stats.accepted++;
+			MetricsShard& metrics = Metrics::local();
+			metrics.count(metrics.accepted);
+			_stats.sessions++;
+		}
+	}
+
+	void removeClosedSessions()
+	{
+		for (Session* session : _closedSessions)
+			_sessions.erase(session);
+		_stats.sessions -= _closedSessions.size();
+		_closedSessions.clear();
+	}
+
+	void checkRetransmissions()
+	{
+		if (_udpTransfers.empty()) return;
+		//finished transfers leave the map
+		vector<Session*> sessions;
+		for (auto& item : _udpTransfers)
+			sessions.push_back(item.second);
+		for (Session* session : sessions)
+			if (session->udpTransfer() != nullptr)
+				session->udpTransfer()->checkRetransmission();
+	}
+
+	void checkTimeouts()
+	{
+		time_t now = std::time(NULL);
+		if (now == _lastTimeoutsCheck) return;
+		_lastTimeoutsCheck = now;
+
+		for (auto& item : _sessions)
+			item.second->checkTimeouts(now);
+
+		_group.checkTimeouts(now);
+
+		for (auto it = _udpRequests.begin(); it != _udpRequests.end();)
+			if (now >= it->second.deadline)
+			{//client address has not been received
+				_group.cancelUdpRequest(this, it->first);
+				refuseUdpTransfer(it->second.session, it->second.kind);
+				it = _udpRequests.erase(it);
+			}
+			else
+				++it;
 	}
 
 	//-----------------------------------(),  ------------------------------//
 
-	
+
 	bool echo(string& message)
 	{
-		cutSuitableSubstring(message, "( )+");
-		return _contactSocket->sendMessage(message);
+		string text = CommandParser::afterSpaces(message).str();
+		return _session->sendMessage(text);
 	}
-	
+
 	bool quit(string& message)
 	{
-		 //bool result = _contactSocket->shutDown();
-		//_contactSocket->closeSocket();
-		_contactSocket.reset();
+		_session->finish();
 		return true;
 	}
 	bool time(string& message)
 	{
 		time_t curTime;
 		curTime = std::time(NULL);
-		return _contactSocket->sendMessage(std::ctime(&curTime));
+		return _session->sendMessage(std::ctime(&curTime));
+	}
+
+	bool version(string& message)
+	{//protocol version of the client -> the one both sides speak
+	 //(old clients don't ask and get version 1)
+		int clientVersion = atoi(message.c_str());
+		int version = (clientVersion < ProtocolVersion) ? std::max(clientVersion, 1) : ProtocolVersion;
+		_session->setProtocolVersion(version);
+		string reply = "version " + toString(version);
+		return _session->sendMessage(reply);
+	}
+
+	bool progress(string& message)
+	{//progress frames of the downloads (framed protocol): "progress <milliseconds> [<bytes>]",
+	 //0 - not by the time (bytes); none by default
+		char* end = nullptr;
+		long interval = strtol(message.c_str(), &end, 10);
+		long long bytes = strtoll(end, nullptr, 10);
+		interval = std::max(interval, 0L);
+		bytes = std::max(bytes, 0LL);
+		_session->setProgress((int)std::min<long>(interval, std::numeric_limits<int>::max()), bytes);
+		string reply = "progress " + toString(_session->progressInterval()) + " " + toString(_session->progressBytes());
+		return _session->sendMessage(reply);
+	}
+
+	bool compress(string& message)
+	{//compressed frames of the downloads: "compress lz" or "compress none" (by default), the reply tells
+	 //the codec in use - none unless the protocol has the compressed frames (see "version");
+	 //the uploads are compressed by the client as it decides
+		string codec;
+		istringstream(message) >> codec;
+		_session->setCompression(codec == "lz" && _session->protocolVersion() >= FileWorker::CompressedFramesVersion);
+		string reply = string("compress ") + (_session->compression() ? "lz" : "none");
+		return _session->sendMessage(reply);
+	}
+
+	bool autotune(string& message)
+	{//"autotune on" or "autotune off" (by default): the chunk of the downloads follows the bandwidth-delay
+	 //product (framed protocol, see "version"), the reply tells whether the transfers are tuned
+		string mode;
+		istringstream(message) >> mode;
+		_session->setAutotune(mode == "on" && _session->protocolVersion() >= FileWorker::ProgressFramesVersion);
+		string reply = string("autotune ") + (_session->autotune() ? "on" : "off");
+		return _session->sendMessage(reply);
+	}
+
+	bool workers(string& message)
+	{//how the clients are spread among the worker threads
+		string report = _group.statsReport();
+		return _session->sendMessage(report);
+	}
+
+	bool cache(string& message)
+	{//hits and misses of the downloaded files cache
+		string report = _group.fileCache().report();
+		return _session->sendMessage(report);
+	}
+
+	bool stats(string& message)
+	{//counters and latencies of the process (see Metrics), the same as the metrics port serves
+		string report = Metrics::global().report();
+		return _session->sendMessage(report);
+	}
+
+	bool trace(string& message)
+	{//"trace [<file>]": the spans of the threads go to the file (trace.json by default) as the trace-event
+	 //JSON for chrome://tracing or Perfetto (see Trace.h)
+#if defined(TRACING)
+		string fileName = getFileName(message);
+		if (fileName.empty())
+			fileName = "trace.json";
+		std::ofstream file(fileName, ios::out | ios::trunc);
+		size_t spans = Tracer::global().dump(file);
+		file.close();
+		string reply = file ? "trace " + toString(spans) + " spans in " + fileName : string("fail to write the trace");
+#else
+		string reply = "trace is not compiled in (TRACING)";
+#endif
+		return _session->sendMessage(reply);
 	}
 
 	void fillCommandMap() override
 	{
-		
-		_commandMap[string("echo")] = std::bind(&Server::echo, this, std::placeholders::_1);
-		_commandMap[string("time")] = std::bind(&Server::time, this, std::placeholders::_1);
-		_commandMap[string("quit")] = std::bind(&Server::quit, this, std::placeholders::_1);
-		
-		_commandMap[string("download")] = std::bind(&Server::sendFile, this, std::placeholders::_1);
-		_commandMap[string("upload")] = std::bind(&Server::receiveFile, this, std::placeholders::_1);
-		_commandMap[string("download_udp")] = std::bind(&Server::sendFileUdp, this, std::placeholders::_1);
-		_commandMap[string("upload_udp")] = std::bind(&Server::receiveFileUdp, this, std::placeholders::_1);
+
+		_commandTable.add<Server, &Server::echo>("echo");
+		_commandTable.add<Server, &Server::time>("time");
+		_commandTable.add<Server, &Server::quit>("quit");
+		_commandTable.add<Server, &Server::workers>("workers");
+		_commandTable.add<Server, &Server::cache>("cache");
+		_commandTable.add<Server, &Server::stats>("stats");
+		_commandTable.add<Server, &Server::trace>("trace");
+		_commandTable.add<Server, &Server::version>("version");
+		_commandTable.add<Server, &Server::progress>("progress");
+		_commandTable.add<Server, &Server::compress>("compress");
+		_commandTable.add<Server, &Server::autotune>("autotune");
+
+		_commandTable.add<Server, &Server::sendFile>("download");
+		_commandTable.add<Server, &Server::sendFileParallel>("pdownload");
+		_commandTable.add<Server, &Server::sendRange>("range");
+		_commandTable.add<Server, &Server::receiveFile>("upload");
+		_commandTable.add<Server, &Server::receiveFileParallel>("pupload");
+		_commandTable.add<Server, &Server::receiveRange>("upload_range");
+		_commandTable.add<Server, &Server::syncFile>("dsync");
+		_commandTable.add<Server, &Server::receiveDelta>("dupload");
+		_commandTable.add<Server, &Server::sendFileUdp>("download_udp");
+		_commandTable.add<Server, &Server::receiveFileUdp>("upload_udp");
 	}
 
 
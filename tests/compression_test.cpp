@@ -0,0 +1,157 @@
+//LZ blocks of the compressed frames: random, repetitive and incompressible buffers come back as they were,
+//the blocks which are truncated, overlong or foreign (the peer's data) are refused without reading
+//or writing past the buffers
+//
+//compression_test
+
+#include "../Includes.h"
+#include "../Compression.h"
+
+static size_t bound(size_t length)
+{//the block of the data which doesn't compress at all
+	return length + length / 255 + 16;
+}
+
+static bool check(bool condition, const string& what, int& failed)
+{
+	if (!condition)
+	{
+		cerr << what << endl;
+		failed++;
+	}
+	return condition;
+}
+
+static int roundTrip(const string& name, const vector<char>& data, size_t maxLength)
+{//the block (not longer than maxLength) is decoded into the buffer of the exact length only,
+ //the strict prefixes and the longer blocks are refused
+	int failed = 0;
+	//the buffers are not empty (no null pointers for the empty data)
+	vector<char> source(data);
+	source.push_back(0);
+	vector<char> block(bound(data.size()));
+	size_t length = LzCodec::compress(source.data(), data.size(), block.data(), block.size());
+	if (!check(length > 0, name + ": not compressed", failed))
+		return failed;
+	check(length <= maxLength, name + ": " + toString((long long)length) + " of " + toString((long long)data.size()), failed);
+	block.resize(length);
+
+	vector<char> raw(data.size() + 1);
+	if (check(LzCodec::decompress(block.data(), length, raw.data(), data.size()), name + ": not decompressed", failed))
+		check(std::equal(data.begin(), data.end(), raw.begin()), name + ": wrong data", failed);
+	if (!data.empty())
+		check(!LzCodec::decompress(block.data(), length, raw.data(), data.size() - 1), name + ": shorter raw length", failed);
+	check(!LzCodec::decompress(block.data(), length, raw.data(), data.size() + 1), name + ": longer raw length", failed);
+
+	//truncated: every prefix of the small blocks, some of the large ones
+	size_t step = std::max<size_t>(1, length / 512);
+	for (size_t prefix = 0; prefix < length; prefix += step)
+		if (!check(!LzCodec::decompress(block.data(), prefix, raw.data(), data.size()), name + ": truncated to " + toString((long long)prefix), failed))
+			break;
+	//overlong: the bytes after the last sequence
+	for (unsigned char extra : { 0x00, 0x10, 0xF0, 0xFF })
+	{
+		vector<char> overlong = block;
+		overlong.insert(overlong.end(), 3, (char)extra);
+		check(!LzCodec::decompress(overlong.data(), overlong.size(), raw.data(), data.size()), name + ": overlong block", failed);
+	}
+	return failed;
+}
+
+static int malformedTest()
+{//blocks made by hand: the lengths and the offsets point out of the buffers
+	int failed = 0;
+	char raw[64];
+	unsigned char none = 0;
+	struct Case { const char* name; vector<unsigned char> block; size_t rawLength; };
+	vector<Case> cases = {
+		{ "empty block", {}, 0 },
+		{ "literals past the block", { 0x50, 'a', 'b' }, 5 },
+		{ "literals past the raw length", { 0x30, 'a', 'b', 'c' }, 2 },
+		{ "literal length past the block", { 0xF0, 0xFF, 0xFF }, 64 },
+		{ "offset cut", { 0x10, 'a', 0x01 }, 5 },
+		{ "zero offset", { 0x10, 'a', 0x00, 0x00, 0x00 }, 5 },
+		{ "offset before the data", { 0x10, 'a', 0x02, 0x00, 0x00 }, 5 },
+		{ "match past the raw length", { 0x1F, 'a', 0x01, 0x00, 0x40, 0x00 }, 64 },
+		{ "match length past the block", { 0x1F, 'a', 0x01, 0x00, 0xFF }, 64 },
+		{ "no last literals", { 0x10, 'a', 0x01, 0x00 }, 5 },
+	};
+	for (Case& item : cases)
+		check(!LzCodec::decompress((const char*)(item.block.empty() ? &none : item.block.data()), item.block.size(), raw, item.rawLength),
+			item.name, failed);
+
+	//the valid hand-made block: "a" and the match of 4 overlapping it, then the literal
+	vector<unsigned char> block = { 0x10, 'a', 0x01, 0x00, 0x10, 'b' };
+	if (check(LzCodec::decompress((const char*)block.data(), block.size(), raw, 6), "overlapping match", failed))
+		check(memcmp(raw, "aaaaab", 6) == 0, "overlapping match: wrong data", failed);
+	return failed;
+}
+
+static int garbageTest(std::mt19937& random)
+{//the foreign data is refused (or decoded within the buffer): the bytes after the raw length are not touched
+	const char Canary = 0x5a;
+	int failed = 0;
+	vector<char> block(256), raw(1024);
+	for (int i = 0; i < 20000 && failed == 0; i++)
+	{
+		size_t length = random() % block.size();
+		for (size_t j = 0; j < length; j++)
+			block[j] = (char)random();
+		size_t rawLength = random() % (raw.size() / 2);
+		std::fill(raw.begin(), raw.end(), Canary);
+		LzCodec::decompress(block.data(), length, raw.data(), rawLength);
+		check(std::count(raw.begin() + rawLength, raw.end(), Canary) == (long)(raw.size() - rawLength),
+			"foreign block is written past the raw length", failed);
+	}
+	return failed;
+}
+
+int main()
+{
+	std::mt19937 random(2024);
+	int failed = 0;
+	try
+	{
+		vector<char> empty;
+		failed += roundTrip("empty", empty, bound(0));
+		for (size_t length : { (size_t)1, (size_t)5, (size_t)12, (size_t)13, (size_t)100, (size_t)70000, (size_t)1024 * 1024 })
+		{
+			vector<char> incompressible(length);
+			for (char& c : incompressible)
+				c = (char)random();
+			failed += roundTrip("random " + toString((long long)length), incompressible, bound(length));
+
+			vector<char> same(length, 'x');
+			failed += roundTrip("repeated byte " + toString((long long)length), same, (length >= 1000) ? length / 16 : bound(length));
+
+			//the words of the text and the CSV, the matches are far apart in the large ones
+			vector<char> text;
+			const char* words[] = { "id,", "name,", "12345,", "\n", "transfer ", "file ", "server " };
+			while (text.size() < length)
+			{
+				const char* word = words[random() % 7];
+				text.insert(text.end(), word, word + strlen(word));
+			}
+			text.resize(length);
+			failed += roundTrip("text " + toString((long long)length), text, (length >= 100) ? length * 3 / 4 : bound(length));
+		}
+
+		//the incompressible data doesn't fit the block smaller than itself
+		vector<char> incompressible(4096), block(4095);
+		for (char& c : incompressible)
+			c = (char)random();
+		check(LzCodec::compress(incompressible.data(), incompressible.size(), block.data(), block.size()) == 0,
+			"incompressible data fits the smaller block", failed);
+
+		failed += malformedTest();
+		failed += garbageTest(random);
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << endl;
+		failed++;
+	}
+
+	cerr << (failed == 0 ? "ok" : "failed") << endl;
+	return failed == 0 ? 0 : 1;
+}
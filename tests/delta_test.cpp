@@ -0,0 +1,142 @@
+//rsync-like delta: signature of the basis -> delta of the new file -> the file patched from the basis,
+//for the inserts, the deletes, the truncated and the appended file; the basis changed after its signature
+//and the truncated delta make the patch fail
+//
+//delta_test
+
+#include "../Includes.h"
+#include "../DeltaSync.h"
+
+static const char* BasisName = "deltabasis.bin";
+static const char* FileName = "deltafile.bin";
+static const char* SignatureName = "deltasig.bin";
+static const char* DeltaName = "delta.bin";
+static const char* OutputName = "deltaout.bin";
+
+static void writeFile(const string& fileName, const vector<char>& data)
+{
+	std::ofstream file(fileName, ios::out | ios::trunc | ios::binary);
+	file.write(data.data(), data.size());
+}
+
+static vector<char> readFile(const string& fileName)
+{
+	std::ifstream file(fileName, ios::in | ios::binary);
+	return vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static vector<char> randomBytes(std::mt19937& random, size_t length)
+{
+	vector<char> data(length);
+	for (char& c : data)
+		c = (char)random();
+	return data;
+}
+
+static bool check(bool condition, const string& what, int& failed)
+{
+	if (!condition)
+	{
+		cerr << what << endl;
+		failed++;
+	}
+	return condition;
+}
+
+static int roundTrip(const string& name, const vector<char>& basis, const vector<char>& file, long long maxLiteral)
+{//the patched file is the new one, at most maxLiteral bytes of it are sent as they are
+	int failed = 0;
+	writeFile(BasisName, basis);
+	writeFile(FileName, file);
+	long long literal = -1;
+	if (!check(DeltaSync::signature(BasisName, SignatureName) && DeltaSync::encode(SignatureName, FileName, DeltaName, &literal),
+		name + ": no delta", failed))
+		return failed;
+	check(literal >= 0 && literal <= maxLiteral, name + ": " + toString(literal) + " literal bytes", failed);
+	if (check(DeltaSync::patch(BasisName, DeltaName, OutputName), name + ": not patched", failed))
+		check(readFile(OutputName) == file, name + ": wrong file", failed);
+	return failed;
+}
+
+static int changedBasisTest(const vector<char>& basis, const vector<char>& file)
+{//the delta refers to the blocks the basis doesn't have any more
+	int failed = 0;
+	writeFile(BasisName, basis);
+	writeFile(FileName, file);
+	if (!check(DeltaSync::signature(BasisName, SignatureName) && DeltaSync::encode(SignatureName, FileName, DeltaName),
+		"changed basis: no delta", failed))
+		return failed;
+
+	vector<char> changed = basis;
+	//the block the delta refers to (not the one of the insert)
+	changed[changed.size() / 4] ^= 0x5a;
+	writeFile(BasisName, changed);
+	check(!DeltaSync::patch(BasisName, DeltaName, OutputName), "changed basis: patched", failed);
+
+	vector<char> shorter(basis.begin(), basis.begin() + basis.size() / 2);
+	writeFile(BasisName, shorter);
+	check(!DeltaSync::patch(BasisName, DeltaName, OutputName), "truncated basis: patched", failed);
+
+	std::remove(BasisName);
+	check(!DeltaSync::patch(BasisName, DeltaName, OutputName), "no basis: patched", failed);
+
+	//the delta itself is cut
+	writeFile(BasisName, basis);
+	vector<char> delta = readFile(DeltaName);
+	delta.resize(delta.size() - 1);
+	writeFile(DeltaName, delta);
+	check(!DeltaSync::patch(BasisName, DeltaName, OutputName), "truncated delta: patched", failed);
+	return failed;
+}
+
+int main()
+{
+	std::mt19937 random(2024);
+	int failed = 0;
+	try
+	{
+		//not a multiple of the block size: the short last block is matched too
+		vector<char> basis = randomBytes(random, 5 * 1024 * 1024 + 777);
+		long long block = DeltaSync::blockSize((long long)basis.size());
+
+		failed += roundTrip("same file", basis, basis, 0);
+
+		vector<char> inserted = basis;
+		for (size_t at : { (size_t)0, basis.size() / 3, basis.size() / 2 + 5, basis.size() })
+		{
+			vector<char> bytes = randomBytes(random, 1000);
+			inserted.insert(inserted.begin() + at + (inserted.size() - basis.size()), bytes.begin(), bytes.end());
+		}
+		failed += roundTrip("inserts", basis, inserted, 4 * (1000 + block));
+
+		vector<char> deleted = basis;
+		deleted.erase(deleted.begin() + 4 * 1024 * 1024, deleted.begin() + 4 * 1024 * 1024 + 5000);
+		deleted.erase(deleted.begin() + 1000, deleted.begin() + 1100);
+		deleted.erase(deleted.begin(), deleted.begin() + 10);
+		failed += roundTrip("deletes", basis, deleted, 3 * block);
+
+		vector<char> truncated(basis.begin(), basis.begin() + basis.size() / 2 + 123);
+		failed += roundTrip("truncated file", basis, truncated, block);
+
+		vector<char> appended = basis;
+		vector<char> tail = randomBytes(random, 3000);
+		appended.insert(appended.end(), tail.begin(), tail.end());
+		failed += roundTrip("appended file", basis, appended, 3000 + block);
+
+		vector<char> empty;
+		failed += roundTrip("empty file", basis, empty, 0);
+		failed += roundTrip("empty basis", empty, inserted, (long long)inserted.size());
+
+		failed += changedBasisTest(basis, inserted);
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << endl;
+		failed++;
+	}
+
+	for (const char* name : { BasisName, FileName, SignatureName, DeltaName, OutputName })
+		std::remove(name);
+	cerr << (failed == 0 ? "ok" : "failed") << endl;
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+//crash recovery of the transfer journal: the journal of the previous run (with the torn last line) is read,
+//the offset records without their chunks are dropped, the durable offset is checked against the file
+//(the corrupted chunk and the ones after it are received again), the ended transfers are compacted away
+//
+//journal_test
+
+#include "../Includes.h"
+#include "../TransferJournal.h"
+
+static const char* JournalName = "journaltest.journal";
+static const char* UploadName = "journalupload.bin";
+static const long long UploadLength = 3 * TransferJournal::ChunkSize + TransferJournal::ChunkSize / 2;
+
+static char byteAt(long long offset)
+{
+	return (char)(offset * 7 + offset / 251);
+}
+
+static uint32_t chunkChecksum(const vector<char>& file, int chunk)
+{
+	long long begin = (long long)chunk * TransferJournal::ChunkSize;
+	int length = (int)std::min<long long>(TransferJournal::ChunkSize, (long long)file.size() - begin);
+	return Crc32c::compute(file.data() + begin, length);
+}
+
+static string hex(uint32_t value)
+{
+	ostringstream text;
+	text << std::hex << value;
+	return text.str();
+}
+
+static string beginRecord(int clientId, char direction)
+{
+	return "B " + toString(clientId) + " " + direction + " 4 1024 30 " + toString(UploadLength) + " 0 -1 " + UploadName + "\n";
+}
+
+static bool check(bool condition, const string& what, int& failed)
+{
+	if (!condition)
+	{
+		cerr << what << endl;
+		failed++;
+	}
+	return condition;
+}
+
+static int restoredTest(const vector<char>& file, long long durable)
+{//the journal of the previous run is read (and compacted): the transfers are restored as far as the file allows
+	int failed = 0;
+	TransferJournal journal(JournalName);
+	TransferJournal::Entry entry;
+	if (check(journal.take(11, entry), "upload 11 is not restored", failed))
+	{
+		check(entry.upload && entry.fileName == UploadName && entry.fileLength == UploadLength && entry.version == 4,
+			"upload 11: wrong hint data", failed);
+		check(entry.durable == durable, "upload 11: durable " + toString(entry.durable) + " instead of " + toString(durable), failed);
+		check(entry.checksums.size() == (size_t)(durable / TransferJournal::ChunkSize), "upload 11: wrong checksums number", failed);
+		for (size_t i = 0; i < entry.checksums.size(); i++)
+			check(entry.checksums[i] == chunkChecksum(file, (int)i), "upload 11: wrong checksum " + toString((int)i), failed);
+		check(!journal.take(11, entry), "upload 11 is restored twice", failed);
+	}
+	check(journal.take(12, entry) && !entry.upload, "download 12 is not restored", failed);
+	//its first chunk has been recorded, the offset goes past it
+	if (check(journal.take(13, entry), "upload 13 is not restored", failed))
+		check(entry.durable == 0 && entry.checksums.empty(), "upload 13: the chunks which are not recorded are kept", failed);
+	check(!journal.take(14, entry), "ended upload 14 is restored", failed);
+	check(!journal.take(15, entry), "malformed upload 15 is restored", failed);
+	return failed;
+}
+
+int main()
+{
+	const int ChunkSize = TransferJournal::ChunkSize;
+	vector<char> file((size_t)UploadLength);
+	for (long long i = 0; i < UploadLength; i++)
+		file[(size_t)i] = byteAt(i);
+
+	//three chunks are durable, the torn last line would have moved the offset to the end
+	string records = beginRecord(11, 'U') +
+		"O 11 " + toString(2 * ChunkSize) + " 0 " + hex(chunkChecksum(file, 0)) + " " + hex(chunkChecksum(file, 1)) + "\n" +
+		"O 11 " + toString(3 * ChunkSize) + " 2 " + hex(chunkChecksum(file, 2)) + "\n" +
+		beginRecord(12, 'D') +
+		beginRecord(13, 'U') +
+		"O 13 " + toString(2 * ChunkSize) + " 0 " + hex(chunkChecksum(file, 0)) + "\n" +
+		beginRecord(14, 'U') +
+		"E 14\n" +
+		//the malformed record is skipped
+		"B 15 U 4 1024 30 " + toString(UploadLength) + "\n" +
+		"O 11 " + toString(UploadLength) + " 3 " + hex(chunkChecksum(file, 3));
+	{
+		std::ofstream journal(JournalName, ios::out | ios::trunc | ios::binary);
+		journal << records;
+	}
+	//the second chunk has not reached the disk
+	file[(size_t)ChunkSize + 100] ^= 0x5a;
+	{
+		std::ofstream upload(UploadName, ios::out | ios::trunc | ios::binary);
+		upload.write(file.data(), file.size());
+	}
+
+	int failed = 0;
+	try
+	{
+		failed += restoredTest(file, ChunkSize);
+
+		//the journal has been compacted: the ended transfer and the malformed record are gone,
+		//the verified offset is kept for the next run
+		std::ifstream journal(JournalName, ios::in | ios::binary);
+		string line;
+		while (std::getline(journal, line))
+			check(line.compare(0, 4, "E 14") != 0 && line.compare(0, 4, "B 14") != 0 && line.compare(0, 4, "B 15") != 0,
+				"not compacted: " + line, failed);
+		journal.close();
+		failed += restoredTest(file, ChunkSize);
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << endl;
+		failed++;
+	}
+
+	std::remove(JournalName);
+	std::remove(UploadName);
+	cerr << (failed == 0 ? "ok" : "failed") << endl;
+	return failed == 0 ? 0 : 1;
+}
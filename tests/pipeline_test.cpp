@@ -0,0 +1,176 @@
+//disk stages of the buffered transfers driven by the event loop: the network stage never waits, it's refused
+//(Pending, no room) and the stage thread wakes the owner through the loop when it may go on
+//
+//pipeline_test
+
+#include "../Includes.h"
+#include "../Pipeline.h"
+
+static const char* SourceName = "pipelinesource.bin";
+static const long long SourceLength = 100000;
+static const int BlockSize = 4096;
+
+static char byteAt(long long offset)
+{
+	return (char)(offset * 7);
+}
+
+class Owner
+{//the transfer's owner in the loop: counts its wake-ups
+	EventLoop& _eventLoop;
+	CallbackHandler _handler;
+	std::shared_ptr<StageWakeUp> _wakeUp;
+	int _wakeUps;
+public:
+	explicit Owner(EventLoop& eventLoop) : _eventLoop(eventLoop), _wakeUp(std::make_shared<StageWakeUp>()), _wakeUps(0)
+	{
+		_handler.setCallback([this](int) { _wakeUps++; });
+		_wakeUp->attach(&_eventLoop, &_handler);
+	}
+
+	std::function<void()> ready()
+	{//as FileWorker gives it to the stages
+		std::shared_ptr<StageWakeUp> wakeUp = _wakeUp;
+		return [wakeUp]() { wakeUp->notify(); };
+	}
+
+	bool awaitWakeUp()
+	{//the loop runs until the stage wakes the owner (false - it doesn't in time)
+		int wakeUps = _wakeUps;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (_wakeUps == wakeUps && std::chrono::steady_clock::now() < deadline)
+			_eventLoop.runOnce(50);
+		return _wakeUps != wakeUps;
+	}
+};
+
+static int readAheadTest(EventLoop& eventLoop)
+{//the file is sent from the start, then from the middle (resumed transfer)
+	Owner owner(eventLoop);
+	ReadAhead readAhead(SourceName, 0, SourceLength, BlockSize, 4, owner.ready());
+	int failed = 0;
+	for (long long start : { 0LL, SourceLength / 2 })
+	{
+		long long offset = start;
+		while (true)
+		{
+			const char* data = nullptr;
+			int length = readAhead.acquire(offset, BlockSize, data, false);
+			if (length == ReadAhead::Pending)
+			{
+				if (!owner.awaitWakeUp())
+				{
+					cerr << "read ahead: no wake-up at " << offset << endl;
+					return failed + 1;
+				}
+				continue;
+			}
+			if (length <= 0)
+			{
+				if (length < 0 || offset != SourceLength)
+				{
+					cerr << "read ahead: " << length << " at " << offset << endl;
+					failed++;
+				}
+				break;
+			}
+			for (int i = 0; i < length; i++)
+				if (data[i] != byteAt(offset + i))
+				{
+					cerr << "read ahead: wrong byte at " << offset + i << endl;
+					return failed + 1;
+				}
+			readAhead.release(length);
+			offset += length;
+		}
+	}
+	return failed;
+}
+
+static int writeBehindTest(EventLoop& eventLoop)
+{//the disk is stopped: the receiver is refused the room and the drain, then woken up when the disk goes on
+	Owner owner(eventLoop);
+	vector<char> file;
+	std::mutex gateLock;
+	std::condition_variable gateOpened;
+	bool open = false;
+	std::function<bool(long long, const char*, int)> write = [&](long long offset, const char* data, int length)
+	{
+		std::unique_lock<std::mutex> lock(gateLock);
+		gateOpened.wait(lock, [&open]() { return open; });
+		if (file.size() < (size_t)(offset + length))
+			file.resize((size_t)(offset + length));
+		memcpy(file.data() + offset, data, length);
+		return true;
+	};
+
+	int failed = 0;
+	long long offset = 0;
+	{
+		WriteBehind writeBehind(write, 0, BlockSize, 2, owner.ready());
+		vector<char> chunk(BlockSize);
+		while (writeBehind.room(false) && offset < SourceLength)
+		{
+			int length = (int)std::min<long long>(BlockSize, SourceLength - offset);
+			for (int i = 0; i < length; i++)
+				chunk[i] = byteAt(offset + i);
+			writeBehind.write(offset, chunk.data(), length);
+			offset += length;
+		}
+		if (offset >= SourceLength || writeBehind.drain(false) != WriteBehind::Pending)
+		{
+			cerr << "write behind: the stopped disk has room" << endl;
+			failed++;
+		}
+		{
+			std::lock_guard<std::mutex> lock(gateLock);
+			open = true;
+			gateOpened.notify_all();
+		}
+		int drained = WriteBehind::Pending;
+		while ((drained = writeBehind.drain(false)) == WriteBehind::Pending)
+			if (!owner.awaitWakeUp())
+			{
+				cerr << "write behind: no wake-up" << endl;
+				return failed + 1;
+			}
+		if (drained != WriteBehind::Drained || writeBehind.written() != offset)
+		{
+			cerr << "write behind: " << drained << ", " << writeBehind.written() << " of " << offset << endl;
+			failed++;
+		}
+	}
+	for (long long i = 0; i < offset && failed == 0; i++)
+		if (i >= (long long)file.size() || file[(size_t)i] != byteAt(i))
+		{
+			cerr << "write behind: wrong byte at " << i << endl;
+			failed++;
+		}
+	return failed;
+}
+
+int main()
+{
+	{
+		std::ofstream file(SourceName, ios::out | ios::trunc | ios::binary);
+		for (long long i = 0; i < SourceLength; i++)
+			file.put(byteAt(i));
+	}
+
+	int failed = 0;
+	try
+	{
+		EventLoop eventLoop;
+		failed += readAheadTest(eventLoop);
+		failed += writeBehindTest(eventLoop);
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << endl;
+		failed++;
+	}
+
+	std::remove(SourceName);
+	cerr << (failed == 0 ? "ok" : "failed") << endl;
+	return failed == 0 ? 0 : 1;
+}
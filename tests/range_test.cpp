@@ -0,0 +1,156 @@
+//"range" of the parallel download on the loopback: the server runs in this process, the ranges out of
+//the file (reversed, negative, past the end, not numbers) are refused, the valid ones are downloaded;
+//the parallel upload larger than the disk is refused
+//
+//range_test [port]
+
+#include "../Includes.h"
+#include "../server.h"
+
+//[A-Za-z0-9]+.[A-Za-z0-9]+ as the commands take it
+static const char* SourceName = "rangesource.bin";
+static const char* CopyName = "rangecopy.bin";
+static const long long SourceLength = 100000;
+
+class RangeClient : public Connection
+{//the command connection and the streams of the parallel download
+	string _port;
+	unique_ptr<Socket> _tcp;
+public:
+	explicit RangeClient(const string& port) : Connection(1024, 30), _port(port)
+	{
+		_tcp.reset(new ClientSocket((char*)"127.0.0.1", (char*)_port.c_str()));
+		_tcp->send(_id);
+	}
+
+	string command(const string& line)
+	{
+		string message = line;
+		_tcp->sendMessage(message);
+		return _tcp->receiveMessage();
+	}
+
+	bool download(const string& fileName, const string& localName, const vector<long long>& bounds)
+	{//the ranges one by one, each over its own connection (as receiveFileParallel() has them) into the local file
+		if (!prepareFile(localName, bounds.back()))
+			return false;
+		std::function<Socket*(int)> noReconnect = [](int) -> Socket* { return nullptr; };
+		for (size_t i = 0; i + 1 < bounds.size(); i++)
+		{
+			unique_ptr<Socket> socket(new ClientSocket((char*)"127.0.0.1", (char*)_port.c_str()));
+			int streamId = _id + 1 + (int)i;
+			socket->send(streamId);
+			string message = "range " + fileName + " " + toString(bounds[i]) + " " + toString(bounds[i + 1]);
+			socket->sendMessage(message);
+			FileWorker fileWorker(socket.get(), noReconnect, _bufLen, _timeOut);
+			fileWorker.useRange(bounds[i], bounds[i + 1] - bounds[i]);
+			string name = localName;
+			if (!fileWorker.receive(name) || !socket->sendConfirm() ||
+				!CommandParser::contains(socket->receiveMessage(), "downloaded"))
+				return false;
+		}
+		return true;
+	}
+
+private:
+	void fillCommandMap() override {}
+};
+
+static string startServer(int port)
+{//the worker never stops (the process ends with _Exit)
+	string service = toString(port);
+	std::thread([service]()
+	{
+		try
+		{
+			WorkerGroup* group = new WorkerGroup();
+			Server* server = new Server((char*)"127.0.0.1", (char*)service.c_str(), *group);
+			server->workWithClients();
+		}
+		catch (exception& e)
+		{
+			cerr << "server " << service << ": " << e.what() << endl;
+		}
+	}).detach();
+	//ready when it accepts
+	for (int attempt = 0; attempt < 100; attempt++)
+	{
+		try
+		{
+			ClientSocket probe((char*)"127.0.0.1", (char*)service.c_str());
+			return service;
+		}
+		catch (exception&)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	}
+	throw runtime_error("server " + service + " doesn't start");
+}
+
+static bool sameBytes(const string& first, const string& second)
+{
+	std::ifstream a(first, ios::in | ios::binary), b(second, ios::in | ios::binary);
+	std::istreambuf_iterator<char> end;
+	return a.is_open() && b.is_open() && std::equal(std::istreambuf_iterator<char>(a), end, std::istreambuf_iterator<char>(b));
+}
+
+int main(int argc, char** argv)
+{
+	int port = (argc > 1) ? atoi(argv[1]) : 17300;
+	Socket::initializeWinsock_();
+	{
+		std::ofstream file(SourceName, ios::out | ios::trunc | ios::binary);
+		for (long long i = 0; i < SourceLength; i++)
+			file.put((char)(i * 7));
+	}
+	//the transfers report their progress to cout
+	std::streambuf* console = cout.rdbuf(nullptr);
+
+	int failed = 0;
+	try
+	{
+		string service = startServer(port);
+		RangeClient client(service);
+		string source = SourceName;
+		const char* refused[] = { "600 400", "-5 100", "0 100001", "100", "a b", "" };
+		for (const char* range : refused)
+		{
+			string reply = client.command("range " + source + " " + range);
+			if (!CommandParser::contains(reply, "fail to download the file"))
+			{
+				cerr << "range " << range << ": " << reply << endl;
+				failed++;
+			}
+		}
+		//the parallel upload of the file larger than the disk
+		const char* oversized[] = { "4611686018427387904", "9223372036854775807" };
+		for (const char* length : oversized)
+		{
+			string reply = client.command("pupload " + source + " " + length);
+			if (!CommandParser::contains(reply, "fail to upload the file"))
+			{
+				cerr << "pupload " << length << ": " << reply << endl;
+				failed++;
+			}
+		}
+		vector<long long> bounds = { 0, 1, 40000, 40000, SourceLength };
+		if (!client.download(source, CopyName, bounds) || !sameBytes(SourceName, CopyName))
+		{
+			cerr << "ranges of the file are not downloaded" << endl;
+			failed++;
+		}
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << endl;
+		failed++;
+	}
+
+	cout.rdbuf(console);
+	std::remove(SourceName);
+	std::remove(CopyName);
+	cerr << (failed == 0 ? "ok" : "failed") << endl;
+	//the server is still running
+	std::_Exit(failed == 0 ? 0 : 1);
+}